@@ -0,0 +1,72 @@
+//
+//  CBCanonicalJSON+Private.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBCanonicalJSON.h"
+
+
+#define kCBCanonicalJSONBufferSize 4096
+
+
+/** Which bytes CBCanonicalJSONScan stops at. */
+typedef enum {
+    kCBJSONScanQuotes,                  // '"' (the characters escaped by version 1)
+    kCBJSONScanEscapes,                 // '"', '\' and control characters (escaped by version 2)
+    kCBJSONScanEscapesAndNonASCII       // all of the above, plus bytes >= 0x80
+} CBJSONScanMode;
+
+/** Returns a pointer to the first byte in [pos, end) matching the mode, or end if none does.
+    Uses SSE2 or NEON to check 16 bytes at a time. */
+const uint8_t* CBCanonicalJSONScan(const uint8_t* pos, const uint8_t* end, CBJSONScanMode mode);
+
+
+@interface CBCanonicalJSON ()
+{
+    @package
+    id _input;
+    NSData* _jsonData;
+    NSArray* _ignoreKeyPrefixes;
+    NSArray* _whitelistedKeys;
+    NSSet* _whitelistedKeySet;
+    uint8_t _prefixFirstChars[32];              // bitmap of ignored prefixes' first chars & 0xFF
+    NSData* _canonicalData;
+    NSMutableDictionary* _ignoredValueRanges;   // key -> NSValue(NSRange) in _jsonData
+    CBCanonicalJSONOutput _output;
+    uint8_t _buffer[kCBCanonicalJSONBufferSize];
+    size_t _bufferLength;
+    CBCanonicalJSONVersion _version;
+    BOOL _invalid;
+    int _depth;
+}
+
+// Output primitives, implemented in CBCanonicalJSON.m:
+- (void) flush;
+- (void) appendBytes: (const void*)bytes length: (size_t)length;
+- (void) appendChar: (char)c;
+- (void) appendCharactersOf: (NSString*)string range: (NSRange)range;
+- (void) appendEscapedUTF8: (const void*)bytes length: (size_t)length;
+- (void) appendDouble: (double)d;
+
+/** Returns YES if a top-level dictionary key is left out by the ignoreKeyPrefixes rule. */
+- (BOOL) ignoreTopLevelKey: (NSString*)key;
+
+/** Like -writeTo:, but encodes the given object instead of the input, with the same settings.
+    (The ignoreKeyPrefixes rule applies to the object's top level.) */
+- (BOOL) writeObject: (id)object to: (CBCanonicalJSONOutput)output;
+
+@end
+
+
+@interface CBCanonicalJSON (Raw)
+/** Encodes _jsonData directly from its bytes; implemented in CBCanonicalJSON+Raw.m. */
+- (void) encodeJSONData;
+
+/** Finds the top-level values of _jsonData that -ignoredTopLevelValue: returns, without encoding
+    anything; nested values are skipped over, not checked. Returns NO if the data's structure is
+    invalid at the top level. */
+- (BOOL) scanIgnoredTopLevelValues;
+@end
@@ -0,0 +1,638 @@
+//
+//  CBCanonicalJSON+Raw.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBCanonicalJSON+Private.h"
+#import "CBJSONDouble.h"
+#import <xlocale.h>
+
+
+/*
+ Canonicalizes JSON data in a single pass over its bytes, without creating an object per value.
+ The output has to be identical to what the object-tree encoder produces from the result of
+ NSJSONSerialization, so:
+    - Strings are decoded (escapes and all) and then re-escaped as the version requires.
+    - Integers are normalized the way NSNumber formats them. Other numbers are parsed as doubles
+      and formatted like the object encoder formats an NSNumber of type double.
+    - Dictionary keys are sorted in UTF-16 order, which is what NSLiteralSearch compares.
+    - Top-level keys are filtered by the ignoreKeyPrefixes and whitelistedKeys rules.
+
+ Sorting a dictionary's keys means its members can't be written until all of them have been seen.
+ So each dictionary is first scanned to find its keys (decoded into a scratch buffer) and the
+ offsets of their values, which are skipped over; then the values are encoded in key order.
+ The scratch buffer and member array are stacks shared by all nesting levels, so their size is
+ bounded by the largest set of dictionaries open at once, not by the size of the document.
+ */
+
+
+#define kMaxDepth 512
+
+#define isDigit(C)      ((C) >= '0' && (C) <= '9')
+#define isWhitespace(C) ((C) == ' ' || (C) == '\n' || (C) == '\r' || (C) == '\t')
+
+
+typedef struct {
+    size_t keyOffset, keyLength;    // location of the decoded key in the scratch buffer
+    size_t valueOffset;             // offset of the value in the input
+    size_t index;                   // order in the input, to keep the sort stable
+} Member;
+
+typedef struct {
+    __unsafe_unretained CBCanonicalJSON* encoder;
+    __unsafe_unretained NSArray* ignorePrefixes;    // UTF-8 NSData objects
+    __unsafe_unretained NSArray* whitelist;         // UTF-8 NSData objects
+    const uint8_t *start, *pos, *end;
+    Member* members;
+    size_t membersCount, membersCapacity;
+    uint8_t* scratch;
+    size_t scratchLength, scratchCapacity;
+} Parser;
+
+
+static BOOL emitValue(Parser* p, int depth);
+static BOOL scanNumber(Parser* p, BOOL* outInteger);
+static BOOL scanLiteral(Parser* p, const char* literal);
+
+
+static inline void skipWhitespace(Parser* p) {
+    while (p->pos < p->end && isWhitespace(*p->pos))
+        ++p->pos;
+}
+
+
+static inline BOOL expect(Parser* p, uint8_t c) {
+    if (p->pos >= p->end || *p->pos != c)
+        return NO;
+    ++p->pos;
+    return YES;
+}
+
+
+static void appendToScratch(Parser* p, const void* bytes, size_t length) {
+    if (p->scratchLength + length > p->scratchCapacity) {
+        p->scratchCapacity = MAX(2 * p->scratchCapacity, p->scratchLength + length + 256);
+        p->scratch = reallocf(p->scratch, p->scratchCapacity);
+        if (!p->scratch)
+            [NSException raise: NSMallocException format: @"Out of memory"];
+    }
+    memcpy(p->scratch + p->scratchLength, bytes, length);
+    p->scratchLength += length;
+}
+
+
+// Copies a run of string contents from the input, which never needs escaping.
+static inline void put(Parser* p, const void* bytes, size_t length, BOOL toScratch) {
+    if (length == 0)
+        return;
+    if (toScratch)
+        appendToScratch(p, bytes, length);
+    else
+        [p->encoder appendBytes: bytes length: length];
+}
+
+
+// Returns the length of the valid UTF-8 multi-byte sequence at s, or 0 if it's invalid.
+static size_t utf8SequenceLength(const uint8_t* s, const uint8_t* end) {
+    uint8_t c = s[0];
+    size_t n;
+    uint32_t cp, min;
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2; cp = c & 0x1F; min = 0x80;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3; cp = c & 0x0F; min = 0x800;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4; cp = c & 0x07; min = 0x10000;
+    } else {
+        return 0;
+    }
+    if ((size_t)(end - s) < n)
+        return 0;
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        return 0;
+    return n;
+}
+
+
+static int parseHex4(Parser* p) {
+    if (p->end - p->pos < 4)
+        return -1;
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        uint8_t c = *p->pos++;
+        int digit;
+        if (isDigit(c))
+            digit = c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            digit = (c | 0x20) - 'a' + 10;
+        else
+            return -1;
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+
+// Decodes the escape sequence following a backslash.
+static BOOL parseEscape(Parser* p, BOOL toScratch) {
+    if (p->pos >= p->end)
+        return NO;
+    uint32_t cp;
+    switch (*p->pos++) {
+        case '"':   cp = '"'; break;
+        case '\\':  cp = '\\'; break;
+        case '/':   cp = '/'; break;
+        case 'b':   cp = '\b'; break;
+        case 'f':   cp = '\f'; break;
+        case 'n':   cp = '\n'; break;
+        case 'r':   cp = '\r'; break;
+        case 't':   cp = '\t'; break;
+        case 'u': {
+            int u = parseHex4(p);
+            if (u < 0 || (u >= 0xDC00 && u <= 0xDFFF))
+                return NO;
+            cp = u;
+            if (u >= 0xD800 && u <= 0xDBFF) {
+                // Surrogate pair; an unpaired one can't be represented in UTF-8:
+                if (!expect(p, '\\') || !expect(p, 'u'))
+                    return NO;
+                int low = parseHex4(p);
+                if (low < 0xDC00 || low > 0xDFFF)
+                    return NO;
+                cp = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+            }
+            break;
+        }
+        default:
+            return NO;
+    }
+
+    uint8_t utf8[4];
+    size_t n;
+    if (cp < 0x80) {
+        utf8[0] = (uint8_t)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        utf8[0] = (uint8_t)(0xC0 | (cp >> 6));
+        utf8[1] = (uint8_t)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else if (cp < 0x10000) {
+        utf8[0] = (uint8_t)(0xE0 | (cp >> 12));
+        utf8[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+        utf8[2] = (uint8_t)(0x80 | (cp & 0x3F));
+        n = 3;
+    } else {
+        utf8[0] = (uint8_t)(0xF0 | (cp >> 18));
+        utf8[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+        utf8[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+        utf8[3] = (uint8_t)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    if (toScratch)
+        appendToScratch(p, utf8, n);
+    else
+        [p->encoder appendEscapedUTF8: utf8 length: n];
+    return YES;
+}
+
+
+// Parses a string, starting just after its opening quote. The decoded UTF-8 is appended to the
+// scratch buffer as-is, or else written to the output, escaped.
+static BOOL parseString(Parser* p, BOOL toScratch) {
+    const uint8_t* run = p->pos;
+    for (;;) {
+        // Skip ahead to the next byte that isn't plain ASCII; runs of those need no escaping:
+        p->pos = CBCanonicalJSONScan(p->pos, p->end, kCBJSONScanEscapesAndNonASCII);
+        if (p->pos >= p->end)
+            return NO;
+        uint8_t c = *p->pos;
+        if (c == '"' || c == '\\') {
+            put(p, run, p->pos - run, toScratch);
+            ++p->pos;
+            if (c == '"')
+                return YES;
+            if (!parseEscape(p, toScratch))
+                return NO;
+            run = p->pos;
+        } else if (c < 0x20) {
+            return NO;
+        } else {
+            size_t n = utf8SequenceLength(p->pos, p->end);
+            if (n == 0)
+                return NO;
+            p->pos += n;
+        }
+    }
+}
+
+
+// Writes a decoded string from the scratch buffer to the output, escaped.
+static void emitKey(Parser* p, const Member* m) {
+    [p->encoder appendChar: '"'];
+    [p->encoder appendEscapedUTF8: p->scratch + m->keyOffset length: m->keyLength];
+    [p->encoder appendChar: '"'];
+}
+
+
+// Compares UTF-8 strings in UTF-16 code-unit order, which is what NSLiteralSearch uses.
+// That's the same as byte order, except that U+E000..U+FFFF (lead bytes EE, EF) sort after
+// supplementary characters (lead bytes F0..F4), since the latter's surrogates are D800..DFFF.
+static int compareKeys(const uint8_t* a, size_t aLength, const uint8_t* b, size_t bLength) {
+    size_t n = MIN(aLength, bLength);
+    for (size_t i = 0; i < n; i++) {
+        int ca = a[i], cb = b[i];
+        if (ca != cb) {
+            if (ca == 0xEE || ca == 0xEF)
+                ca += 0x10;
+            if (cb == 0xEE || cb == 0xEF)
+                cb += 0x10;
+            return ca - cb;
+        }
+    }
+    return (aLength > bLength) - (aLength < bLength);
+}
+
+
+static BOOL isIgnoredKey(Parser* p, size_t keyOffset, size_t keyLength) {
+    const uint8_t* key = p->scratch + keyOffset;
+    for (NSData* prefix in p->ignorePrefixes) {
+        if (keyLength >= prefix.length && memcmp(key, prefix.bytes, prefix.length) == 0) {
+            for (NSData* whitelisted in p->whitelist)
+                if (keyLength == whitelisted.length && memcmp(key, whitelisted.bytes, keyLength) == 0)
+                    return NO;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+
+// Skips over a value without encoding it, but checking its syntax just as strictly, so that
+// ignored values can't hide malformed JSON. (A string is decoded into the scratch buffer, then
+// discarded; that's the simplest way to check its escapes and UTF-8.)
+static BOOL skipValue(Parser* p, int depth) {
+    if (p->pos >= p->end || depth > kMaxDepth)
+        return NO;
+    switch (*p->pos) {
+        case '"': {
+            ++p->pos;
+            size_t scratchBase = p->scratchLength;
+            BOOL ok = parseString(p, YES);
+            p->scratchLength = scratchBase;
+            return ok;
+        }
+        case '{':
+        case '[': {
+            BOOL isObject = (*p->pos == '{');
+            uint8_t close = isObject ? '}' : ']';
+            ++p->pos;
+            skipWhitespace(p);
+            if (expect(p, close))
+                return YES;
+            for (;;) {
+                if (isObject) {
+                    if (p->pos >= p->end || *p->pos != '"' || !skipValue(p, depth + 1))
+                        return NO;
+                    skipWhitespace(p);
+                    if (!expect(p, ':'))
+                        return NO;
+                    skipWhitespace(p);
+                }
+                if (!skipValue(p, depth + 1))
+                    return NO;
+                skipWhitespace(p);
+                if (expect(p, close))
+                    return YES;
+                if (!expect(p, ','))
+                    return NO;
+                skipWhitespace(p);
+            }
+        }
+        case 't':
+            return scanLiteral(p, "true");
+        case 'f':
+            return scanLiteral(p, "false");
+        case 'n':
+            return scanLiteral(p, "null");
+        default:
+            return scanNumber(p, NULL);
+    }
+}
+
+
+// Finds the members of the dictionary at p->pos and their keys, pushing them onto p->members, and
+// leaves p->pos after the dictionary. At the top level, the ranges of ignored members' values are
+// recorded in the encoder's _ignoredValueRanges instead.
+static BOOL scanObject(Parser* p, int depth) {
+    ++p->pos;
+    skipWhitespace(p);
+    if (!expect(p, '}')) {
+        for (;;) {
+            if (!expect(p, '"'))
+                return NO;
+            size_t keyOffset = p->scratchLength;
+            if (!parseString(p, YES))
+                return NO;
+            size_t keyLength = p->scratchLength - keyOffset;
+            skipWhitespace(p);
+            if (!expect(p, ':'))
+                return NO;
+            skipWhitespace(p);
+            const uint8_t* value = p->pos;
+            if (!skipValue(p, depth + 1))
+                return NO;
+
+            if (depth == 1 && isIgnoredKey(p, keyOffset, keyLength)) {
+                NSString* key = [[NSString alloc] initWithBytes: p->scratch + keyOffset
+                                                         length: keyLength
+                                                       encoding: NSUTF8StringEncoding];
+                NSRange range = NSMakeRange(value - p->start, p->pos - value);
+                p->encoder->_ignoredValueRanges[key] = [NSValue valueWithRange: range];
+                p->scratchLength = keyOffset;
+            } else {
+                if (p->membersCount == p->membersCapacity) {
+                    p->membersCapacity = MAX(2 * p->membersCapacity, 32);
+                    p->members = reallocf(p->members, p->membersCapacity * sizeof(Member));
+                    if (!p->members)
+                        [NSException raise: NSMallocException format: @"Out of memory"];
+                }
+                p->members[p->membersCount] = (Member){keyOffset, keyLength,
+                                                       value - p->start, p->membersCount};
+                ++p->membersCount;
+            }
+
+            skipWhitespace(p);
+            if (expect(p, '}'))
+                break;
+            if (!expect(p, ','))
+                return NO;
+            skipWhitespace(p);
+        }
+    }
+    return YES;
+}
+
+
+static BOOL emitObject(Parser* p, int depth) {
+    size_t base = p->membersCount, scratchBase = p->scratchLength;
+
+    // First find all the members and their keys:
+    if (!scanObject(p, depth))
+        return NO;
+    const uint8_t* objectEnd = p->pos;
+    size_t count = p->membersCount;
+
+    // Sort them by key:
+    const uint8_t* scratch = p->scratch;
+    qsort_b(&p->members[base], count - base, sizeof(Member), ^int(const void* a, const void* b) {
+        const Member *ma = a, *mb = b;
+        int cmp = compareKeys(scratch + ma->keyOffset, ma->keyLength,
+                              scratch + mb->keyOffset, mb->keyLength);
+        if (cmp == 0)
+            cmp = (ma->index > mb->index) - (ma->index < mb->index);
+        return cmp;
+    });
+
+    // Then write them in order. (The arrays may be reallocated by nested dictionaries, so don't
+    // hang onto pointers into them.)
+    [p->encoder appendChar: '{'];
+    BOOL first = YES;
+    for (size_t i = base; i < count; i++) {
+        Member m = p->members[i];
+        if (i + 1 < count) {
+            const Member* next = &p->members[i + 1];
+            if (next->keyLength == m.keyLength
+                    && memcmp(p->scratch + next->keyOffset, p->scratch + m.keyOffset,
+                              m.keyLength) == 0)
+                continue;       // Duplicate key; the last one wins
+        }
+        if (first)
+            first = NO;
+        else
+            [p->encoder appendChar: ','];
+        emitKey(p, &m);
+        [p->encoder appendChar: ':'];
+        p->pos = p->start + m.valueOffset;
+        if (!emitValue(p, depth + 1))
+            return NO;
+    }
+    [p->encoder appendChar: '}'];
+
+    p->pos = objectEnd;
+    p->membersCount = base;
+    p->scratchLength = scratchBase;
+    return YES;
+}
+
+
+static BOOL emitArray(Parser* p, int depth) {
+    ++p->pos;
+    [p->encoder appendChar: '['];
+    skipWhitespace(p);
+    if (!expect(p, ']')) {
+        for (;;) {
+            if (!emitValue(p, depth + 1))
+                return NO;
+            skipWhitespace(p);
+            if (expect(p, ']'))
+                break;
+            if (!expect(p, ','))
+                return NO;
+            [p->encoder appendChar: ','];
+            skipWhitespace(p);
+        }
+    }
+    [p->encoder appendChar: ']'];
+    return YES;
+}
+
+
+// Skips over a number, checking its syntax. Sets *outInteger if it has no fraction or exponent.
+static BOOL scanNumber(Parser* p, BOOL* outInteger) {
+    const uint8_t* pos = p->pos, *end = p->end;
+    BOOL integer = YES;
+    if (pos < end && *pos == '-')
+        ++pos;
+    if (pos >= end || !isDigit(*pos))
+        return NO;
+    if (*pos == '0')
+        ++pos;
+    else
+        while (pos < end && isDigit(*pos))
+            ++pos;
+    if (pos < end && *pos == '.') {
+        integer = NO;
+        if (++pos >= end || !isDigit(*pos))
+            return NO;
+        while (pos < end && isDigit(*pos))
+            ++pos;
+    }
+    if (pos < end && (*pos | 0x20) == 'e') {
+        integer = NO;
+        if (++pos < end && (*pos == '+' || *pos == '-'))
+            ++pos;
+        if (pos >= end || !isDigit(*pos))
+            return NO;
+        while (pos < end && isDigit(*pos))
+            ++pos;
+    }
+    p->pos = pos;
+    if (outInteger)
+        *outInteger = integer;
+    return YES;
+}
+
+
+static BOOL emitNumber(Parser* p) {
+    const uint8_t* start = p->pos;
+    BOOL integer;
+    if (!scanNumber(p, &integer))
+        return NO;
+
+    // JSON doesn't allow leading zeroes, so an integer that fits in an int64 is already in
+    // canonical form, except for "-0":
+    size_t length = p->pos - start;
+    if (integer && length <= 18) {
+        if (length == 2 && start[0] == '-' && start[1] == '0')
+            [p->encoder appendChar: '0'];
+        else
+            [p->encoder appendBytes: start length: length];
+        return YES;
+    }
+
+    char stackBuf[64];
+    char* str = (length < sizeof(stackBuf)) ? stackBuf : malloc(length + 1);
+    if (!str)
+        [NSException raise: NSMallocException format: @"Out of memory"];
+    memcpy(str, start, length);
+    str[length] = '\0';
+
+    // Larger integers are formatted the way NSNumber would, as in -encodeNumber:
+    char out[32];
+    size_t outLength = 0;
+    if (integer) {
+        errno = 0;
+        long long n = strtoll_l(str, NULL, 10, NULL);
+        if (errno == 0) {
+            outLength = CBJSONFormatInteger(n, out);
+        } else if (str[0] != '-') {
+            errno = 0;
+            unsigned long long u = strtoull_l(str, NULL, 10, NULL);
+            if (errno == 0)
+                outLength = CBJSONFormatUnsigned(u, out);
+        }
+    }
+    if (outLength > 0)
+        [p->encoder appendBytes: out length: outLength];
+    else
+        [p->encoder appendDouble: strtod_l(str, NULL, NULL)];   // (NULL means the C locale)
+    if (str != stackBuf)
+        free(str);
+    return YES;
+}
+
+
+static BOOL scanLiteral(Parser* p, const char* literal) {
+    size_t length = strlen(literal);
+    if ((size_t)(p->end - p->pos) < length || memcmp(p->pos, literal, length) != 0)
+        return NO;
+    p->pos += length;
+    return YES;
+}
+
+
+static BOOL emitLiteral(Parser* p, const char* literal) {
+    if (!scanLiteral(p, literal))
+        return NO;
+    [p->encoder appendBytes: literal length: strlen(literal)];
+    return YES;
+}
+
+
+static BOOL emitValue(Parser* p, int depth) {
+    if (p->pos >= p->end || depth > kMaxDepth)
+        return NO;
+    switch (*p->pos) {
+        case '"':
+            ++p->pos;
+            [p->encoder appendChar: '"'];
+            if (!parseString(p, NO))
+                return NO;
+            [p->encoder appendChar: '"'];
+            return YES;
+        case '{':
+            return emitObject(p, depth);
+        case '[':
+            return emitArray(p, depth);
+        case 't':
+            return emitLiteral(p, "true");
+        case 'f':
+            return emitLiteral(p, "false");
+        case 'n':
+            return emitLiteral(p, "null");
+        default:
+            return emitNumber(p);
+    }
+}
+
+
+static NSArray* utf8Strings(NSArray* strings) {
+    NSMutableArray* result = [NSMutableArray arrayWithCapacity: strings.count];
+    for (NSString* str in strings)
+        [result addObject: [str dataUsingEncoding: NSUTF8StringEncoding]];
+    return result;
+}
+
+
+@implementation CBCanonicalJSON (Raw)
+
+// Parses _jsonData, calling `parse` on the root value, and checks that nothing follows it.
+- (BOOL) parseJSONData: (BOOL(^)(Parser*))parse {
+    _ignoredValueRanges = [[NSMutableDictionary alloc] init];
+    NSArray* ignorePrefixes = utf8Strings(_ignoreKeyPrefixes);
+    NSArray* whitelist = utf8Strings(_whitelistedKeys);
+    Parser p = {
+        .encoder = self,
+        .ignorePrefixes = ignorePrefixes,
+        .whitelist = whitelist,
+        .start = _jsonData.bytes,
+        .pos = _jsonData.bytes,
+        .end = (const uint8_t*)_jsonData.bytes + _jsonData.length,
+    };
+    BOOL ok;
+    @try {
+        skipWhitespace(&p);
+        ok = parse(&p);
+        if (ok) {
+            skipWhitespace(&p);
+            ok = (p.pos == p.end);
+        }
+    } @finally {
+        free(p.members);
+        free(p.scratch);
+    }
+    return ok;
+}
+
+- (void) encodeJSONData {
+    if (![self parseJSONData: ^BOOL(Parser* p) { return emitValue(p, 1); }])
+        _invalid = YES;
+}
+
+- (BOOL) scanIgnoredTopLevelValues {
+    return [self parseJSONData: ^BOOL(Parser* p) {
+        if (p->pos < p->end && *p->pos == '{')
+            return scanObject(p, 1);
+        return skipValue(p, 1);
+    }];
+}
+
+@end
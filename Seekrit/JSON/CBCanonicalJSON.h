@@ -8,12 +8,40 @@
 
 #import <Foundation/Foundation.h>
 
+
+/** A block that receives canonical JSON output, as UTF-8 bytes, in chunks as it's generated. */
+typedef void (^CBCanonicalJSONOutput)(const void* bytes, size_t length);
+
+
+/** Versions of the canonical form. They differ in how strings are escaped and how non-integer
+    numbers are formatted. */
+typedef enum {
+    /** The original form. Only '"' is escaped, so strings containing backslashes or control
+        characters don't produce valid JSON. Non-integers are formatted by -[NSNumber stringValue],
+        which can vary between platforms. */
+    kCBCanonicalJSONVersion1 = 1,
+    /** Full escaping. '"' and '\' are escaped with a backslash. Control characters (U+0000 to
+        U+001F) are written as \b, \f, \n, \r or \t, or else as \u00xx with lowercase hex
+        digits. Nothing else is escaped; all other characters, including '/', U+007F and
+        non-ASCII characters, are written as literal UTF-8.
+        Integers are written in decimal. Other numbers are written as the shortest decimal that
+        parses back to the same double, laid out like ECMAScript's Number.prototype.toString
+        (e.g. "0.1", "1.5e-7", "1e+21"); NaN and infinity can't be encoded. */
+    kCBCanonicalJSONVersion2 = 2
+} CBCanonicalJSONVersion;
+
+
 /** Generates a canonical JSON form of an object tree, suitable for signing.
     See algorithm at <http://wiki.apache.org/couchdb/SignedDocuments>. */
 @interface CBCanonicalJSON : NSObject
 
 - (id) initWithObject: (id)object;
 
+/** Initializes an instance that canonicalizes JSON data directly from its bytes, without parsing
+    it into an object tree. The output is the same as from the object parsed by
+    NSJSONSerialization. (If a dictionary has duplicate keys, the last value is used.) */
+- (id) initWithJSONData: (NSData*)jsonData;
+
 /** If non-nil, dictionary keys beginning with these prefixes will be ignored.
     Defaults to @"_" and @"(", appropriate for canonicalizing Couch-type documents, to skip the metadata keys like "_rev" and signing-related keys like "(signed)". */
 @property (nonatomic, copy) NSArray* ignoreKeyPrefixes;
@@ -22,6 +50,10 @@
     Defaults to [@"_id"], appropriate for canonicalizing CBLDB documents. */
 @property (nonatomic, copy) NSArray* whitelistedKeys;
 
+/** The version of the canonical form to generate. Defaults to kCBCanonicalJSONVersion1, for
+    compatibility with existing signatures. */
+@property (nonatomic) CBCanonicalJSONVersion version;
+
 /** Canonical JSON string from the input object tree.
     This isn't directly useful for tasks like signing or generating digests; you probably want to use .canonicalData instead for that. */
 @property (readonly) NSString* canonicalString;
@@ -29,6 +61,18 @@
 /** Canonical form of UTF-8 encoded JSON data from the input object tree. */
 @property (readonly) NSData* canonicalData;
 
+/** Generates the canonical UTF-8 encoded JSON, passing it to the output block a chunk at a time.
+    This is useful for feeding it directly into a digest, without buffering all of it in memory.
+    Returns NO if a string in the input can't be encoded as UTF-8 (i.e. has unpaired surrogates),
+    or if the input JSON data is invalid; in that case the output is incomplete, and canonicalData
+    would have returned nil. */
+- (BOOL) writeTo: (CBCanonicalJSONOutput)output;
+
+/** When encoding JSON data, returns the value of a top-level dictionary key that was left out of
+    the canonical form by the ignoreKeyPrefixes rule, e.g. the "(signed)" property.
+    Only valid after the data has been encoded. */
+- (id) ignoredTopLevelValue: (NSString*)key;
+
 
 /** Convenience method that instantiates a CanonicalJSON object and uses it to encode the object. */
 + (NSData*) canonicalData: (id)rootObject;
@@ -6,18 +6,69 @@
 //  Copyright (c) 2011 Couchbase, Inc. All rights reserved.
 //
 
-#import "CBCanonicalJSON.h"
+#import "CBCanonicalJSON+Private.h"
+#import "CBJSONDouble.h"
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#endif
+
+
+#define kBufferSize kCBCanonicalJSONBufferSize
+
+
+const uint8_t* CBCanonicalJSONScan(const uint8_t* pos, const uint8_t* end, CBJSONScanMode mode) {
+    // Check 16 bytes at a time with SIMD instructions where available:
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+    const __m128i maxControl = _mm_set1_epi8(0x1F);
+    while (end - pos >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)pos);
+        __m128i found = _mm_cmpeq_epi8(v, quote);
+        if (mode >= kCBJSONScanEscapes) {
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(v, backslash));
+            // (unsigned) v <= 0x1F  <==>  min(v, 0x1F) == v
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(_mm_min_epu8(v, maxControl), v));
+        }
+        int mask = _mm_movemask_epi8(found);
+        if (mode == kCBJSONScanEscapesAndNonASCII)
+            mask |= _mm_movemask_epi8(v);       // high bit of each byte
+        if (mask)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t quote = vdupq_n_u8('"'), backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(0x20), nonASCII = vdupq_n_u8(0x80);
+    while (end - pos >= 16) {
+        uint8x16_t v = vld1q_u8(pos);
+        uint8x16_t found = vceqq_u8(v, quote);
+        if (mode >= kCBJSONScanEscapes) {
+            found = vorrq_u8(found, vceqq_u8(v, backslash));
+            found = vorrq_u8(found, vcltq_u8(v, space));
+        }
+        if (mode == kCBJSONScanEscapesAndNonASCII)
+            found = vorrq_u8(found, vcgeq_u8(v, nonASCII));
+        if (vmaxvq_u8(found))
+            break;          // the scalar loop below will find exactly where
+        pos += 16;
+    }
+#endif
+    for (; pos < end; ++pos) {
+        uint8_t c = *pos;
+        if (c == '"')
+            break;
+        if (mode >= kCBJSONScanEscapes && (c == '\\' || c < 0x20))
+            break;
+        if (mode == kCBJSONScanEscapesAndNonASCII && c >= 0x80)
+            break;
+    }
+    return pos;
+}
 
 
 @implementation CBCanonicalJSON
-{
-    @private
-    id _input;
-    NSArray* _ignoreKeyPrefixes;
-    NSArray* _whitelistedKeys;
-    NSMutableString* _output;
-    int _depth;
-}
 
 
 - (id) initWithObject: (id)object {
@@ -26,6 +77,16 @@
         _input = object;
         self.ignoreKeyPrefixes = @[@"_", @"("];
         self.whitelistedKeys = @[@"_id"];
+        _version = kCBCanonicalJSONVersion1;
+    }
+    return self;
+}
+
+
+- (id) initWithJSONData: (NSData*)jsonData {
+    self = [self initWithObject: nil];
+    if (self) {
+        _jsonData = [jsonData copy];
     }
     return self;
 }
@@ -34,96 +95,358 @@
 @synthesize ignoreKeyPrefixes=_ignoreKeyPrefixes, whitelistedKeys=_whitelistedKeys;
 
 
+- (void) setIgnoreKeyPrefixes: (NSArray*)prefixes {
+    _ignoreKeyPrefixes = [prefixes copy];
+    // Compile the prefixes into a bitmap of their first characters (hashed to 8 bits), so most
+    // keys can be accepted with a single lookup:
+    memset(_prefixFirstChars, 0, sizeof(_prefixFirstChars));
+    for (NSString* prefix in _ignoreKeyPrefixes) {
+        if (prefix.length > 0) {
+            uint8_t c = (uint8_t)[prefix characterAtIndex: 0];
+            _prefixFirstChars[c >> 3] |= (1 << (c & 7));
+        }
+    }
+    _canonicalData = nil;
+}
+
+- (void) setWhitelistedKeys: (NSArray*)keys {
+    _whitelistedKeys = [keys copy];
+    _whitelistedKeySet = [NSSet setWithArray: _whitelistedKeys];
+    _canonicalData = nil;
+}
+
+
+- (CBCanonicalJSONVersion) version {
+    return _version;
+}
+
+- (void) setVersion: (CBCanonicalJSONVersion)version {
+    NSParameterAssert(version == kCBCanonicalJSONVersion1 || version == kCBCanonicalJSONVersion2);
+    if (version != _version) {
+        _version = version;
+        _canonicalData = nil;
+    }
+}
+
+
+#pragma mark - OUTPUT:
+
+
+- (void) flush {
+    if (_bufferLength > 0) {
+        _output(_buffer, _bufferLength);
+        _bufferLength = 0;
+    }
+}
+
+
+- (void) appendBytes: (const void*)bytes length: (size_t)length {
+    if (_bufferLength + length > kBufferSize) {
+        [self flush];
+        if (length > kBufferSize) {
+            _output(bytes, length);
+            return;
+        }
+    }
+    memcpy(&_buffer[_bufferLength], bytes, length);
+    _bufferLength += length;
+}
+
+
+- (void) appendChar: (char)c {
+    if (_bufferLength == kBufferSize)
+        [self flush];
+    _buffer[_bufferLength++] = (uint8_t)c;
+}
+
+
+#define appendLiteral(STR)  [self appendBytes: (STR) length: sizeof(STR) - 1]
+
+
+// Transcodes a range of a string to UTF-8 directly into the buffer, without any temporary objects.
+- (void) appendCharactersOf: (NSString*)string range: (NSRange)range {
+    while (range.length > 0) {
+        NSUInteger used;
+        [string getBytes: &_buffer[_bufferLength] maxLength: kBufferSize - _bufferLength
+              usedLength: &used encoding: NSUTF8StringEncoding options: 0
+                   range: range remainingRange: &range];
+        _bufferLength += used;
+        if (range.length > 0) {
+            if (used == 0 && _bufferLength == 0) {
+                // Not even one character fits in an empty buffer, so it must be unencodable:
+                _invalid = YES;
+                return;
+            }
+            [self flush];
+        }
+    }
+}
+
+
+- (void) appendEscape: (uint8_t)c {
+    switch (c) {
+        case '"':   appendLiteral("\\\""); break;
+        case '\\':  appendLiteral("\\\\"); break;
+        case '\b':  appendLiteral("\\b"); break;
+        case '\f':  appendLiteral("\\f"); break;
+        case '\n':  appendLiteral("\\n"); break;
+        case '\r':  appendLiteral("\\r"); break;
+        case '\t':  appendLiteral("\\t"); break;
+        default: {
+            static const char kHex[16] = "0123456789abcdef";
+            char escape[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xF]};
+            [self appendBytes: escape length: sizeof(escape)];
+            break;
+        }
+    }
+}
+
+
+// Appends UTF-8 string contents, escaping characters as required by the current version.
+- (void) appendEscapedUTF8: (const void*)bytes length: (size_t)length {
+    const uint8_t* pos = bytes, *end = pos + length;
+    CBJSONScanMode mode = (_version >= kCBCanonicalJSONVersion2) ? kCBJSONScanEscapes
+                                                                 : kCBJSONScanQuotes;
+    while (pos < end) {
+        const uint8_t* special = CBCanonicalJSONScan(pos, end, mode);
+        [self appendBytes: pos length: special - pos];
+        if (special == end)
+            break;
+        [self appendEscape: *special];
+        pos = special + 1;
+    }
+}
+
+
+#pragma mark - ENCODING:
+
+
 - (void) encodeString: (NSString*)string {
-    [_output appendString: @"\""];
-    NSRange remainder = {0, string.length};
-    while (remainder.length > 0) {
-        NSRange quote = [string rangeOfString: @"\"" options: 0 range: remainder];
-        if (quote.length == 0)
-            quote.location = string.length;
-        NSUInteger nChars = quote.location - remainder.location;
-        [_output appendString: [string substringWithRange:
-                        NSMakeRange(remainder.location, nChars)]];
-        if (quote.length > 0) {
-            [_output appendString: @"\\\""];
-            ++nChars;
+    [self appendChar: '"'];
+    // Transcode a chunk at a time, then copy it to the output, escaping as needed:
+    uint8_t chunk[1024];
+    NSRange range = {0, string.length};
+    while (range.length > 0) {
+        NSUInteger used;
+        [string getBytes: chunk maxLength: sizeof(chunk) usedLength: &used
+                encoding: NSUTF8StringEncoding options: 0
+                   range: range remainingRange: &range];
+        if (used == 0) {
+            _invalid = YES;     // Unencodable character (unpaired surrogate)
+            break;
         }
-        remainder.location += nChars;
-        remainder.length -= nChars;
+        [self appendEscapedUTF8: chunk length: used];
+    }
+    [self appendChar: '"'];
+}
+
+
+- (void) appendDouble: (double)d {
+    if (_version >= kCBCanonicalJSONVersion2) {
+        char str[kCBJSONDoubleMaxLength + 1];
+        size_t len = CBJSONFormatDouble(d, str);
+        if (len == 0)
+            _invalid = YES;     // NaN or infinity
+        [self appendBytes: str length: len];
+    } else {
+        NSString* string = @(d).stringValue;
+        [self appendCharactersOf: string range: NSMakeRange(0, string.length)];
     }
-    [_output appendString: @"\""];
 }
 
 
 - (void) encodeNumber: (NSNumber*)number {
-    const char* encoding = number.objCType;
-    if (encoding[0] == 'c')
-        [_output appendString:[number boolValue] ? @"true" : @"false"];
-    else
-        [_output appendString:[number stringValue]];
+    // Integers are formatted the same way -stringValue would, but without creating a string:
+    char str[32];
+    size_t len;
+    switch (number.objCType[0]) {
+        case 'c':
+            if (number.boolValue)
+                appendLiteral("true");
+            else
+                appendLiteral("false");
+            return;
+        case 's': case 'i': case 'l': case 'q':
+            len = CBJSONFormatInteger(number.longLongValue, str);
+            break;
+        case 'S': case 'I': case 'L': case 'Q':
+            len = CBJSONFormatUnsigned(number.unsignedLongLongValue, str);
+            break;
+        default:
+            if (_version >= kCBCanonicalJSONVersion2) {
+                [self appendDouble: number.doubleValue];
+            } else {
+                NSString* string = number.stringValue;
+                [self appendCharactersOf: string range: NSMakeRange(0, string.length)];
+            }
+            return;
+    }
+    [self appendBytes: str length: len];
 }
 
 
 - (void) encodeArray: (NSArray*)array {
-    [_output appendString: @"["];
+    [self appendChar: '['];
     BOOL first = YES;
     for (id item in array) {
         if (first)
             first = NO;
         else
-            [_output appendString: @","];
+            [self appendChar: ','];
         [self encode: item];
     }
-    [_output appendString: @"]"];
+    [self appendChar: ']'];
+}
+
+
+// A dictionary entry, with a pointer to the key's UTF-16 characters for sorting.
+typedef struct {
+    const UniChar* chars;
+    CFIndex length;
+    __unsafe_unretained NSString* key;
+    __unsafe_unretained id value;
+} KeyView;
+
+
+// Compares keys by UTF-16 code units (the same as NSLiteralSearch), starting at index d.
+static int compareKeyViews(const KeyView* a, const KeyView* b, CFIndex d) {
+    CFIndex n = MIN(a->length, b->length);
+    for (; d < n; d++)
+        if (a->chars[d] != b->chars[d])
+            return (a->chars[d] < b->chars[d]) ? -1 : 1;
+    return (a->length > b->length) - (a->length < b->length);
 }
 
+static inline int charAt(const KeyView* k, CFIndex d) {
+    return (d < k->length) ? k->chars[d] : -1;
+}
+
+static inline void swapKeyViews(KeyView* a, size_t i, size_t j) {
+    KeyView temp = a[i];
+    a[i] = a[j];
+    a[j] = temp;
+}
 
-static NSComparisonResult compareCanonStrings( id s1, id s2, void *context) {
-    return [s1 compare: s2 options: NSLiteralSearch];
-    /* Alternate implementation in case NSLiteralSearch turns out to be inappropriate:
-    NSUInteger len1 = [s1 length], len2 = [s2 length];
-    unichar chars1[len1], chars2[len2];     //FIX: Will crash (stack overflow) on v. long strings
-    [s1 getCharacters: chars1 range: NSMakeRange(0, len1)];
-    [s2 getCharacters: chars2 range: NSMakeRange(0, len2)];
-    NSUInteger minLen = MIN(len1, len2);
-    for (NSUInteger i=0; i<minLen; i++) {
-        if (chars1[i] > chars2[i])
-            return 1;
-        else if (chars1[i] < chars2[i])
-            return -1;
+// Multikey quicksort (Bentley & Sedgewick), where all keys in `a` match in their first d
+// characters. It looks at each character about once, instead of re-comparing common prefixes
+// (like IDs with a shared prefix) in every comparison the way a comparison sort does.
+static void sortKeyViews(KeyView* a, size_t n, CFIndex d) {
+    while (n > 1) {
+        if (n < 8) {
+            for (size_t i = 1; i < n; i++)
+                for (size_t j = i; j > 0 && compareKeyViews(&a[j-1], &a[j], d) > 0; j--)
+                    swapKeyViews(a, j-1, j);
+            return;
+        }
+        // Three-way partition on the character at index d:
+        int pivot = charAt(&a[n / 2], d);
+        size_t lt = 0, i = 0, gt = n;
+        while (i < gt) {
+            int c = charAt(&a[i], d);
+            if (c < pivot)
+                swapKeyViews(a, lt++, i++);
+            else if (c > pivot)
+                swapKeyViews(a, i, --gt);
+            else
+                i++;
+        }
+        sortKeyViews(a, lt, d);
+        if (pivot >= 0)
+            sortKeyViews(a + lt, gt - lt, d + 1);
+        a += gt;
+        n -= gt;
     }
-    // All chars match, so the longer string wins
-    return (NSInteger)len1 - (NSInteger)len2;
-     */
 }
 
 
 - (BOOL) ignoreTopLevelKey: (NSString*)key {
+    if (key.length == 0)
+        return NO;
+    uint8_t c = (uint8_t)CFStringGetCharacterAtIndex((__bridge CFStringRef)key, 0);
+    if (!(_prefixFirstChars[c >> 3] & (1 << (c & 7))))
+        return NO;
     for (NSString* prefix in _ignoreKeyPrefixes)
         if ([key hasPrefix: prefix])
-            return ![_whitelistedKeys containsObject: key];
+            return ![_whitelistedKeySet containsObject: key];
     return NO;
 }
 
 
+#define kMaxStackKeys 16
+
 - (void) encodeDictionary: (NSDictionary*)dict {
-    [_output appendString: @"{"];
-    NSArray* keys = [[dict allKeys] sortedArrayUsingFunction:&compareCanonStrings context: NULL];
-    BOOL first = YES;
-    for (NSString* key in keys) {
+    NSUInteger count = dict.count;
+    KeyView stackViews[kMaxStackKeys];
+    __unsafe_unretained id stackObjects[2 * kMaxStackKeys];
+    KeyView* views = stackViews;
+    __unsafe_unretained id* objects = stackObjects;
+    if (count > kMaxStackKeys) {
+        views = malloc(count * sizeof(KeyView));
+        objects = (__unsafe_unretained id*)malloc(2 * count * sizeof(id));
+        if (!views || !objects) {
+            free(views);
+            free((void*)objects);
+            [NSException raise: NSMallocException format: @"Out of memory"];
+        }
+    }
+    __unsafe_unretained id* keys = objects + count;
+    [dict getObjects: objects andKeys: keys];
+
+    // Collect the keys that aren't ignored, with their characters. Most strings can provide a
+    // direct pointer to them; the rest are copied into a single block:
+    size_t n = 0;
+    CFIndex copiedLength = 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        NSString* key = keys[i];
         NSAssert([key isKindOfClass: [NSString class]], @"Can't encode %@ as dict key in JSON",
                  [key class]);
         if (_depth == 1 && [self ignoreTopLevelKey: key])
             continue;
-        if (first)
-            first = NO;
-        else
-            [_output appendString: @","];
-        [self encodeString: key];
-        [_output appendString: @":"];
-        [self encode: dict[key]];
+        CFStringRef cfKey = (__bridge CFStringRef)key;
+        const UniChar* chars = CFStringGetCharactersPtr(cfKey);
+        CFIndex length = CFStringGetLength(cfKey);
+        if (!chars)
+            copiedLength += length;
+        views[n++] = (KeyView){chars, length, key, objects[i]};
+    }
+    UniChar* copied = NULL;
+    if (copiedLength > 0) {
+        copied = malloc(copiedLength * sizeof(UniChar));
+        if (!copied) {
+            if (views != stackViews) {
+                free(views);
+                free((void*)objects);
+            }
+            [NSException raise: NSMallocException format: @"Out of memory"];
+        }
+        UniChar* next = copied;
+        for (size_t i = 0; i < n; i++) {
+            if (!views[i].chars) {
+                CFStringGetCharacters((__bridge CFStringRef)views[i].key,
+                                      CFRangeMake(0, views[i].length), next);
+                views[i].chars = next;
+                next += views[i].length;
+            }
+        }
+    }
+
+    sortKeyViews(views, n, 0);
+
+    [self appendChar: '{'];
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0)
+            [self appendChar: ','];
+        [self encodeString: views[i].key];
+        [self appendChar: ':'];
+        [self encode: views[i].value];
+    }
+    [self appendChar: '}'];
+
+    free(copied);
+    if (views != stackViews) {
+        free(views);
+        free((void*)objects);
     }
-    [_output appendString: @"}"];
 }
 
 
@@ -134,7 +457,7 @@ static NSComparisonResult compareCanonStrings( id s1, id s2, void *context) {
     } else if ([object isKindOfClass: [NSNumber class]]) {
         [self encodeNumber: object];
     } else if ([object isKindOfClass: [NSNull class]]) {
-        [_output appendString: @"null"];
+        appendLiteral("null");
     } else if ([object isKindOfClass: [NSDictionary class]]) {
         [self encodeDictionary: object];
     } else if ([object isKindOfClass: [NSArray class]]) {
@@ -146,23 +469,63 @@ static NSComparisonResult compareCanonStrings( id s1, id s2, void *context) {
 }
 
 
-- (void) encode {
-    if (!_output) {
-        _output = [[NSMutableString alloc] init];
+- (void) beginOutput: (CBCanonicalJSONOutput)output {
+    _output = output;
+    _bufferLength = 0;
+    _invalid = NO;
+    _depth = 0;
+}
+
+- (BOOL) endOutput {
+    [self flush];
+    _output = nil;
+    return !_invalid;
+}
+
+
+- (BOOL) writeTo: (CBCanonicalJSONOutput)output {
+    [self beginOutput: output];
+    if (_jsonData)
+        [self encodeJSONData];
+    else
         [self encode: _input];
+    return [self endOutput];
+}
+
+
+- (BOOL) writeObject: (id)object to: (CBCanonicalJSONOutput)output {
+    [self beginOutput: output];
+    [self encode: object];
+    return [self endOutput];
+}
+
+
+- (NSData*) canonicalData {
+    if (!_canonicalData) {
+        NSMutableData* data = [NSMutableData dataWithCapacity: kBufferSize];
+        if (![self writeTo: ^(const void* bytes, size_t length) {
+                [data appendBytes: bytes length: length];
+            }])
+            return nil;
+        _canonicalData = data;
     }
+    return _canonicalData;
 }
 
 
 - (NSString*) canonicalString {
-    [self encode];
-    return [_output copy];
+    NSData* data = self.canonicalData;
+    return data ? [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding] : nil;
 }
 
 
-- (NSData*) canonicalData {
-    [self encode];
-    return [_output dataUsingEncoding: NSUTF8StringEncoding];
+- (id) ignoredTopLevelValue: (NSString*)key {
+    NSValue* range = _ignoredValueRanges[key];
+    if (!range)
+        return nil;
+    return [NSJSONSerialization JSONObjectWithData: [_jsonData subdataWithRange: range.rangeValue]
+                                           options: NSJSONReadingAllowFragments
+                                             error: NULL];
 }
 
 
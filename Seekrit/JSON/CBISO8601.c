@@ -0,0 +1,132 @@
+//
+//  CBISO8601.c
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#include "CBISO8601.h"
+
+
+/*
+ Date arithmetic uses Howard Hinnant's days_from_civil and civil_from_days algorithms
+ <http://howardhinnant.github.io/date_algorithms.html>, which convert between a day count and a
+ proleptic Gregorian date in constant time, by working in 400-year eras that start on March 1st.
+ */
+
+#define kSecondsPerDay 86400
+
+
+static int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= (m <= 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yearOfEra = (unsigned)(y - era * 400);                               // [0, 399]
+    unsigned dayOfYear = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;         // [0, 365]
+    unsigned dayOfEra = yearOfEra * 365 + yearOfEra/4 - yearOfEra/100 + dayOfYear; // [0, 146096]
+    return era * 146097 + (int64_t)dayOfEra - 719468;
+}
+
+static void civilFromDays(int64_t z, int64_t* outY, unsigned* outM, unsigned* outD) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned dayOfEra = (unsigned)(z - era * 146097);
+    unsigned yearOfEra = (dayOfEra - dayOfEra/1460 + dayOfEra/36524 - dayOfEra/146096) / 365;
+    unsigned dayOfYear = dayOfEra - (365*yearOfEra + yearOfEra/4 - yearOfEra/100);
+    unsigned mp = (5*dayOfYear + 2) / 153;                                       // [0, 11]
+    *outD = dayOfYear - (153*mp + 2)/5 + 1;
+    *outM = (mp < 10) ? mp + 3 : mp - 9;
+    *outY = (int64_t)yearOfEra + era * 400 + (*outM <= 2);
+}
+
+static unsigned daysInMonth(int64_t y, unsigned m) {
+    static const uint8_t kDays[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (m == 2 && (y % 4 == 0) && (y % 100 != 0 || y % 400 == 0))
+        return 29;
+    return kDays[m - 1];
+}
+
+
+static inline void writeDigits(char* buf, unsigned n, int count) {
+    for (int i = count - 1; i >= 0; --i) {
+        buf[i] = (char)('0' + n % 10);
+        n /= 10;
+    }
+}
+
+size_t CBISO8601Format(int64_t seconds, char* buf) {
+    int64_t days = seconds / kSecondsPerDay;
+    int64_t secondOfDay = seconds % kSecondsPerDay;
+    if (secondOfDay < 0) {
+        secondOfDay += kSecondsPerDay;
+        --days;
+    }
+    int64_t y;
+    unsigned m, d;
+    civilFromDays(days, &y, &m, &d);
+    if (y < 1 || y > 9999)
+        return 0;
+    unsigned s = (unsigned)secondOfDay;
+    writeDigits(buf, (unsigned)y, 4);
+    buf[4] = '-';
+    writeDigits(buf + 5, m, 2);
+    buf[7] = '-';
+    writeDigits(buf + 8, d, 2);
+    buf[10] = 'T';
+    writeDigits(buf + 11, s / 3600, 2);
+    buf[13] = ':';
+    writeDigits(buf + 14, s / 60 % 60, 2);
+    buf[16] = ':';
+    writeDigits(buf + 17, s % 60, 2);
+    buf[19] = 'Z';
+    buf[20] = '\0';
+    return kCBISO8601Length;
+}
+
+
+// Reads `count` decimal digits; returns false if any of them isn't a digit.
+static inline bool readDigits(const char* str, int count, unsigned* outN) {
+    unsigned n = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned digit = (unsigned)(str[i] - '0');
+        if (digit > 9)
+            return false;
+        n = 10*n + digit;
+    }
+    *outN = n;
+    return true;
+}
+
+bool CBISO8601Parse(const char* str, size_t length, int64_t* outSeconds) {
+    // "yyyy-MM-ddTHH:mm:ss" followed by "Z" or "+HH:mm" / "-HH:mm"
+    if (length != 20 && length != 25)
+        return false;
+    unsigned y, m, d, hour, min, sec;
+    if (!readDigits(str, 4, &y) || str[4] != '-' || !readDigits(str + 5, 2, &m) || str[7] != '-'
+            || !readDigits(str + 8, 2, &d) || str[10] != 'T'
+            || !readDigits(str + 11, 2, &hour) || str[13] != ':'
+            || !readDigits(str + 14, 2, &min) || str[16] != ':'
+            || !readDigits(str + 17, 2, &sec))
+        return false;
+    if (y < 1 || m < 1 || m > 12 || d < 1 || d > daysInMonth(y, m)
+            || hour > 23 || min > 59 || sec > 59)
+        return false;
+
+    int64_t offset = 0;
+    if (length == 20) {
+        if (str[19] != 'Z')
+            return false;
+    } else {
+        unsigned offsetHour, offsetMin;
+        if ((str[19] != '+' && str[19] != '-') || !readDigits(str + 20, 2, &offsetHour)
+                || str[22] != ':' || !readDigits(str + 23, 2, &offsetMin)
+                || offsetHour > 23 || offsetMin > 59)
+            return false;
+        offset = 60 * (60 * (int64_t)offsetHour + offsetMin);
+        if (str[19] == '-')
+            offset = -offset;
+    }
+
+    *outSeconds = daysFromCivil(y, m, d) * kSecondsPerDay + 3600*hour + 60*min + sec - offset;
+    return true;
+}
@@ -0,0 +1,29 @@
+//
+//  CBISO8601.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** The length of a timestamp written by CBISO8601Format, not counting the trailing NUL.
+    (e.g. "2015-06-28T17:05:09Z") */
+#define kCBISO8601Length 20
+
+/** Writes a time, in seconds since the Unix epoch, in the layout "yyyy-MM-dd'T'HH:mm:ssXXX"
+    in UTC, i.e. "2015-06-28T17:05:09Z". Uses the proleptic Gregorian calendar.
+    The buffer must have room for kCBISO8601Length + 1 bytes. Returns the length written, or 0
+    (writing nothing) if the year would be outside 1...9999.
+    Doesn't lock or allocate memory, so it's safe to call on any number of threads at once. */
+size_t CBISO8601Format(int64_t seconds, char* buf);
+
+/** Parses a timestamp in the layout "yyyy-MM-dd'T'HH:mm:ssXXX", where the time zone is either
+    "Z" or an offset like "+05:30". The string doesn't need to be NUL-terminated.
+    Returns false if it's not in that exact layout, or if any field is out of range.
+    Doesn't lock or allocate memory, so it's safe to call on any number of threads at once. */
+bool CBISO8601Parse(const char* str, size_t length, int64_t* outSeconds);
@@ -0,0 +1,28 @@
+//
+//  CBJSONDouble.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** The longest string CBJSONFormatDouble can write, not counting the trailing NUL.
+    (e.g. "-0.0000012345678901234567") */
+#define kCBJSONDoubleMaxLength 25
+
+/** Writes a double as the shortest decimal string that parses back to exactly the same value,
+    laid out like ECMAScript's Number.prototype.toString, e.g. "0.1", "100", "1.5e-7", "1e+21".
+    The result is the same on every platform and in every locale.
+    The buffer must have room for kCBJSONDoubleMaxLength + 1 bytes. Returns the length written,
+    or 0 (writing nothing) if the value is NaN or infinite, which JSON can't represent. */
+size_t CBJSONFormatDouble(double d, char* buf);
+
+/** Writes a signed integer in decimal. The buffer must have room for 21 bytes. */
+size_t CBJSONFormatInteger(int64_t i, char* buf);
+
+/** Writes an unsigned integer in decimal. The buffer must have room for 21 bytes. */
+size_t CBJSONFormatUnsigned(uint64_t u, char* buf);
@@ -0,0 +1,53 @@
+//
+//  CBJSONMerkleTree.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** Computes a Merkle-tree digest of a JSON object, and proofs that let a single value in the object
+    be verified against that digest without the rest of the object.
+    Every value is hashed separately, with BLAKE2b: strings, numbers, booleans and nulls in their
+    version-2 canonical JSON form, and arrays and dictionaries from the hashes of their items,
+    arranged in a binary Merkle tree (dictionary items in canonical key order.) As with canonical
+    JSON, top-level keys beginning with "_" or "(" (except "_id") are left out.
+    The instance keeps the tree of the last object it digested. Given a new version of that object,
+    it reuses the hashes of values that haven't changed -- equal strings, identical numbers, and
+    identical arrays and dictionaries that are immutable all the way down -- so the cost of
+    updating the digest is proportional to the size of the changes, not of the whole object.
+    Other arrays and dictionaries are always rescanned, since something in them may have been
+    changed in place; but their key order and Merkle trees are kept too, so changing one item only
+    rehashes its path to the root. Array items are matched up by index, so inserting or removing
+    an item rehashes the ones after it.
+    Not thread-safe. */
+@interface CBJSONMerkleTree : NSObject
+
+/** Updates the tree to match the object and returns its digest (32 bytes.)
+    Returns nil if the object can't be canonicalized, i.e. a string has unpaired surrogates. */
+- (NSData*) digestOfJSON: (id)jsonObject;
+
+/** The digest returned by the last call to -digestOfJSON:. */
+@property (readonly) NSData* digest;
+
+/** The number of values hashed during the last call to -digestOfJSON:, i.e. the ones whose
+    hashes couldn't be reused from the previous tree. Useful for diagnostics and testing. */
+@property (readonly) NSUInteger valuesHashed;
+
+/** Returns a proof that a value is at the given key path in the last object digested. The path is
+    an array of NSString dictionary keys and NSNumber array indexes, from the top level down.
+    The proof is a JSON-compatible array that can be sent along with the value.
+    Returns nil if there's no value at that path. */
+- (NSArray*) proofForKeyPath: (NSArray*)keyPath;
+
+/** Computes the digest of the object that a value and its proof (from -proofForKeyPath:) imply.
+    If this matches a trusted digest, the value is proven to be at that path in that object.
+    Returns nil if the proof is malformed. */
++ (NSData*) digestOfValue: (id)value
+                atKeyPath: (NSArray*)keyPath
+                    proof: (NSArray*)proof;
+
+@end
@@ -0,0 +1,526 @@
+//
+//  CBJSONMerkleTree.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBJSONMerkleTree.h"
+#import "CBCanonicalJSON+Private.h"
+#import "sodium.h"
+
+
+/*
+ Hashes. H is BLAKE2b with a 32-byte output, and n is an item count as a big-endian 64-bit integer.
+    string, number, boolean, null:  H(0x00 || canonical JSON, version 2)
+    array:                          H(0x01 || n || MTH(hashes of items))
+    dictionary:                     H(0x02 || n || MTH(hashes of entries, in canonical key order))
+    dictionary entry:               H(0x03 || hash of key (as a string) || hash of value)
+ MTH is the Merkle Tree Hash of RFC 6962 (section 2.1), with 0x04 as the interior-node prefix:
+    MTH({})       = 32 zero bytes
+    MTH({d0})     = d0
+    MTH(D[0:n])   = H(0x04 || MTH(D[0:k]) || MTH(D[k:n])), where k is the largest power of 2 < n
+
+ Proofs. A proof has one item per key-path component, from the top level down:
+    {"count": n, "index": i, "path": [base64 hashes]}
+ where "path" is the RFC 6962 audit path of item i among the n items of that container, starting
+ from the bottom of its Merkle tree.
+ */
+
+enum {
+    kScalarTag = 0,
+    kArrayTag,
+    kDictionaryTag,
+    kEntryTag,
+    kNodeTag
+};
+
+typedef struct {
+    uint8_t bytes[32];
+} MerkleHash;
+
+
+static void hashParts(uint8_t tag, const void* a, size_t aLength, const void* b, size_t bLength,
+                      MerkleHash* outHash)
+{
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, NULL, 0, sizeof(MerkleHash));
+    crypto_generichash_update(&state, &tag, 1);
+    crypto_generichash_update(&state, a, aLength);
+    crypto_generichash_update(&state, b, bLength);
+    crypto_generichash_final(&state, outHash->bytes, sizeof(MerkleHash));
+}
+
+// The largest power of 2 less than n, for n > 1. (Written so that it can't overflow even for
+// the huge counts an untrusted proof may claim.)
+static uint64_t splitPoint(uint64_t n) {
+    uint64_t k = 1;
+    while (k < n - k)
+        k *= 2;
+    return k;
+}
+
+// Computes MTH(leaves[0:n]) for n > 0, storing the hashes of all its subtrees in `nodes`: 2n-1 of
+// them, in pre-order, so nodes[0] is the root, the left subtree (of k leaves) starts at nodes[1]
+// and the right one at nodes[2k]. If `oldNodes` is non-NULL it holds the subtrees of an earlier
+// tree with the same n, and only the subtrees containing a leaf flagged in `changed` are
+// rehashed. Returns YES if the root was rehashed.
+static BOOL cachedTreeHash(const MerkleHash* leaves, const BOOL* changed, size_t n,
+                           const MerkleHash* oldNodes, MerkleHash* nodes)
+{
+    if (n == 1) {
+        nodes[0] = leaves[0];
+        return !oldNodes || changed[0];
+    }
+    size_t k = (size_t)splitPoint(n);
+    BOOL left = cachedTreeHash(leaves, changed, k,
+                               (oldNodes ? oldNodes + 1 : NULL), nodes + 1);
+    BOOL right = cachedTreeHash(leaves + k, changed + k, n - k,
+                                (oldNodes ? oldNodes + 2*k : NULL), nodes + 2*k);
+    if (!left && !right) {
+        nodes[0] = oldNodes[0];
+        return NO;
+    }
+    MerkleHash children[2] = {nodes[1], nodes[2*k]};
+    hashParts(kNodeTag, &children, sizeof(children), NULL, 0, &nodes[0]);
+    return YES;
+}
+
+// H(tag || n || root)
+static void containerHashFromRoot(uint8_t tag, uint64_t n, const MerkleHash* root,
+                                  MerkleHash* outHash)
+{
+    uint8_t count[8];
+    OSWriteBigInt64(count, 0, n);
+    hashParts(tag, count, sizeof(count), root, sizeof(MerkleHash), outHash);
+}
+
+// Appends the audit path of leaf m of n to `path`, bottom-up, given the subtree hashes computed by
+// cachedTreeHash.
+static void auditPath(const MerkleHash* nodes, size_t n, size_t m, NSMutableArray* path) {
+    if (n <= 1)
+        return;
+    size_t k = (size_t)splitPoint(n);
+    const MerkleHash* sibling;
+    if (m < k) {
+        auditPath(nodes + 1, k, m, path);
+        sibling = &nodes[2*k];
+    } else {
+        auditPath(nodes + 2*k, n - k, m - k, path);
+        sibling = &nodes[1];
+    }
+    NSData* data = [[NSData alloc] initWithBytes: sibling length: sizeof(MerkleHash)];
+    [path addObject: [data base64EncodedStringWithOptions: 0]];
+}
+
+// Computes MTH from leaf m of n and its audit path; the inverse of auditPath.
+static BOOL rootFromAuditPath(const MerkleHash* leaf, uint64_t m, uint64_t n,
+                              const MerkleHash* path, size_t pathLength, MerkleHash* outRoot)
+{
+    if (n <= 1) {
+        *outRoot = *leaf;
+        return (pathLength == 0);
+    }
+    if (pathLength == 0)
+        return NO;
+    uint64_t k = splitPoint(n);
+    MerkleHash children[2];
+    if (m < k) {
+        if (!rootFromAuditPath(leaf, m, k, path, pathLength - 1, &children[0]))
+            return NO;
+        children[1] = path[pathLength - 1];
+    } else {
+        if (!rootFromAuditPath(leaf, m - k, n - k, path, pathLength - 1, &children[1]))
+            return NO;
+        children[0] = path[pathLength - 1];
+    }
+    hashParts(kNodeTag, &children, sizeof(children), NULL, 0, outRoot);
+    return YES;
+}
+
+
+// Reads a count or index from a proof or key path, rejecting anything that isn't a non-negative
+// integer (like -1, 1.5 or 1e30) instead of letting NSNumber round or wrap it.
+static BOOL getIndex(id number, uint64_t* outValue) {
+    if (![number isKindOfClass: [NSNumber class]])
+        return NO;
+    switch ([number objCType][0]) {
+        case 's': case 'i': case 'l': case 'q':
+            if ([number longLongValue] < 0)
+                return NO;
+            // fall through
+        case 'S': case 'I': case 'L': case 'Q':
+            *outValue = [number unsignedLongLongValue];
+            return YES;
+        default:
+            return NO;
+    }
+}
+
+
+// Orders strings by UTF-16 code units, as canonical JSON does.
+static NSInteger compareKeys(id a, id b, void* context) {
+    CFStringRef strA = (__bridge CFStringRef)a, strB = (__bridge CFStringRef)b;
+    CFIndex lengthA = CFStringGetLength(strA), lengthB = CFStringGetLength(strB);
+    CFStringInlineBuffer bufA, bufB;
+    CFStringInitInlineBuffer(strA, &bufA, CFRangeMake(0, lengthA));
+    CFStringInitInlineBuffer(strB, &bufB, CFRangeMake(0, lengthB));
+    for (CFIndex i = 0; i < lengthA && i < lengthB; i++) {
+        UniChar ca = CFStringGetCharacterFromInlineBuffer(&bufA, i);
+        UniChar cb = CFStringGetCharacterFromInlineBuffer(&bufB, i);
+        if (ca != cb)
+            return (ca < cb) ? NSOrderedAscending : NSOrderedDescending;
+    }
+    if (lengthA == lengthB)
+        return NSOrderedSame;
+    return (lengthA < lengthB) ? NSOrderedAscending : NSOrderedDescending;
+}
+
+// Returns YES if the value can't be changed in place. (Immutable strings and containers return
+// themselves from -copy. Checking the class isn't enough: CF-based immutable objects are also
+// kinds of the mutable classes.)
+static BOOL isImmutable(id value) {
+    if ([value isKindOfClass: [NSString class]] || [value isKindOfClass: [NSArray class]]
+            || [value isKindOfClass: [NSDictionary class]])
+        return [value copy] == value;
+    return YES;
+}
+
+
+
+
+// A hashed value in the tree.
+@interface CBJSONMerkleNode : NSObject
+{
+    @package
+    id _value;                      // the value that was hashed (a copy, if it's a string)
+    MerkleHash _hash;
+    MerkleHash _entryHash;          // if it's in a dictionary, the hash of its entry
+    BOOL _immutable;                // YES if neither the value nor anything in it can change
+    NSArray* _children;             // array or dictionary: item nodes, in order
+    NSArray* _keys;                 // dictionary: keys in canonical order
+    NSDictionary* _childrenByKey;   // dictionary: key -> item node
+    NSData* _tree;                  // array or dictionary: its Merkle subtree hashes (see
+                                    // cachedTreeHash), or nil if it's empty
+}
+@end
+
+@implementation CBJSONMerkleNode
+@end
+
+
+
+
+@implementation CBJSONMerkleTree
+{
+    CBCanonicalJSON* _encoder;
+    CBJSONMerkleNode* _root;
+    NSData* _digest;
+    NSUInteger _valuesHashed;
+    BOOL _invalid;
+}
+
+@synthesize digest=_digest, valuesHashed=_valuesHashed;
+
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _encoder = [[CBCanonicalJSON alloc] initWithObject: nil];
+        _encoder.version = kCBCanonicalJSONVersion2;
+    }
+    return self;
+}
+
+
+- (void) hashScalar: (id)value into: (MerkleHash*)outHash {
+    crypto_generichash_state state;
+    crypto_generichash_state* statePtr = &state;
+    crypto_generichash_init(&state, NULL, 0, sizeof(MerkleHash));
+    uint8_t tag = kScalarTag;
+    crypto_generichash_update(&state, &tag, 1);
+    if (![_encoder writeObject: value to: ^(const void* bytes, size_t length) {
+            crypto_generichash_update(statePtr, bytes, length);
+        }])
+        _invalid = YES;
+    crypto_generichash_final(&state, outHash->bytes, sizeof(MerkleHash));
+}
+
+
+- (void) hashEntryWithKey: (NSString*)key value: (const MerkleHash*)valueHash
+                     into: (MerkleHash*)outHash
+{
+    MerkleHash keyHash;
+    [self hashScalar: key into: &keyHash];
+    hashParts(kEntryTag, &keyHash, sizeof(keyHash), valueHash, sizeof(MerkleHash), outHash);
+}
+
+
+// Returns a node for the value, reusing `old` (the node previously at the same place in the
+// tree) or its descendants where they still match. A container is only reused whole if it's the
+// same object and was immutable all the way down, since otherwise something inside it may have
+// been changed in place.
+- (CBJSONMerkleNode*) nodeForValue: (id)value old: (CBJSONMerkleNode*)old topLevel: (BOOL)topLevel {
+    BOOL isString = [value isKindOfClass: [NSString class]];
+    if (old) {
+        if (isString) {
+            if ([old->_value isKindOfClass: [NSString class]]
+                    && [old->_value isEqualToString: value]) {
+                if (old->_immutable == isImmutable(value))
+                    return old;
+                // Same hash, but whether the string can change (which the parent cares about)
+                // doesn't match:
+                CBJSONMerkleNode* node = [[CBJSONMerkleNode alloc] init];
+                node->_value = old->_value;
+                node->_hash = old->_hash;
+                node->_immutable = !old->_immutable;
+                return node;
+            }
+        } else if (old->_value == value && old->_immutable) {
+            return old;
+        }
+    }
+
+    ++_valuesHashed;
+    CBJSONMerkleNode* node = [[CBJSONMerkleNode alloc] init];
+    node->_value = isString ? [value copy] : value;
+    node->_immutable = isString ? (node->_value == value) : isImmutable(value);
+    if ([value isKindOfClass: [NSDictionary class]]) {
+        [self hashDictionary: value node: node old: old topLevel: topLevel];
+    } else if ([value isKindOfClass: [NSArray class]]) {
+        [self hashArray: value node: node old: old];
+    } else {
+        [self hashScalar: value into: &node->_hash];
+    }
+    return node;
+}
+
+
+// Sets a container node's hash from the hashes of its items, storing its Merkle tree. If
+// `oldTree` is non-nil, it's the tree of the previous version of the container, whose items are
+// in the same positions, and only the paths to the items flagged in `changed` are rehashed.
+- (void) hashContainer: (uint8_t)tag
+                  node: (CBJSONMerkleNode*)node
+                leaves: (const MerkleHash*)leaves
+               changed: (const BOOL*)changed
+                 count: (size_t)count
+               oldTree: (NSData*)oldTree
+{
+    MerkleHash root = {{0}};
+    if (count > 0) {
+        NSMutableData* tree = [[NSMutableData alloc] initWithLength: (2*count - 1)
+                                                                     * sizeof(MerkleHash)];
+        cachedTreeHash(leaves, changed, count, oldTree.bytes, tree.mutableBytes);
+        root = *(const MerkleHash*)tree.bytes;
+        node->_tree = tree;
+    }
+    containerHashFromRoot(tag, count, &root, &node->_hash);
+}
+
+
+// Returns the dictionary's keys (minus ignored ones) in canonical order. Instead of sorting all of
+// them, the previous version's sorted keys are reused, with just the new keys sorted and merged
+// in; if the keys haven't changed, the same array is returned.
+- (NSArray*) sortedKeysOf: (NSDictionary*)dict old: (CBJSONMerkleNode*)old topLevel: (BOOL)topLevel {
+    NSDictionary* oldChildren = old ? old->_childrenByKey : nil;
+    NSArray* oldKeys = old ? old->_keys : nil;
+    NSMutableArray* added = [NSMutableArray array];
+    NSUInteger kept = 0;
+    for (NSString* key in dict) {
+        if (topLevel && [_encoder ignoreTopLevelKey: key])
+            continue;
+        if (oldChildren[key])
+            ++kept;
+        else
+            [added addObject: key];
+    }
+    if (oldChildren && added.count == 0 && kept == oldKeys.count)
+        return oldKeys;
+
+    [added sortUsingFunction: compareKeys context: NULL];
+    NSMutableArray* keys = [NSMutableArray arrayWithCapacity: kept + added.count];
+    NSUInteger a = 0, nAdded = added.count;
+    for (NSString* key in oldKeys) {
+        if (!dict[key])
+            continue;
+        while (a < nAdded && compareKeys(added[a], key, NULL) == NSOrderedAscending)
+            [keys addObject: added[a++]];
+        [keys addObject: key];
+    }
+    while (a < nAdded)
+        [keys addObject: added[a++]];
+    return [keys copy];
+}
+
+
+- (void) hashDictionary: (NSDictionary*)dict
+                   node: (CBJSONMerkleNode*)node
+                    old: (CBJSONMerkleNode*)old
+               topLevel: (BOOL)topLevel
+{
+    NSArray* keys = [self sortedKeysOf: dict old: old topLevel: topLevel];
+    NSDictionary* oldChildren = old ? old->_childrenByKey : nil;
+    NSUInteger count = keys.count;
+    NSMutableArray* children = [NSMutableArray arrayWithCapacity: count];
+    NSMutableDictionary* childrenByKey = [NSMutableDictionary dictionaryWithCapacity: count];
+    MerkleHash* entries = malloc(MAX(count, 1u) * sizeof(MerkleHash));
+    BOOL* changed = malloc(MAX(count, 1u) * sizeof(BOOL));
+    NSUInteger i = 0;
+    for (NSString* key in keys) {
+        CBJSONMerkleNode* oldChild = oldChildren[key];
+        CBJSONMerkleNode* child = [self nodeForValue: dict[key] old: oldChild topLevel: NO];
+        if (child != oldChild)
+            [self hashEntryWithKey: key value: &child->_hash into: &child->_entryHash];
+        changed[i] = (child != oldChild);
+        entries[i++] = child->_entryHash;
+        node->_immutable = node->_immutable && child->_immutable;
+        [children addObject: child];
+        childrenByKey[key] = child;
+    }
+    // The old tree only lines up with this one if the keys are the same:
+    NSData* oldTree = (oldChildren && keys == old->_keys) ? old->_tree : nil;
+    [self hashContainer: kDictionaryTag node: node leaves: entries changed: changed count: count
+                oldTree: oldTree];
+    free(entries);
+    free(changed);
+    node->_keys = keys;
+    node->_children = [children copy];
+    node->_childrenByKey = [childrenByKey copy];
+}
+
+
+- (void) hashArray: (NSArray*)array node: (CBJSONMerkleNode*)node old: (CBJSONMerkleNode*)old {
+    NSArray* oldChildren = nil;
+    if (old && [old->_value isKindOfClass: [NSArray class]])
+        oldChildren = old->_children;
+    NSUInteger count = array.count, oldCount = oldChildren.count;
+    NSMutableArray* children = [NSMutableArray arrayWithCapacity: count];
+    MerkleHash* items = malloc(MAX(count, 1u) * sizeof(MerkleHash));
+    BOOL* changed = malloc(MAX(count, 1u) * sizeof(BOOL));
+    NSUInteger i = 0;
+    for (id item in array) {
+        CBJSONMerkleNode* oldChild = (i < oldCount) ? oldChildren[i] : nil;
+        CBJSONMerkleNode* child = [self nodeForValue: item old: oldChild topLevel: NO];
+        changed[i] = (child != oldChild);
+        items[i++] = child->_hash;
+        node->_immutable = node->_immutable && child->_immutable;
+        [children addObject: child];
+    }
+    // The old tree only lines up with this one if the count is the same:
+    NSData* oldTree = (oldChildren && count == oldCount) ? old->_tree : nil;
+    [self hashContainer: kArrayTag node: node leaves: items changed: changed count: count
+                oldTree: oldTree];
+    free(items);
+    free(changed);
+    node->_children = [children copy];
+}
+
+
+- (NSData*) digestOfJSON: (id)jsonObject {
+    _valuesHashed = 0;
+    _invalid = NO;
+    _root = [self nodeForValue: jsonObject old: _root topLevel: YES];
+    if (_invalid) {
+        _root = nil;
+        _digest = nil;
+    } else {
+        _digest = [[NSData alloc] initWithBytes: &_root->_hash length: sizeof(MerkleHash)];
+    }
+    return _digest;
+}
+
+
+#pragma mark - PROOFS:
+
+
+- (NSArray*) proofForKeyPath: (NSArray*)keyPath {
+    if (!_root)
+        return nil;
+    NSMutableArray* proof = [NSMutableArray arrayWithCapacity: keyPath.count];
+    CBJSONMerkleNode* node = _root;
+    for (id component in keyPath) {
+        BOOL inDictionary = [node->_value isKindOfClass: [NSDictionary class]];
+        NSUInteger index;
+        uint64_t arrayIndex;
+        if ([component isKindOfClass: [NSString class]] && inDictionary) {
+            if (!node->_childrenByKey[component])
+                return nil;
+            index = [node->_keys indexOfObject: component];
+        } else if (!inDictionary && getIndex(component, &arrayIndex)) {
+            if (arrayIndex >= node->_children.count)
+                return nil;
+            index = (NSUInteger)arrayIndex;
+        } else {
+            return nil;
+        }
+
+        NSUInteger count = node->_children.count;
+        NSMutableArray* path = [NSMutableArray array];
+        auditPath(node->_tree.bytes, count, index, path);
+
+        [proof addObject: @{@"count": @(count), @"index": @(index), @"path": path}];
+        node = node->_children[index];
+    }
+    return proof;
+}
+
+
++ (NSData*) digestOfValue: (id)value
+                atKeyPath: (NSArray*)keyPath
+                    proof: (NSArray*)proof
+{
+    if (![proof isKindOfClass: [NSArray class]] || proof.count != keyPath.count)
+        return nil;
+    CBJSONMerkleTree* tree = [[self alloc] init];
+    CBJSONMerkleNode* node = [tree nodeForValue: value old: nil topLevel: (keyPath.count == 0)];
+    if (tree->_invalid)
+        return nil;
+
+    MerkleHash hash = node->_hash;
+    uint64_t arrayIndex;
+    for (NSInteger level = (NSInteger)keyPath.count - 1; level >= 0; --level) {
+        NSDictionary* step = proof[level];
+        if (![step isKindOfClass: [NSDictionary class]])
+            return nil;
+        uint64_t n, m;
+        NSArray* path = step[@"path"];
+        if (!getIndex(step[@"count"], &n) || !getIndex(step[@"index"], &m) || m >= n
+                || n > NSIntegerMax     // no real array is that big
+                || ![path isKindOfClass: [NSArray class]] || path.count > 64)
+            return nil;
+
+        MerkleHash pathHashes[64];
+        size_t pathLength = 0;
+        for (NSString* item in path) {
+            if (![item isKindOfClass: [NSString class]])
+                return nil;
+            NSData* data = [[NSData alloc] initWithBase64EncodedString: item options: 0];
+            if (data.length != sizeof(MerkleHash))
+                return nil;
+            memcpy(&pathHashes[pathLength++], data.bytes, sizeof(MerkleHash));
+        }
+
+        id component = keyPath[level];
+        MerkleHash leaf, root;
+        uint8_t tag;
+        if ([component isKindOfClass: [NSString class]]) {
+            [tree hashEntryWithKey: component value: &hash into: &leaf];
+            tag = kDictionaryTag;
+        } else if (getIndex(component, &arrayIndex) && arrayIndex == m) {
+            leaf = hash;
+            tag = kArrayTag;
+        } else {
+            return nil;
+        }
+        if (!rootFromAuditPath(&leaf, m, n, pathHashes, pathLength, &root))
+            return nil;
+        containerHashFromRoot(tag, n, &root, &hash);
+    }
+    if (tree->_invalid)
+        return nil;
+    return [[NSData alloc] initWithBytes: &hash length: sizeof(hash)];
+}
+
+
+@end
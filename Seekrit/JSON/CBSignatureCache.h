@@ -0,0 +1,45 @@
+//
+//  CBSignatureCache.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBSigningPrivateKey.h"
+
+
+/** A bounded cache of signatures that have already been verified, so verifying the same signed
+    JSON again can skip the Ed25519 check. When it's full, the least recently used entries are
+    evicted. Entries are keyed by the public key, the signed data and the signature, so a hit
+    means exactly that signature has been verified before.
+    To use it, pass an instance to +[CBVerifyingPublicKey setSignatureCache:].
+    The cache can be used on multiple threads at once. */
+@interface CBSignatureCache : NSObject
+
+/** Creates a cache holding up to `capacity` signatures. */
+- (instancetype) initWithCapacity: (NSUInteger)capacity;
+
+@property (readonly) NSUInteger capacity;
+
+/** The number of signatures in the cache. */
+@property (readonly) NSUInteger count;
+
+/** The number of lookups that found / didn't find the signature. */
+@property (readonly) NSUInteger hits, misses;
+
+/** Returns YES if the signature of the data by the key has been added to the cache, and marks
+    it as recently used. Updates the hit or miss count. */
+- (BOOL) containsSignature: (CBSignature)signature
+                    ofData: (NSData*)data
+                    signer: (CBVerifyingPublicKey*)signer;
+
+/** Adds a signature that's been verified. */
+- (void) addSignature: (CBSignature)signature
+               ofData: (NSData*)data
+               signer: (CBVerifyingPublicKey*)signer;
+
+/** Empties the cache and resets the counters. */
+- (void) removeAll;
+
+@end
@@ -0,0 +1,170 @@
+//
+//  CBSignatureCache.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBSignatureCache.h"
+#import "sodium.h"
+
+
+// Cache key: a BLAKE2b hash of the public key and the signed data, followed by the signature.
+// (Hashing keeps the entries small, however long the data is.)
+typedef struct {
+    uint8_t signedHash[32];
+    CBSignature signature;
+} CacheKey;
+
+
+// An entry in the cache's LRU list.
+@interface CBSignatureCacheEntry : NSObject
+{
+    @package
+    NSData* _key;
+    __unsafe_unretained CBSignatureCacheEntry *_prev, *_next;
+}
+@end
+
+@implementation CBSignatureCacheEntry
+@end
+
+
+
+
+@implementation CBSignatureCache
+{
+    NSUInteger _capacity;
+    NSMutableDictionary* _entries;          // CacheKey data -> CBSignatureCacheEntry
+    CBSignatureCacheEntry *_newest, *_oldest;
+    NSUInteger _hits, _misses;
+}
+
+@synthesize capacity=_capacity;
+
+
+- (instancetype) initWithCapacity: (NSUInteger)capacity {
+    self = [super init];
+    if (self) {
+        _capacity = MAX(capacity, 1u);
+        _entries = [[NSMutableDictionary alloc] initWithCapacity: _capacity];
+    }
+    return self;
+}
+
+- (instancetype) init {
+    return [self initWithCapacity: 1000];
+}
+
+
+static NSData* cacheKey(CBSignature signature, NSData* data, CBVerifyingPublicKey* signer) {
+    CacheKey key;
+    NSData* keyData = signer.keyData;
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, NULL, 0, sizeof(key.signedHash));
+    crypto_generichash_update(&state, keyData.bytes, keyData.length);
+    crypto_generichash_update(&state, data.bytes, data.length);
+    crypto_generichash_final(&state, key.signedHash, sizeof(key.signedHash));
+    key.signature = signature;
+    return [[NSData alloc] initWithBytes: &key length: sizeof(key)];
+}
+
+
+- (void) unlink: (CBSignatureCacheEntry*)entry {
+    if (entry->_prev)
+        entry->_prev->_next = entry->_next;
+    else
+        _newest = entry->_next;
+    if (entry->_next)
+        entry->_next->_prev = entry->_prev;
+    else
+        _oldest = entry->_prev;
+    entry->_prev = entry->_next = nil;
+}
+
+- (void) makeNewest: (CBSignatureCacheEntry*)entry {
+    entry->_next = _newest;
+    if (_newest)
+        _newest->_prev = entry;
+    _newest = entry;
+    if (!_oldest)
+        _oldest = entry;
+}
+
+
+- (BOOL) containsSignature: (CBSignature)signature
+                    ofData: (NSData*)data
+                    signer: (CBVerifyingPublicKey*)signer
+{
+    NSData* key = cacheKey(signature, data, signer);
+    @synchronized(self) {
+        CBSignatureCacheEntry* entry = _entries[key];
+        if (!entry) {
+            ++_misses;
+            return NO;
+        }
+        ++_hits;
+        if (entry != _newest) {
+            [self unlink: entry];
+            [self makeNewest: entry];
+        }
+        return YES;
+    }
+}
+
+
+- (void) addSignature: (CBSignature)signature
+               ofData: (NSData*)data
+               signer: (CBVerifyingPublicKey*)signer
+{
+    NSData* key = cacheKey(signature, data, signer);
+    @synchronized(self) {
+        CBSignatureCacheEntry* entry = _entries[key];
+        if (entry) {
+            [self unlink: entry];
+        } else {
+            if (_entries.count >= _capacity) {
+                CBSignatureCacheEntry* oldest = _oldest;
+                [self unlink: oldest];
+                [_entries removeObjectForKey: oldest->_key];
+            }
+            entry = [[CBSignatureCacheEntry alloc] init];
+            entry->_key = key;
+            _entries[key] = entry;
+        }
+        [self makeNewest: entry];
+    }
+}
+
+
+- (NSUInteger) count {
+    @synchronized(self) {
+        return _entries.count;
+    }
+}
+
+- (NSUInteger) hits {
+    @synchronized(self) {
+        return _hits;
+    }
+}
+
+- (NSUInteger) misses {
+    @synchronized(self) {
+        return _misses;
+    }
+}
+
+
+- (void) removeAll {
+    @synchronized(self) {
+        // The entries' links are unretained, so just dropping the dictionary frees them all.
+        [_entries removeAllObjects];
+        _newest = _oldest = nil;
+        _hits = _misses = 0;
+    }
+}
+
+
+@end
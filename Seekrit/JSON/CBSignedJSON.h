@@ -7,6 +7,8 @@
 //
 
 #import "CBSigningPrivateKey.h"
+#import "CBCanonicalJSON.h"
+@class CBJSONMerkleTree, CBSignatureCache;
 
 
 // https://github.com/couchbase/couchbase-lite-ios/wiki/Signed-Documents
@@ -15,9 +17,21 @@
 /** The property name used in a JSON object to hold the signature. Equal to "(signed)". */
 extern NSString* const kCBJSONSignatureProperty;
 
+/** Digest algorithms a signature can use. */
+typedef enum {
+    kCBSignedJSONDigestSHA1,        // "digest_SHA": SHA-1; the default, for compatibility
+    kCBSignedJSONDigestBLAKE2b      // "digest_blake2b": 256-bit BLAKE2b
+} CBSignedJSONDigestType;
+
 
 @interface CBVerifyingPublicKey (JSON)
 
+/** A cache of verified signatures, used by all the methods below to skip checking a signature
+    that's been verified before. (The document digest is still checked every time.)
+    Defaults to nil, i.e. no caching. */
++ (CBSignatureCache*) signatureCache;
++ (void) setSignatureCache: (CBSignatureCache*)cache;
+
 /** Verifies a signed JSON object and returns the signer's key.
     If verification fails (or the object is unsigned) returns nil. */
 + (CBVerifyingPublicKey*) signerOfJSON:(NSDictionary*)jsonDict
@@ -29,6 +43,13 @@ extern NSString* const kCBJSONSignatureProperty;
                                      ofJSON: (id)jsonObject
                                       error: (NSError**)outError;
 
+/** Verifies signed JSON data (i.e. the serialized form of an object created by
+    +addSignatureToJSON:) and returns the signer's key. The data is canonicalized and digested
+    directly from its bytes, which is faster than parsing it into objects first.
+    If verification fails (or the data is unsigned or invalid) returns nil. */
++ (CBVerifyingPublicKey*) signerOfJSONData: (NSData*)jsonData
+                                     error: (NSError**)outError;
+
 /** Returns the signature dictionary of a signed JSON object (without verifying it.) */
 + (NSDictionary*) signatureOfJSON: (id)jsonObject;
 
@@ -46,22 +67,65 @@ extern NSString* const kCBJSONSignatureProperty;
                   ofJSON: (id)jsonObject
                    error: (NSError**)outError;
 
+/** Verifies a single value of a JSON object against a Merkle signature (one created by
+    -signatureOfJSON:merkleTree:expiresAfter:), without needing the rest of the object.
+    The proof comes from -[CBJSONMerkleTree proofForKeyPath:] on the signer's tree. */
+- (BOOL) verifySignature: (NSDictionary*)signature
+                 ofValue: (id)value
+               atKeyPath: (NSArray*)keyPath
+                   proof: (NSArray*)proof
+                   error: (NSError**)outError;
+
 /** Verifies a signed JSON object created by +addSignatureToJSON:.
     The object must have been signed by the private key matching the receiver.*/
 - (BOOL) verifySignedJSON: (NSDictionary*)jsonDict
                     error: (NSError**)outError;
 
+/** Verifies signed JSON data, like -verifySignedJSON:error: but without parsing it into objects.
+    The data must have been signed by the private key matching the receiver. */
+- (BOOL) verifySignedJSONData: (NSData*)jsonData
+                        error: (NSError**)outError;
+
 @end
 
 
 @interface CBSigningPrivateKey (JSON)
 
 /** Returns a dictionary containing a signature of the given object (which must be JSON-encodable).
+    The digest is of version 1 of the canonical JSON form, so that older versions of this library
+    can verify it. Returns nil if the object can't be canonicalized.
     If expirationInterval is greater than zero, the signature will be timestamped as losing its
     validity after that interval from now. */
 - (NSDictionary*) signatureOfJSON: (id)jsonObject
                      expiresAfter: (NSTimeInterval)expirationInterval;
 
+/** Like -signatureOfJSON:expiresAfter:, but with a choice of digest algorithm. BLAKE2b is
+    stronger and faster than SHA-1, but older versions of this library can't verify it.
+    All the verification methods accept either type of digest. */
+- (NSDictionary*) signatureOfJSON: (id)jsonObject
+                       digestType: (CBSignedJSONDigestType)digestType
+                     expiresAfter: (NSTimeInterval)expirationInterval;
+
+/** Like -signatureOfJSON:digestType:expiresAfter:, but with a choice of canonical JSON version.
+    Version 2 canonicalizes strings with backslashes or control characters, and non-integers,
+    reliably across platforms, but older versions of this library ignore the signature's
+    "canonical" property and will fail to verify such objects.
+    All the verification methods accept either version. */
+- (NSDictionary*) signatureOfJSON: (id)jsonObject
+                       digestType: (CBSignedJSONDigestType)digestType
+                 canonicalVersion: (CBCanonicalJSONVersion)version
+                     expiresAfter: (NSTimeInterval)expirationInterval;
+
+/** Like -signatureOfJSON:expiresAfter:, but the digest is the root of a Merkle tree over the
+    object's values (see CBJSONMerkleTree), stored as "digest_merkle" instead of "digest_SHA".
+    The tree is updated to match the object. Keep it and pass it in again when re-signing a later
+    version of the object, and only the parts that changed will be rehashed. (If tree is nil, a
+    temporary one is used.) Returns nil if the object can't be canonicalized.
+    All the verification methods accept this type of signature. */
+- (NSDictionary*) signatureOfJSON: (id)jsonObject
+                       merkleTree: (CBJSONMerkleTree*)tree
+                     expiresAfter: (NSTimeInterval)expirationInterval;
+
 /** Returns a copy of the dictionary with a signature (generated by -signatureOfJson:) added to it
     under a "(signed)" key.
     If expirationInterval is greater than zero, the signature will be timestamped as losing its
@@ -79,5 +143,6 @@ enum {
     kCBSignedJSONErrorIncorrectDigest,
     kCBSignedJSONErrorInvalidSignature,
     kCBSignedJSONErrorUnknownSignatureType,
-    kCBSignedJSONErrorUnsigned
+    kCBSignedJSONErrorUnsigned,
+    kCBSignedJSONErrorInvalidJSON
 };
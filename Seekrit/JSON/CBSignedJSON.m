@@ -7,9 +7,13 @@
 //
 
 #import "CBSignedJSON.h"
-#import "CBCanonicalJSON.h"
+#import "CBCanonicalJSON+Private.h"
+#import "CBJSONMerkleTree.h"
+#import "CBSignatureCache.h"
+#import "CBISO8601.h"
 #import "Logging.h"
 #import "MYErrorUtils.h"
+#import "sodium.h"
 #import <CommonCrypto/CommonDigest.h>
 
 
@@ -21,17 +25,92 @@ NSString* const kCBSignedJSONErrorDomain = @"CBSignedJSON";
 
 
 
-static NSData* CanonicalDigest(id jsonObject) {
-    NSData* canonical = [CBCanonicalJSON canonicalData: jsonObject];
-    struct {
-        uint8_t bytes[20];
-    } digest;
-    CC_SHA1(canonical.bytes, (CC_LONG)canonical.length, digest.bytes);
-    return [[NSData alloc] initWithBytes: &digest length: sizeof(digest)];
+// The signature property holding the digest, for each CBSignedJSONDigestType.
+static NSString* const kDigestProperties[2] = {@"digest_SHA", @"digest_blake2b"};
+
+
+// Streams the canonical JSON straight into the digest, instead of buffering it.
+// Returns nil if the input can't be canonicalized.
+static NSData* DigestOfCanonicalJSON(CBCanonicalJSON* encoder, CBSignedJSONDigestType type) {
+    switch (type) {
+        case kCBSignedJSONDigestSHA1: {
+            __block CC_SHA1_CTX ctx;
+            CC_SHA1_Init(&ctx);
+            if (![encoder writeTo: ^(const void* bytes, size_t length) {
+                    CC_SHA1_Update(&ctx, bytes, (CC_LONG)length);
+                }])
+                return nil;
+            struct {
+                uint8_t bytes[CC_SHA1_DIGEST_LENGTH];
+            } digest;
+            CC_SHA1_Final(digest.bytes, &ctx);
+            return [[NSData alloc] initWithBytes: &digest length: sizeof(digest)];
+        }
+        case kCBSignedJSONDigestBLAKE2b: {
+            // (The state is captured by pointer; a __block copy might not keep its alignment.)
+            crypto_generichash_state state;
+            crypto_generichash_state* statePtr = &state;
+            crypto_generichash_init(&state, NULL, 0, crypto_generichash_BYTES);
+            if (![encoder writeTo: ^(const void* bytes, size_t length) {
+                    crypto_generichash_update(statePtr, bytes, length);
+                }])
+                return nil;
+            struct {
+                uint8_t bytes[crypto_generichash_BYTES];
+            } digest;
+            crypto_generichash_final(&state, digest.bytes, sizeof(digest));
+            return [[NSData alloc] initWithBytes: &digest length: sizeof(digest)];
+        }
+        default:
+            return nil;
+    }
+}
+
+static NSData* CanonicalData(id jsonObject, CBCanonicalJSONVersion version) {
+    CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithObject: jsonObject];
+    encoder.version = version;
+    return encoder.canonicalData;
+}
+
+static NSData* CanonicalDigest(id jsonObject, CBCanonicalJSONVersion version,
+                               CBSignedJSONDigestType type)
+{
+    CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithObject: jsonObject];
+    encoder.version = version;
+    return DigestOfCanonicalJSON(encoder, type);     // nil if the input can't be canonicalized
 }
 
-static NSString* CanonicalDigestString(id jsonObject) {
-    return [CanonicalDigest(jsonObject) base64EncodedStringWithOptions: 0];
+// The Merkle digest of the encoder's input object or JSON data. (The ignore rules leave out the
+// "(signed)" property, as when canonicalizing.)
+static NSData* MerkleDigestOfCanonicalJSONInput(CBCanonicalJSON* encoder) {
+    id jsonObject = encoder->_input;
+    if (encoder->_jsonData)
+        jsonObject = [NSJSONSerialization JSONObjectWithData: encoder->_jsonData
+                                                     options: NSJSONReadingAllowFragments
+                                                       error: NULL];
+    if (!jsonObject)
+        return nil;
+    return [[[CBJSONMerkleTree alloc] init] digestOfJSON: jsonObject];
+}
+
+static NSString* CanonicalDigestString(id jsonObject, CBCanonicalJSONVersion version,
+                                       CBSignedJSONDigestType type)
+{
+    return [CanonicalDigest(jsonObject, version, type) base64EncodedStringWithOptions: 0];
+}
+
+// Returns the canonical JSON version a signature was made with, or 0 if it's unknown.
+static CBCanonicalJSONVersion CanonicalVersionOfSignature(NSDictionary* signature) {
+    id version = signature[@"canonical"];
+    if (!version)
+        return kCBCanonicalJSONVersion1;
+    if (![version isKindOfClass: [NSNumber class]])
+        return 0;
+    switch ([version integerValue]) {
+        case kCBCanonicalJSONVersion1:  return kCBCanonicalJSONVersion1;
+        case kCBCanonicalJSONVersion2:  return kCBCanonicalJSONVersion2;
+        default:                        return 0;
+    }
 }
 
 static NSData* DecodeBase64(id input) {
@@ -41,48 +120,51 @@ static NSData* DecodeBase64(id input) {
                                            options: NSDataBase64DecodingIgnoreUnknownCharacters];
 }
 
+// Finds which type of digest a signature has, and decodes it. Returns nil if there's none.
+static NSData* DigestOfSignature(NSDictionary* signature, CBSignedJSONDigestType* outType) {
+    for (CBSignedJSONDigestType type = kCBSignedJSONDigestSHA1;
+            type <= kCBSignedJSONDigestBLAKE2b; ++type) {
+        NSData* digest = DecodeBase64(signature[kDigestProperties[type]]);
+        if (digest) {
+            *outType = type;
+            return digest;
+        }
+    }
+    return nil;
+}
+
 static BOOL mkError(NSInteger code, NSError** outError) {
     if (outError) {
-        static NSString* const kMessages[6] = {nil,
+        static NSString* const kMessages[7] = {nil,
             @"Signature expired",
             @"Content does not match signature",
             @"Signature is invalid",
             @"Unknown signature type",
-            @"Signature is missing"};
+            @"Signature is missing",
+            @"Invalid JSON data"};
         *outError = MYError((int)code, kCBSignedJSONErrorDomain, @"%@", kMessages[code]);
     }
     return NO;
 }
 
 
-static NSDateFormatter* getISO8601Formatter() {
-    static NSDateFormatter* sFormatter;
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        // Thanks to DenNukem's answer in http://stackoverflow.com/questions/399527/
-        sFormatter = [[NSDateFormatter alloc] init];
-        sFormatter.dateFormat = @"yyyy-MM-dd'T'HH:mm:ssXXX";
-        sFormatter.calendar = [[NSCalendar alloc] initWithCalendarIdentifier:NSCalendarIdentifierGregorian];
-        sFormatter.locale = [[NSLocale alloc] initWithLocaleIdentifier:@"en_US"];
-        sFormatter.timeZone = [NSTimeZone timeZoneForSecondsFromGMT:0];
-    });
-    return sFormatter;
-}
-
+// Dates are parsed and formatted by hand (in the layout "yyyy-MM-dd'T'HH:mm:ssXXX") instead of
+// with an NSDateFormatter, which would have to be shared under a lock, and is slow anyway.
 static NSDate* parseDate(NSString* dateStr) {
     if (![dateStr isKindOfClass: [NSString class]])
         return nil;
-    NSDateFormatter* fmt = getISO8601Formatter();
-    @synchronized(fmt) {
-        return [fmt dateFromString: dateStr];
-    }
+    char buf[32];
+    int64_t seconds;
+    if (!CFStringGetCString((__bridge CFStringRef)dateStr, buf, sizeof(buf), kCFStringEncodingASCII)
+            || !CBISO8601Parse(buf, strlen(buf), &seconds))
+        return nil;
+    return [NSDate dateWithTimeIntervalSince1970: (NSTimeInterval)seconds];
 }
 
 static NSString* formatDate(NSDate* date) {
-    NSDateFormatter* fmt = getISO8601Formatter();
-    @synchronized(fmt) {
-        return [fmt stringFromDate: date];
-    }
+    char buf[kCBISO8601Length + 1];
+    size_t length = CBISO8601Format((int64_t)floor(date.timeIntervalSince1970), buf);
+    return [[NSString alloc] initWithBytes: buf length: length encoding: NSASCIIStringEncoding];
 }
 
 
@@ -90,6 +172,21 @@ static NSString* formatDate(NSDate* date) {
 
 @implementation CBVerifyingPublicKey (JSON)
 
+static CBSignatureCache* sSignatureCache;
+
++ (CBSignatureCache*) signatureCache {
+    @synchronized([CBVerifyingPublicKey class]) {
+        return sSignatureCache;
+    }
+}
+
++ (void) setSignatureCache: (CBSignatureCache*)cache {
+    @synchronized([CBVerifyingPublicKey class]) {
+        sSignatureCache = cache;
+    }
+}
+
+
 + (NSDictionary*) signatureOfJSON: (id)jsonObject {
     if (![jsonObject isKindOfClass: [NSDictionary class]])
         return nil;
@@ -125,37 +222,92 @@ static NSString* formatDate(NSDate* date) {
     return [self expirationDateOfSignature: signature].timeIntervalSinceNow < 0;
 }
 
-/** Verifies a signature created by +signatureOfJSON. */
-- (BOOL) verifySignature: (NSDictionary*)signature
-                  ofJSON: (id)jsonObject
-                   error: (NSError**)outError
+// Verifies the "sig" of a signature, which covers all of its other properties.
+- (BOOL) verifySignatureProperties: (NSDictionary*)signature
+                           version: (CBCanonicalJSONVersion)version
+                             error: (NSError**)outError
 {
-    if ([[self class] isExpiredSignature: signature])
-        return mkError(kCBSignedJSONErrorExpired, outError);
-    NSData* digestData = DecodeBase64(signature[@"digest_SHA"]);
-    if (!digestData) {
-        return mkError(kCBSignedJSONErrorUnknownSignatureType, outError);
-    } else if (![digestData isEqual: CanonicalDigest(jsonObject)]) {
-        Warn(@"SignedJSON: Signature digest %@ doesn't match payload's %@; canonical JSON = %@",
-             digestData, CanonicalDigest(jsonObject),
-             [CBCanonicalJSON canonicalString: jsonObject]);
-        return mkError(kCBSignedJSONErrorIncorrectDigest, outError);
-    }
     NSData* sigData = [[NSData alloc] initWithBase64EncodedString: signature[@"sig"]
                                           options: NSDataBase64DecodingIgnoreUnknownCharacters];
     if (sigData.length != sizeof(CBSignature)) {
         return mkError(kCBSignedJSONErrorUnknownSignatureType, outError);
     }
 
+    CBSignature sig = *(const CBSignature*)sigData.bytes;
     NSMutableDictionary* unsignedSignature = [signature mutableCopy];
     [unsignedSignature removeObjectForKey: @"sig"];
-    if (![self verifySignature: *(const CBSignature*)sigData.bytes
-                        ofData: [CBCanonicalJSON canonicalData: unsignedSignature]]) {
+    NSData* signedData = CanonicalData(unsignedSignature, version);
+    CBSignatureCache* cache = [[self class] signatureCache];
+    if ([cache containsSignature: sig ofData: signedData signer: self])
+        return YES;
+    if (![self verifySignature: sig ofData: signedData]) {
         return mkError(kCBSignedJSONErrorInvalidSignature, outError);
     }
+    [cache addSignature: sig ofData: signedData signer: self];
     return YES;
 }
 
+// Verifies a signature of the JSON the encoder was created with. If digest is non-nil, it's
+// the already-computed digest of the encoder's output at its current version, of type digestType.
+- (BOOL) verifySignature: (NSDictionary*)signature
+         ofCanonicalJSON: (CBCanonicalJSON*)encoder
+                  digest: (NSData*)digest
+              digestType: (CBSignedJSONDigestType)digestType
+                   error: (NSError**)outError
+{
+    if ([[self class] isExpiredSignature: signature])
+        return mkError(kCBSignedJSONErrorExpired, outError);
+    CBCanonicalJSONVersion version = CanonicalVersionOfSignature(signature);
+    CBSignedJSONDigestType type = kCBSignedJSONDigestSHA1;
+    NSData* merkleDigestData = DecodeBase64(signature[@"digest_merkle"]);
+    NSData* digestData = merkleDigestData ?: DigestOfSignature(signature, &type);
+    if (!digestData || !version)
+        return mkError(kCBSignedJSONErrorUnknownSignatureType, outError);
+    if (merkleDigestData) {
+        digest = MerkleDigestOfCanonicalJSONInput(encoder);
+    } else if (!digest || encoder.version != version || digestType != type) {
+        encoder.version = version;
+        digest = DigestOfCanonicalJSON(encoder, type);
+    }
+    if (![digestData isEqual: digest]) {
+        // (Only log the canonical JSON if asked to, since generating it is another full pass.)
+        Warn(@"SignedJSON: Signature digest %@ doesn't match payload's %@", digestData, digest);
+        LogTo(SignedJSON, @"Canonical JSON = %@", encoder.canonicalString);
+        return mkError(kCBSignedJSONErrorIncorrectDigest, outError);
+    }
+    return [self verifySignatureProperties: signature version: version error: outError];
+}
+
+/** Verifies a signature created by +signatureOfJSON. */
+- (BOOL) verifySignature: (NSDictionary*)signature
+                  ofJSON: (id)jsonObject
+                   error: (NSError**)outError
+{
+    return [self verifySignature: signature
+                 ofCanonicalJSON: [[CBCanonicalJSON alloc] initWithObject: jsonObject]
+                          digest: nil
+                      digestType: kCBSignedJSONDigestSHA1
+                           error: outError];
+}
+
+- (BOOL) verifySignature: (NSDictionary*)signature
+                 ofValue: (id)value
+               atKeyPath: (NSArray*)keyPath
+                   proof: (NSArray*)proof
+                   error: (NSError**)outError
+{
+    if ([[self class] isExpiredSignature: signature])
+        return mkError(kCBSignedJSONErrorExpired, outError);
+    CBCanonicalJSONVersion version = CanonicalVersionOfSignature(signature);
+    NSData* digestData = DecodeBase64(signature[@"digest_merkle"]);
+    if (!digestData || !version)
+        return mkError(kCBSignedJSONErrorUnknownSignatureType, outError);
+    NSData* digest = [CBJSONMerkleTree digestOfValue: value atKeyPath: keyPath proof: proof];
+    if (![digestData isEqual: digest])
+        return mkError(kCBSignedJSONErrorIncorrectDigest, outError);
+    return [self verifySignatureProperties: signature version: version error: outError];
+}
+
 /** Verifies a signed JSON object created by +addSignatureToJSON:. */
 - (BOOL) verifySignedJSON: (NSDictionary*)jsonDict
                     error: (NSError**)outError
@@ -169,6 +321,59 @@ static NSString* formatDate(NSDate* date) {
 }
 
 
+- (BOOL) verifySignedJSONData: (NSData*)jsonData
+                        error: (NSError**)outError
+{
+    return [[self class] signerOfJSONData: jsonData expectedSigner: self error: outError] != nil;
+}
+
+
++ (CBVerifyingPublicKey*) signerOfJSONData: (NSData*)jsonData
+                                     error: (NSError**)outError
+{
+    return [self signerOfJSONData: jsonData expectedSigner: nil error: outError];
+}
+
+
++ (CBVerifyingPublicKey*) signerOfJSONData: (NSData*)jsonData
+                            expectedSigner: (CBVerifyingPublicKey*)expectedSigner
+                                     error: (NSError**)outError
+{
+    // Find the "(signed)" property first, without canonicalizing, so that only the kind of digest
+    // the signature has needs to be computed:
+    CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithJSONData: jsonData];
+    if (![encoder scanIgnoredTopLevelValues]) {
+        mkError(kCBSignedJSONErrorInvalidJSON, outError);
+        return nil;
+    }
+    NSDictionary* signature = [encoder ignoredTopLevelValue: kCBJSONSignatureProperty];
+    if (![signature isKindOfClass: [NSDictionary class]]) {
+        mkError(kCBSignedJSONErrorUnsigned, outError);
+        return nil;
+    }
+    CBVerifyingPublicKey* key = expectedSigner ?: [self keyFromSignature: signature];
+    if (!key) {
+        mkError(kCBSignedJSONErrorUnknownSignatureType, outError);
+        return nil;
+    }
+    CBSignedJSONDigestType type = kCBSignedJSONDigestSHA1;
+    CBCanonicalJSONVersion version = CanonicalVersionOfSignature(signature);
+    NSData* digest = nil;
+    if (version && !signature[@"digest_merkle"] && DigestOfSignature(signature, &type)) {
+        encoder.version = version;
+        digest = DigestOfCanonicalJSON(encoder, type);
+        if (!digest) {
+            mkError(kCBSignedJSONErrorInvalidJSON, outError);
+            return nil;
+        }
+    }
+    if (![key verifySignature: signature ofCanonicalJSON: encoder
+                       digest: digest digestType: type error: outError])
+        return nil;
+    return key;
+}
+
+
 + (CBVerifyingPublicKey*) signerOfJSON:(NSDictionary*)jsonDict
                         error: (NSError**)outError
 {
@@ -196,24 +401,78 @@ static NSString* formatDate(NSDate* date) {
 
 @implementation CBSigningPrivateKey (JSON)
 
-- (NSDictionary*) signatureOfJSON: (id)jsonObject
-                     expiresAfter: (NSTimeInterval)expirationInterval
+// Adds the common properties to a signature containing a digest, and signs it.
+// Signatures without a "canonical" property use version 1, which is all older readers know, so
+// the property is only added for later versions.
+- (NSDictionary*) signatureWithDigest: (NSDictionary*)digest
+                     canonicalVersion: (CBCanonicalJSONVersion)version
+                         expiresAfter: (NSTimeInterval)expirationInterval
 {
     NSString* keyStr = [self.publicKey.keyData base64EncodedStringWithOptions: 0];
-    NSMutableDictionary* signature = [@{
-        @"digest_SHA": CanonicalDigestString(jsonObject),
+    NSMutableDictionary* signature = [digest mutableCopy];
+    [signature addEntriesFromDictionary: @{
         @"key_25519": keyStr,
         @"date": formatDate([NSDate date])
-    } mutableCopy];
+    }];
+    if (version != kCBCanonicalJSONVersion1)
+        signature[@"canonical"] = @(version);
     if (expirationInterval > 0.0)
         signature[@"expires"] = @(MAX(0, floor(expirationInterval / kExpiresUnit)));
-    CBSignature sig = [self signData: [CBCanonicalJSON canonicalData: signature]];
+    CBSignature sig = [self signData: CanonicalData(signature, version)];
     NSData* sigData = [NSData dataWithBytes: &sig length: sizeof(sig)];
     signature[@"sig"] = [sigData base64EncodedStringWithOptions: 0];
     return [signature copy];
 }
 
 
+- (NSDictionary*) signatureOfJSON: (id)jsonObject
+                     expiresAfter: (NSTimeInterval)expirationInterval
+{
+    return [self signatureOfJSON: jsonObject
+                      digestType: kCBSignedJSONDigestSHA1
+                    expiresAfter: expirationInterval];
+}
+
+
+- (NSDictionary*) signatureOfJSON: (id)jsonObject
+                       digestType: (CBSignedJSONDigestType)digestType
+                     expiresAfter: (NSTimeInterval)expirationInterval
+{
+    return [self signatureOfJSON: jsonObject
+                      digestType: digestType
+                canonicalVersion: kCBCanonicalJSONVersion1
+                    expiresAfter: expirationInterval];
+}
+
+
+- (NSDictionary*) signatureOfJSON: (id)jsonObject
+                       digestType: (CBSignedJSONDigestType)digestType
+                 canonicalVersion: (CBCanonicalJSONVersion)version
+                     expiresAfter: (NSTimeInterval)expirationInterval
+{
+    NSString* digest = CanonicalDigestString(jsonObject, version, digestType);
+    if (!digest)
+        return nil;
+    return [self signatureWithDigest: @{kDigestProperties[digestType]: digest}
+                    canonicalVersion: version
+                        expiresAfter: expirationInterval];
+}
+
+
+- (NSDictionary*) signatureOfJSON: (id)jsonObject
+                       merkleTree: (CBJSONMerkleTree*)tree
+                     expiresAfter: (NSTimeInterval)expirationInterval
+{
+    NSData* digest = [tree ?: [[CBJSONMerkleTree alloc] init] digestOfJSON: jsonObject];
+    if (!digest)
+        return nil;
+    NSString* digestStr = [digest base64EncodedStringWithOptions: 0];
+    return [self signatureWithDigest: @{@"digest_merkle": digestStr}
+                    canonicalVersion: kCBCanonicalJSONVersion1
+                        expiresAfter: expirationInterval];
+}
+
+
 - (NSDictionary*) addSignatureToJSON: (NSDictionary*)jsonDict
                         expiresAfter: (NSTimeInterval)expirationInterval
 {
@@ -13,16 +13,78 @@
 
 /** Encrypts a message so that any of the recipients can decipher it.
     @param cleartext  The message to be encrypted.
+    Each recipient's copy of the session key is tagged with a short hint that only that recipient
+    can compute, so decryption takes the same time however many recipients there are.
     @param recipientPublicKeys  An array of CBEncryptingPublicKey objects corresponding to the
             recipients who should be able to decipher the message.
-    @return  The encrypted data. */
+    @return  The encrypted data, or nil if a recipient's key is invalid. */
 - (NSData*) encryptGroupMessage: (NSData*)cleartext
                   forRecipients: (NSArray*)recipientPublicKeys;
 
 /** Decrypts a message encrypted by -encryptGroupMessage:forRecipients:.
     This PrivateKey must correspond to one of the public keys given as a recipient when the message
-    was encrypted. */
+    was encrypted. Messages in the older format, without hints, can be decrypted too, as can
+    messages created by the streaming methods below. */
 - (NSData*) decryptGroupMessage: (NSData*)ciphertext
                      fromSender: (CBEncryptingPublicKey*)sender;
 
+/** Reads cleartext from `input` until EOF, writing a group message that any of the recipients can
+    decipher to `output`. The message has the same recipient header as -encryptGroupMessage:
+    forRecipients:, followed by the data split into separately authenticated chunks (see
+    CBSymmetricKey+Streaming), so memory usage doesn't depend on the size of the data.
+    NSStreams will be opened if necessary, but are not closed. */
+- (BOOL) encryptGroupStream: (NSInputStream*)input
+                   toStream: (NSOutputStream*)output
+              forRecipients: (NSArray*)recipientPublicKeys
+                      error: (NSError**)outError;
+
+/** Reads a group message created by -encryptGroupStream:toStream:forRecipients:error: from
+    `input`, writing the decrypted data to `output`.
+    Each chunk is written as soon as it's been authenticated, so a corrupted chunk is detected
+    when it's reached. If this method fails, some data may already have been written, and the
+    caller should discard it. */
+- (BOOL) decryptGroupStream: (NSInputStream*)input
+                   toStream: (NSOutputStream*)output
+                 fromSender: (CBEncryptingPublicKey*)sender
+                      error: (NSError**)outError;
+
+/** Same as -encryptGroupStream:toStream:forRecipients:error:, but operates on file descriptors,
+    which are not closed. */
+- (BOOL) encryptGroupFileDescriptor: (int)inputFD
+                   toFileDescriptor: (int)outputFD
+                      forRecipients: (NSArray*)recipientPublicKeys
+                              error: (NSError**)outError;
+
+/** Same as -decryptGroupStream:toStream:fromSender:error:, but operates on file descriptors,
+    which are not closed. */
+- (BOOL) decryptGroupFileDescriptor: (int)inputFD
+                   toFileDescriptor: (int)outputFD
+                         fromSender: (CBEncryptingPublicKey*)sender
+                              error: (NSError**)outError;
+
+/** Adds recipients to a group message previously encrypted by this key, without re-encrypting
+    the body: the session key is recovered from a known recipient's slot and encrypted for each
+    new recipient, and the body is copied byte-for-byte, so the cost doesn't depend on the size
+    of the message. Works with messages created by -encryptGroupMessage:forRecipients: and by the
+    streaming methods. Recipients who can already read the message are skipped.
+    @param newRecipients  An array of CBEncryptingPublicKey objects to add.
+    @param message  The encrypted group message.
+    @param knownRecipient  The public key of any existing recipient of the message.
+    @return  The new message, or nil if it isn't a group message sent by this key to the known
+            recipient. */
+- (NSData*) addRecipients: (NSArray*)newRecipients
+           toGroupMessage: (NSData*)message
+           knownRecipient: (CBEncryptingPublicKey*)knownRecipient
+                    error: (NSError**)outError;
+
+/** Same as -addRecipients:toGroupMessage:knownRecipient:error:, but reads the message from one file
+    descriptor and writes the new message to another, streaming the body through a small buffer.
+    (The header is at the start of the message and grows, so the file can't be updated in place.)
+    File descriptors are not closed. */
+- (BOOL) addRecipients: (NSArray*)newRecipients
+    toGroupMessageFileDescriptor: (int)inputFD
+                toFileDescriptor: (int)outputFD
+                  knownRecipient: (CBEncryptingPublicKey*)knownRecipient
+                           error: (NSError**)outError;
+
 @end
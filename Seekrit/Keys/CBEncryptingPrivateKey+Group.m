@@ -9,19 +9,58 @@
 #import "CBEncryptingPrivateKey+Group.h"
 #import "CBKey+Private.h"
 #import "CBSymmetricKey.h"
+#import "CBEncryptingSession.h"
+#import "MYErrorUtils.h"
 #import "sodium.h"
+#import <stdatomic.h>
 
 
 /*
- Data format:
+ Data format (version 1):
+    Format byte (0xC3)           1 byte
     Nonce                       24 bytes
-    Recipient count              4 bytes
+    Recipient count              4 bytes (big-endian)
     for each recipient {
+        hint                     4 bytes
         encrypted session key   32 bytes + 16 bytes overhead
     }
     cleartext encrypted with session key (16 bytes overhead)
+
+ A recipient's hint is the first 4 bytes of a BLAKE2b hash of the nonce, keyed with the shared
+ key of the sender and recipient (crypto_box_beforenm), so only they can compute it. A recipient
+ computes the shared key once, then finds its slot by comparing hints, instead of trying to
+ decrypt every slot. The hints reveal nothing about the recipients, and since they depend on the
+ nonce, they can't be used to tell whether two messages have recipients in common.
+
+ Data format (version 2, streaming):
+    Format byte (0xC4)           1 byte
+    Nonce                       24 bytes
+    Recipient count              4 bytes (big-endian)
+    for each recipient {
+        hint                     4 bytes
+        encrypted session key   32 bytes + 16 bytes overhead
+    }
+    cleartext encrypted with session key in the chunked format of CBSymmetricKey+Streaming
+
+ The header is the same as version 1. The body is a series of separately authenticated chunks,
+ so it can be encrypted and decrypted without holding it all in memory, and a receiver can use
+ each chunk as soon as it arrives; a corrupted chunk is detected when it's reached.
+
+ Legacy data format (no format byte or hints):
+    Nonce                       24 bytes
+    Recipient count              4 bytes (big-endian)
+    for each recipient {
+        encrypted session key   32 bytes + 16 bytes overhead
+    }
+    cleartext encrypted with session key (16 bytes overhead)
+
+ A legacy message's random nonce has a 1/256 chance of starting with the format byte, so if a
+ message can't be decrypted as version 1, it's tried as a legacy message.
  */
 
+#define kGroupFormatV1 0xC3
+#define kGroupFormatV2 0xC4
+
 #define kCBEncryptedMessageOverhead crypto_box_MACBYTES
 
 typedef struct {
@@ -34,67 +73,201 @@ typedef struct {
     GroupMessageEncryptedKey encryptedKey[0]; // variable length
 } GroupMessage;
 
+typedef struct {
+    CBGroupHint hint;
+    GroupMessageEncryptedKey encryptedKey;
+} GroupMessageSlot;
 
-@implementation CBEncryptingPrivateKey (GroupEncryption)
+// The version-1 (and -2) header isn't aligned, so it's accessed by offset instead of via a struct:
+#define kV1NonceOffset  1
+#define kV1CountOffset  (kV1NonceOffset + sizeof(CBNonce))
+#define kV1SlotsOffset  (kV1CountOffset + sizeof(uint32_t))
+#define kV1HeaderSize(COUNT)  (kV1SlotsOffset + (COUNT) * sizeof(GroupMessageSlot))
 
-- (NSData*) encryptGroupMessage: (NSData*)cleartext
-                  forRecipients: (NSArray*)recipients
-{
-    NSMutableData* output = [NSMutableData dataWithCapacity: sizeof(GroupMessage)
-                                            + recipients.count * sizeof(GroupMessageEncryptedKey)
-                                            + cleartext.length + kCBEncryptedMessageOverhead];
-    // Generate a random nonce and write it:
-    CBNonce nonce = [CBEncryptingPrivateKey randomNonce];
-    [output appendBytes: &nonce length: sizeof(nonce)];
 
-    // Generate a random session key:
-    CBSymmetricKey* sessionKey = [CBSymmetricKey generate];
-    NSData* sessionKeyData = sessionKey.keyData;
+// Recipients per task when encrypting in parallel. Each one costs a Curve25519 scalar
+// multiplication (unless the sessions are cached), so this is enough to make the dispatch
+// overhead negligible.
+#define kRecipientStride 16
+
+static BOOL mkError(NSInteger code, NSString* message, NSError** outError) {
+    return MYReturnError(outError, code, CBKeyErrorDomain, @"%@", message);
+}
 
-    // Write the recipient count, and the session key encrypted for each recipient:
-    uint32_t bigCount = CFSwapInt32HostToBig((uint32_t)recipients.count);
-    [output appendBytes: &bigCount length: sizeof(bigCount)];
-    for (CBEncryptingPublicKey* recipient in recipients) {
+
+// Writes a recipient's slot: the hint and the session key encrypted for that recipient.
+// If there's no session (the recipient's key is invalid) the slot is zeroed and NO is returned.
+static BOOL writeSlot(uint8_t* dst,
+                      CBEncryptingSession* session,
+                      CBNonce nonce,
+                      const CBRawKey* rawSessionKey)
+{
+    GroupMessageSlot item = {0};
+    BOOL ok = (session != nil);
+    if (ok) {
         // (It's OK to reuse the same nonce, because each recipient public key is different)
-        [self encrypt: sessionKeyData
-            withNonce: nonce
-         forRecipient: recipient
-             appendTo: output];
+        item.hint = [session groupHintForNonce: nonce];
+        [session encryptBytes: rawSessionKey length: sizeof(CBRawKey) withNonce: nonce
+                         into: item.encryptedKey.bytes];
+    }
+    memcpy(dst, &item, sizeof(item));
+    return ok;
+}
+
+// Resizes `output` to the size of the header, and writes the header into it. Returns NO if any
+// recipient has no session, in which case the header is unusable.
+static BOOL writeGroupHeader(NSMutableData* output,
+                             uint8_t format,
+                             NSUInteger count,
+                             CBEncryptingSession* (^sessionAtIndex)(NSUInteger),
+                             CBNonce nonce,
+                             CBSymmetricKey* sessionKey,
+                             BOOL parallel)
+{
+    output.length = kV1HeaderSize(count);
+    uint8_t* header = output.mutableBytes;
+    header[0] = format;
+    memcpy(header + kV1NonceOffset, &nonce, sizeof(nonce));
+    uint32_t bigCount = CFSwapInt32HostToBig((uint32_t)count);
+    memcpy(header + kV1CountOffset, &bigCount, sizeof(bigCount));
+
+    // Write the hint and session key encrypted for each recipient. Every slot has a fixed offset,
+    // so they can be filled in by any number of threads at once, with the same result.
+    CBRawKey rawSessionKey = sessionKey.rawKey;
+    const CBRawKey* rawSessionKeyPtr = &rawSessionKey;
+    uint8_t* slots = header + kV1SlotsOffset;
+    atomic_bool failed = false;
+    atomic_bool* failedPtr = &failed;
+    void (^encryptSlots)(size_t) = ^(size_t task) {
+        NSUInteger end = MIN((task + 1) * kRecipientStride, count);
+        for (NSUInteger i = task * kRecipientStride; i < end; ++i) {
+            if (!writeSlot(slots + i * sizeof(GroupMessageSlot), sessionAtIndex(i), nonce,
+                           rawSessionKeyPtr))
+                atomic_store(failedPtr, true);
+        }
+    };
+    size_t nTasks = (count + kRecipientStride - 1) / kRecipientStride;
+    if (parallel && nTasks > 1) {
+        dispatch_apply(nTasks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                       encryptSlots);
+    } else {
+        for (size_t task = 0; task < nTasks; ++task)
+            encryptSlots(task);
     }
+    sodium_memzero(&rawSessionKey, sizeof(rawSessionKey));
+    return !atomic_load(&failed);
+}
+
 
+NSData* CBEncryptGroupMessage(NSData* cleartext,
+                              NSUInteger count,
+                              CBEncryptingSession* (^sessionAtIndex)(NSUInteger),
+                              CBNonce nonce,
+                              CBSymmetricKey* sessionKey,
+                              BOOL parallel)
+{
+    NSMutableData* output = [NSMutableData dataWithCapacity: kV1HeaderSize(count)
+                                                    + cleartext.length + kCBEncryptionOverhead];
+    if (!writeGroupHeader(output, kGroupFormatV1, count, sessionAtIndex, nonce, sessionKey,
+                          parallel))
+        return nil;
     // Finally append the ciphertext, encrypted with the session key:
     [output appendData: [sessionKey encrypt: cleartext withNonce: nonce]];
     return output;
 }
 
 
-- (NSData*) decryptGroupMessage: (NSData*)input
-                     fromSender: (CBEncryptingPublicKey*)sender
+BOOL CBEncryptGroupStream(CBStreamReader reader, CBStreamWriter writer,
+                          NSUInteger count,
+                          CBEncryptingSession* (^sessionAtIndex)(NSUInteger),
+                          NSError** outError)
+{
+    // The header is proportional to the number of recipients, not the data, so it's built in
+    // memory; the body is encrypted a chunk at a time.
+    CBSymmetricKey* sessionKey = [CBSymmetricKey generate];
+    NSMutableData* header = [NSMutableData data];
+    if (!writeGroupHeader(header, kGroupFormatV2, count, sessionAtIndex,
+                          [CBEncryptingPrivateKey randomNonce], sessionKey, YES))
+        return mkError(kCBKeyErrorInvalidKey, @"Invalid recipient key", outError);
+    if (!writer(header.bytes, header.length, outError))
+        return NO;
+    CBRawKey rawSessionKey = sessionKey.rawKey;
+    BOOL ok = CBEncryptChunks(&rawSessionKey, reader, writer, outError);
+    sodium_memzero(&rawSessionKey, sizeof(rawSessionKey));
+    return ok;
+}
+
+
+// Decrypts a session key from a slot, returning nil if it's not addressed to the session's key.
+static CBSymmetricKey* decryptSessionKey(CBEncryptingSession* session,
+                                         const GroupMessageEncryptedKey* encryptedKey,
+                                         CBNonce nonce)
 {
+    CBRawKey rawKey;
+    if (![session decryptBytes: encryptedKey->bytes length: sizeof(encryptedKey->bytes)
+                     withNonce: nonce into: rawKey.bytes])
+        return nil;
+    CBSymmetricKey* sessionKey = [[CBSymmetricKey alloc] initWithRawKey: rawKey];
+    sodium_memzero(&rawKey, sizeof(rawKey));
+    return sessionKey;
+}
+
+
+// Decrypts a version-1 message; returns nil if it's not addressed to me, or isn't version 1.
+static NSData* decryptGroupMessageV1(NSData* input, CBEncryptingSession* session) {
+    size_t inputLen = input.length;
+    if (inputLen < kV1SlotsOffset)
+        return nil;
+    const uint8_t* header = input.bytes;
+    if (header[0] != kGroupFormatV1)
+        return nil;
+    uint32_t count;
+    memcpy(&count, header + kV1CountOffset, sizeof(count));
+    count = CFSwapInt32BigToHost(count);
+    if ((inputLen - kV1SlotsOffset) / sizeof(GroupMessageSlot) < count)
+        return nil;
+    CBNonce nonce;
+    memcpy(&nonce, header + kV1NonceOffset, sizeof(nonce));
+
+    // Find my slot by its hint. (Another recipient's hint could match too, but only with
+    // probability 2^-32, so it's not worth avoiding the decryption attempt.)
+    CBGroupHint hint = [session groupHintForNonce: nonce];
+    CBSymmetricKey* sessionKey = nil;
+    for (uint32_t i = 0; i < count && !sessionKey; i++) {
+        GroupMessageSlot slot;
+        memcpy(&slot, header + kV1SlotsOffset + i * sizeof(slot), sizeof(slot));
+        if (slot.hint == hint)
+            sessionKey = decryptSessionKey(session, &slot.encryptedKey, nonce);
+    }
+    if (!sessionKey)
+        return nil;
+
+    // Decrypt the ciphertext with the session key:
+    size_t headerLen = kV1HeaderSize(count);
+    NSData* ciphertext = [[NSData alloc] initWithBytesNoCopy: (void*)(header + headerLen)
+                                                      length: inputLen - headerLen
+                                                freeWhenDone: NO];
+    return [sessionKey decrypt: ciphertext withNonce: nonce];
+}
+
+
+// Decrypts a legacy message by trying every slot, returning nil if it's not addressed to me.
+static NSData* decryptGroupMessageLegacy(NSData* input, CBEncryptingSession* session) {
     // Read the header:
     size_t inputLen = input.length;
     if (inputLen < sizeof(GroupMessage))
         return nil;
     const GroupMessage* header = input.bytes;
     uint32_t count = CFSwapInt32BigToHost(header->count);
-    if (inputLen < offsetof(GroupMessage, encryptedKey[count]))
+    if ((inputLen - sizeof(GroupMessage)) / sizeof(GroupMessageEncryptedKey) < count)
         return nil;
-    // Look at each recipient's encrypted session key looking for one I can decrypt:
-    NSData* sessionKeyData = nil;
-    for (uint32_t i = 0; i < count; i++) {
-        NSData* item = [[NSData alloc] initWithBytesNoCopy: (void*)&header->encryptedKey[i]
-                                                    length: sizeof(header->encryptedKey[i])
-                                              freeWhenDone: NO];
-        sessionKeyData = [self decrypt: item withNonce: header->nonce fromSender: sender];
-        if (sessionKeyData)
-            break;
-    }
-    if (!sessionKeyData)
-        return nil; // Apparently it wasn't addressed to me :(
-
-    CBSymmetricKey* sessionKey = [[CBSymmetricKey alloc] initWithKeyData: sessionKeyData];
+    // Look at each recipient's encrypted session key looking for one I can decrypt. (Using the
+    // session's shared key, this is a cheap symmetric decryption per slot.)
+    CBSymmetricKey* sessionKey = nil;
+    for (uint32_t i = 0; i < count && !sessionKey; i++)
+        sessionKey = decryptSessionKey(session, &header->encryptedKey[i], header->nonce);
     if (!sessionKey)
-        return nil;
+        return nil; // Apparently it wasn't addressed to me :(
 
     // Decrypt the ciphertext with the session key:
     size_t cipherLen = input.length - offsetof(GroupMessage, encryptedKey[count]);
@@ -105,4 +278,373 @@ typedef struct {
 }
 
 
+// Slots read at a time while scanning a version-2 header.
+#define kSlotBatchSize 64
+
+BOOL CBDecryptGroupStream(CBStreamReader reader, CBStreamWriter writer,
+                          CBEncryptingSession* session,
+                          NSError** outError)
+{
+    uint8_t prefix[kV1SlotsOffset];
+    ssize_t n = reader(prefix, sizeof(prefix), outError);
+    if (n < 0)
+        return NO;
+    else if ((size_t)n < sizeof(prefix))
+        return mkError(kCBKeyErrorTruncated, @"Group message is truncated", outError);
+    if (prefix[0] != kGroupFormatV2)
+        return mkError(kCBKeyErrorUnknownFormat, @"Unknown group message format", outError);
+    uint32_t count;
+    memcpy(&count, prefix + kV1CountOffset, sizeof(count));
+    count = CFSwapInt32BigToHost(count);
+    CBNonce nonce;
+    memcpy(&nonce, prefix + kV1NonceOffset, sizeof(nonce));
+
+    // Read the slots a batch at a time, so memory use doesn't depend on the number of recipients,
+    // looking for the one with my hint:
+    CBGroupHint hint = [session groupHintForNonce: nonce];
+    CBSymmetricKey* sessionKey = nil;
+    GroupMessageSlot slots[kSlotBatchSize];
+    for (uint32_t i = 0; i < count; i += kSlotBatchSize) {
+        uint32_t batch = MIN(count - i, (uint32_t)kSlotBatchSize);
+        n = reader(slots, batch * sizeof(GroupMessageSlot), outError);
+        if (n < 0)
+            return NO;
+        else if ((size_t)n < batch * sizeof(GroupMessageSlot))
+            return mkError(kCBKeyErrorTruncated, @"Group message is truncated", outError);
+        for (uint32_t j = 0; j < batch && !sessionKey; j++) {
+            if (slots[j].hint == hint)
+                sessionKey = decryptSessionKey(session, &slots[j].encryptedKey, nonce);
+        }
+    }
+    if (!sessionKey)
+        return mkError(kCBKeyErrorDecryptionFailed, @"Group message isn't addressed to this key",
+                       outError);
+
+    // Now decrypt the body, a chunk at a time:
+    CBRawKey rawSessionKey = sessionKey.rawKey;
+    BOOL ok = CBDecryptChunks(&rawSessionKey, reader, writer, outError);
+    sodium_memzero(&rawSessionKey, sizeof(rawSessionKey));
+    return ok;
+}
+
+
+// Decrypts a version-2 message held in memory; returns nil if it's not addressed to me, or isn't
+// version 2.
+static NSData* decryptGroupMessageV2(NSData* input, CBEncryptingSession* session) {
+    if (input.length == 0 || ((const uint8_t*)input.bytes)[0] != kGroupFormatV2)
+        return nil;
+    __block size_t pos = 0;
+    CBStreamReader reader = ^ssize_t(void* buffer, size_t length, NSError** outError) {
+        length = MIN(length, input.length - pos);
+        memcpy(buffer, (const uint8_t*)input.bytes + pos, length);
+        pos += length;
+        return length;
+    };
+    NSMutableData* output = [NSMutableData dataWithCapacity: input.length];
+    CBStreamWriter writer = ^BOOL(const void* buffer, size_t length, NSError** outError) {
+        [output appendBytes: buffer length: length];
+        return YES;
+    };
+    if (!CBDecryptGroupStream(reader, writer, session, NULL)) {
+        sodium_memzero(output.mutableBytes, output.length);
+        return nil;
+    }
+    return output;
+}
+
+
+NSData* CBDecryptGroupMessage(NSData* input, CBEncryptingSession* session) {
+    return decryptGroupMessageV1(input, session) ?: decryptGroupMessageV2(input, session)
+                                                 ?: decryptGroupMessageLegacy(input, session);
+}
+
+
+// Returns the index of the slot addressed to the session's peer, or -1.
+static int64_t findSlot(const uint8_t* header, uint32_t count, CBEncryptingSession* session,
+                        CBNonce nonce, CBSymmetricKey** outSessionKey)
+{
+    CBGroupHint hint = [session groupHintForNonce: nonce];
+    for (uint32_t i = 0; i < count; i++) {
+        GroupMessageSlot slot;
+        memcpy(&slot, header + kV1SlotsOffset + i * sizeof(slot), sizeof(slot));
+        if (slot.hint == hint) {
+            CBSymmetricKey* sessionKey = decryptSessionKey(session, &slot.encryptedKey, nonce);
+            if (sessionKey) {
+                if (outSessionKey)
+                    *outSessionKey = sessionKey;
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+
+
+
+@implementation CBEncryptingPrivateKey (GroupEncryption)
+
+
+- (NSData*) encryptGroupMessage: (NSData*)cleartext
+                  forRecipients: (NSArray*)recipients
+{
+    return [self encryptGroupMessage: cleartext
+                       forRecipients: recipients
+                           withNonce: [CBEncryptingPrivateKey randomNonce]
+                          sessionKey: [CBSymmetricKey generate]
+                            parallel: YES];
+}
+
+
+- (NSData*) encryptGroupMessage: (NSData*)cleartext
+                  forRecipients: (NSArray*)recipients
+                      withNonce: (CBNonce)nonce
+                     sessionKey: (CBSymmetricKey*)sessionKey
+                       parallel: (BOOL)parallel
+{
+    recipients = [recipients copy];     // so it can't change while other threads are reading it
+    return CBEncryptGroupMessage(cleartext, recipients.count,
+                                 ^CBEncryptingSession*(NSUInteger i) {
+                                     return [self sessionWithPeer: recipients[i]];
+                                 },
+                                 nonce, sessionKey, parallel);
+}
+
+
+- (NSData*) decryptGroupMessage: (NSData*)input
+                     fromSender: (CBEncryptingPublicKey*)sender
+{
+    // Do the expensive key agreement just once, for any format:
+    CBEncryptingSession* session = [self sessionWithPeer: sender];
+    if (!session)
+        return nil;
+    return CBDecryptGroupMessage(input, session);
+}
+
+
+#pragma mark - STREAMING:
+
+
+- (BOOL) encryptGroupReader: (CBStreamReader)reader
+                     writer: (CBStreamWriter)writer
+              forRecipients: (NSArray*)recipients
+                      error: (NSError**)outError
+{
+    recipients = [recipients copy];
+    return CBEncryptGroupStream(reader, writer, recipients.count,
+                                ^CBEncryptingSession*(NSUInteger i) {
+                                    return [self sessionWithPeer: recipients[i]];
+                                },
+                                outError);
+}
+
+
+- (BOOL) decryptGroupReader: (CBStreamReader)reader
+                     writer: (CBStreamWriter)writer
+                 fromSender: (CBEncryptingPublicKey*)sender
+                      error: (NSError**)outError
+{
+    CBEncryptingSession* session = [self sessionWithPeer: sender];
+    if (!session)
+        return mkError(kCBKeyErrorDecryptionFailed, @"Invalid sender key", outError);
+    return CBDecryptGroupStream(reader, writer, session, outError);
+}
+
+
+- (BOOL) encryptGroupStream: (NSInputStream*)input
+                   toStream: (NSOutputStream*)output
+              forRecipients: (NSArray*)recipients
+                      error: (NSError**)outError
+{
+    NSParameterAssert(input && output);
+    return [self encryptGroupReader: CBReaderForStream(input) writer: CBWriterForStream(output)
+                      forRecipients: recipients error: outError];
+}
+
+
+- (BOOL) decryptGroupStream: (NSInputStream*)input
+                   toStream: (NSOutputStream*)output
+                 fromSender: (CBEncryptingPublicKey*)sender
+                      error: (NSError**)outError
+{
+    NSParameterAssert(input && output);
+    return [self decryptGroupReader: CBReaderForStream(input) writer: CBWriterForStream(output)
+                         fromSender: sender error: outError];
+}
+
+
+- (BOOL) encryptGroupFileDescriptor: (int)inputFD
+                   toFileDescriptor: (int)outputFD
+                      forRecipients: (NSArray*)recipients
+                              error: (NSError**)outError
+{
+    return [self encryptGroupReader: CBReaderForFD(inputFD) writer: CBWriterForFD(outputFD)
+                      forRecipients: recipients error: outError];
+}
+
+
+- (BOOL) decryptGroupFileDescriptor: (int)inputFD
+                   toFileDescriptor: (int)outputFD
+                         fromSender: (CBEncryptingPublicKey*)sender
+                              error: (NSError**)outError
+{
+    return [self decryptGroupReader: CBReaderForFD(inputFD) writer: CBWriterForFD(outputFD)
+                         fromSender: sender error: outError];
+}
+
+
+#pragma mark - ADDING RECIPIENTS:
+
+
+// Given the complete header of a version 1 or 2 message sent by me, returns a new header with
+// slots appended for the new recipients (skipping any who are already recipients.)
+- (NSData*) groupHeader: (NSData*)header
+          addRecipients: (NSArray*)newRecipients
+         knownRecipient: (CBEncryptingPublicKey*)knownRecipient
+                  error: (NSError**)outError
+{
+    const uint8_t* bytes = header.bytes;
+    uint32_t count;
+    memcpy(&count, bytes + kV1CountOffset, sizeof(count));
+    count = CFSwapInt32BigToHost(count);
+    CBNonce nonce;
+    memcpy(&nonce, bytes + kV1NonceOffset, sizeof(nonce));
+
+    // Recover the session key from the known recipient's slot. (The shared key is the same in
+    // both directions, so I can decrypt what I encrypted for them.)
+    CBSymmetricKey* sessionKey = nil;
+    CBEncryptingSession* knownSession = [self sessionWithPeer: knownRecipient];
+    if (!knownSession || findSlot(bytes, count, knownSession, nonce, &sessionKey) < 0) {
+        mkError(kCBKeyErrorDecryptionFailed,
+                @"Group message wasn't sent by this key to the known recipient", outError);
+        return nil;
+    }
+
+    NSMutableArray* sessions = [NSMutableArray arrayWithCapacity: newRecipients.count];
+    NSMutableSet* seen = [NSMutableSet set];
+    for (CBEncryptingPublicKey* recipient in newRecipients) {
+        if ([seen containsObject: recipient.keyData])
+            continue;
+        [seen addObject: recipient.keyData];
+        CBEncryptingSession* session = [self sessionWithPeer: recipient];
+        if (!session) {
+            mkError(kCBKeyErrorInvalidKey, @"Invalid recipient key", outError);
+            return nil;
+        }
+        if (findSlot(bytes, count, session, nonce, NULL) < 0)
+            [sessions addObject: session];
+    }
+    if ((uint64_t)count + sessions.count > UINT32_MAX) {
+        mkError(kCBKeyErrorUnknownFormat, @"Too many recipients", outError);
+        return nil;
+    }
+
+    // Copy the existing header, then append the new slots and update the count:
+    NSUInteger newCount = count + sessions.count;
+    NSMutableData* newHeader = [NSMutableData dataWithCapacity: kV1HeaderSize(newCount)];
+    [newHeader appendData: header];
+    newHeader.length = kV1HeaderSize(newCount);
+    uint8_t* newBytes = newHeader.mutableBytes;
+    uint32_t bigCount = CFSwapInt32HostToBig((uint32_t)newCount);
+    memcpy(newBytes + kV1CountOffset, &bigCount, sizeof(bigCount));
+    CBRawKey rawSessionKey = sessionKey.rawKey;
+    for (NSUInteger i = 0; i < sessions.count; i++)
+        writeSlot(newBytes + kV1HeaderSize(count + i), sessions[i], nonce, &rawSessionKey);
+    sodium_memzero(&rawSessionKey, sizeof(rawSessionKey));
+    return newHeader;
+}
+
+
+- (NSData*) addRecipients: (NSArray*)newRecipients
+           toGroupMessage: (NSData*)message
+           knownRecipient: (CBEncryptingPublicKey*)knownRecipient
+                    error: (NSError**)outError
+{
+    const uint8_t* bytes = message.bytes;
+    if (message.length < kV1SlotsOffset
+            || (bytes[0] != kGroupFormatV1 && bytes[0] != kGroupFormatV2)) {
+        mkError(kCBKeyErrorUnknownFormat, @"Not a version 1 or 2 group message", outError);
+        return nil;
+    }
+    uint32_t count;
+    memcpy(&count, bytes + kV1CountOffset, sizeof(count));
+    count = CFSwapInt32BigToHost(count);
+    if ((message.length - kV1SlotsOffset) / sizeof(GroupMessageSlot) < count) {
+        mkError(kCBKeyErrorTruncated, @"Group message is truncated", outError);
+        return nil;
+    }
+
+    size_t headerLen = kV1HeaderSize(count);
+    NSData* header = [[NSData alloc] initWithBytesNoCopy: (void*)bytes length: headerLen
+                                            freeWhenDone: NO];
+    NSData* newHeader = [self groupHeader: header addRecipients: newRecipients
+                           knownRecipient: knownRecipient error: outError];
+    if (!newHeader)
+        return nil;
+    // The body doesn't depend on the recipients, so it's copied as-is:
+    NSMutableData* output = [NSMutableData dataWithCapacity: newHeader.length
+                                                            + message.length - headerLen];
+    [output appendData: newHeader];
+    [output appendBytes: bytes + headerLen length: message.length - headerLen];
+    return output;
+}
+
+
+- (BOOL) addRecipients: (NSArray*)newRecipients
+    toGroupMessageFileDescriptor: (int)inputFD
+                toFileDescriptor: (int)outputFD
+                  knownRecipient: (CBEncryptingPublicKey*)knownRecipient
+                           error: (NSError**)outError
+{
+    CBStreamReader reader = CBReaderForFD(inputFD);
+    CBStreamWriter writer = CBWriterForFD(outputFD);
+
+    // Read the header:
+    NSMutableData* header = [NSMutableData dataWithLength: kV1SlotsOffset];
+    ssize_t n = reader(header.mutableBytes, kV1SlotsOffset, outError);
+    if (n < 0)
+        return NO;
+    else if ((size_t)n < kV1SlotsOffset)
+        return mkError(kCBKeyErrorTruncated, @"Group message is truncated", outError);
+    const uint8_t* bytes = header.bytes;
+    if (bytes[0] != kGroupFormatV1 && bytes[0] != kGroupFormatV2)
+        return mkError(kCBKeyErrorUnknownFormat, @"Not a version 1 or 2 group message", outError);
+    uint32_t count;
+    memcpy(&count, bytes + kV1CountOffset, sizeof(count));
+    count = CFSwapInt32BigToHost(count);
+    // The count hasn't been authenticated, so instead of allocating room for that many slots up
+    // front, the header grows a batch at a time as the slots are actually read:
+    const size_t batchLen = 4096 * sizeof(GroupMessageSlot);
+    size_t slotsLen = (size_t)count * sizeof(GroupMessageSlot);
+    for (size_t slotsRead = 0; slotsRead < slotsLen; slotsRead += batchLen) {
+        size_t len = MIN(slotsLen - slotsRead, batchLen);
+        header.length = kV1SlotsOffset + slotsRead + len;
+        n = reader((uint8_t*)header.mutableBytes + kV1SlotsOffset + slotsRead, len, outError);
+        if (n < 0)
+            return NO;
+        else if ((size_t)n < len)
+            return mkError(kCBKeyErrorTruncated, @"Group message is truncated", outError);
+    }
+
+    // Write the new header:
+    NSData* newHeader = [self groupHeader: header addRecipients: newRecipients
+                           knownRecipient: knownRecipient error: outError];
+    if (!newHeader || !writer(newHeader.bytes, newHeader.length, outError))
+        return NO;
+
+    // Copy the body, without decrypting it:
+    const size_t bufferSize = 1 << 16;
+    uint8_t* buffer = malloc(bufferSize);
+    if (!buffer)
+        return MYReturnError(outError, ENOMEM, NSPOSIXErrorDomain, @"Out of memory");
+    BOOL ok = YES;
+    do {
+        n = reader(buffer, bufferSize, outError);
+        ok = (n >= 0) && writer(buffer, n, outError);
+    } while (ok && (size_t)n == bufferSize);
+    free(buffer);
+    return ok;
+}
+
+
 @end
@@ -7,7 +7,7 @@
 //
 
 #import "CBKey.h"
-@class CBEncryptingPublicKey;
+@class CBEncryptingPublicKey, CBEncryptingSession;
 
 
 /** A Curve25519 private key used to encrypt and decrypt messages.
@@ -48,6 +48,15 @@
     forRecipient: (CBEncryptingPublicKey*)recipient
         appendTo: (NSMutableData*)output;
 
+/** Encrypts `length` bytes at `cleartext`, writing the result to `ciphertext`, which must have room
+    for `length + kCBEncryptionOverhead` bytes.
+    For details, see -encrypt:withNonce:forRecipient:. */
+- (void) encryptBytes: (const void*)cleartext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+         forRecipient: (CBEncryptingPublicKey*)recipient
+                 into: (void*)ciphertext;
+
 
 /** Decrypts a data block.
     The encrypted message must begin with a 24-byte nonce; this is the form generated by
@@ -74,6 +83,27 @@
           withNonce: (CBNonce)nonce
          fromSender: (CBEncryptingPublicKey*)sender;
 
+/** Same as -decrypt:fromSender:, but appends the decrypted message to `output`.
+    Returns NO (leaving `output` unchanged) if decryption fails. */
+- (BOOL) decrypt: (NSData*)ciphertext
+      fromSender: (CBEncryptingPublicKey*)sender
+        appendTo: (NSMutableData*)output;
+
+/** Decrypts `length` bytes at `ciphertext`, writing the result to `cleartext`, which must have room
+    for `length - kCBEncryptionOverhead` bytes. Returns NO if decryption fails, in which case the
+    contents of `cleartext` are undefined.
+    For details, see -decrypt:withNonce:fromSender:. */
+- (BOOL) decryptBytes: (const void*)ciphertext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+           fromSender: (CBEncryptingPublicKey*)sender
+                 into: (void*)cleartext;
+
+/** Returns a session object that efficiently encrypts and decrypts messages exchanged with the
+    given peer. Use this instead of the above methods when exchanging many messages with the same
+    peer, since it only has to perform the expensive key agreement once. */
+- (CBEncryptingSession*) sessionWithPeer: (CBEncryptingPublicKey*)peer;
+
 @end
 
 
@@ -8,6 +8,7 @@
 //  <https://download.libsodium.org/doc/public-key_cryptography/authenticated_encryption.html>
 
 #import "CBEncryptingPrivateKey.h"
+#import "CBEncryptingSession.h"
 #import "CBKey+Private.h"
 #import "sodium.h"
 
@@ -56,18 +57,42 @@
 }
 
 
-- (NSData*) encrypt: (NSData*)cleartext
-       forRecipient: (CBEncryptingPublicKey*)recipient
+- (void) encryptBytes: (const void*)cleartext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+         forRecipient: (CBEncryptingPublicKey*)recipient
+                 into: (void*)ciphertext
 {
     NSParameterAssert(recipient != nil);
+    crypto_box_easy(ciphertext, cleartext, length, nonce.bytes,
+                    recipient.rawKey.bytes, self.rawKey.bytes);
+}
+
 
+- (BOOL) decryptBytes: (const void*)ciphertext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+           fromSender: (CBEncryptingPublicKey*)sender
+                 into: (void*)cleartext
+{
+    NSParameterAssert(sender != nil);
+    if (length < crypto_box_MACBYTES)
+        return NO;
+    return 0 == crypto_box_open_easy(cleartext, ciphertext, length, nonce.bytes,
+                                     sender.rawKey.bytes, self.rawKey.bytes);
+}
+
+
+- (NSData*) encrypt: (NSData*)cleartext
+       forRecipient: (CBEncryptingPublicKey*)recipient
+{
     size_t clearLen = cleartext.length;
     size_t cipherLen = sizeof(CBNonce) + clearLen + crypto_box_MACBYTES;
     void* ciphertext = malloc(cipherLen);
     CBNonce* nonce = (CBNonce*)ciphertext;
     *nonce = [CBKey randomNonce];
-    crypto_box_easy(ciphertext + sizeof(CBNonce), cleartext.bytes, clearLen, (uint8_t*)nonce,
-                    recipient.rawKey.bytes, self.rawKey.bytes);
+    [self encryptBytes: cleartext.bytes length: clearLen withNonce: *nonce
+          forRecipient: recipient into: (uint8_t*)ciphertext + sizeof(CBNonce)];
     return [NSData dataWithBytesNoCopy: ciphertext length: cipherLen freeWhenDone: YES];
 }
 
@@ -76,13 +101,11 @@
           withNonce: (CBNonce)nonce
        forRecipient: (CBEncryptingPublicKey*)recipient
 {
-    NSParameterAssert(recipient != nil);
-
     size_t clearLen = cleartext.length;
     size_t cipherLen = clearLen + crypto_box_MACBYTES;
     void* ciphertext = malloc(cipherLen);
-    crypto_box_easy(ciphertext, cleartext.bytes, clearLen, nonce.bytes,
-                    recipient.rawKey.bytes, self.rawKey.bytes);
+    [self encryptBytes: cleartext.bytes length: clearLen withNonce: nonce
+          forRecipient: recipient into: ciphertext];
     return [NSData dataWithBytesNoCopy: ciphertext length: cipherLen freeWhenDone: YES];
 }
 
@@ -92,17 +115,11 @@
     forRecipient: (CBEncryptingPublicKey*)recipient
         appendTo: (NSMutableData*)output
 {
-    NSParameterAssert(recipient != nil);
-
     size_t clearLen = cleartext.length;
-    size_t cipherLen = clearLen + crypto_box_MACBYTES;
     size_t outputLen = output.length;
-
-    output.length += cipherLen;
-    void* ciphertext = (uint8_t*)output.bytes + outputLen;
-
-    crypto_box_easy(ciphertext, cleartext.bytes, clearLen, nonce.bytes,
-                    recipient.rawKey.bytes, self.rawKey.bytes);
+    output.length += clearLen + crypto_box_MACBYTES;
+    [self encryptBytes: cleartext.bytes length: clearLen withNonce: nonce
+          forRecipient: recipient into: (uint8_t*)output.mutableBytes + outputLen];
 }
 
 
@@ -111,16 +128,17 @@
          fromSender: (CBEncryptingPublicKey*)sender
 {
     NSParameterAssert(ciphertext != nil);
-    NSParameterAssert(sender != nil);
 
     if (ciphertext.length < crypto_box_MACBYTES)
         return nil;
     size_t msgLen = ciphertext.length - crypto_box_MACBYTES;
-    NSMutableData* cleartext = [NSMutableData dataWithLength: msgLen];
-    if (0 != crypto_box_open_easy(cleartext.mutableBytes, ciphertext.bytes, ciphertext.length,
-                                  nonce.bytes, sender.rawKey.bytes, self.rawKey.bytes))
+    void* cleartext = malloc(MAX(msgLen, 1u));
+    if (![self decryptBytes: ciphertext.bytes length: ciphertext.length withNonce: nonce
+                 fromSender: sender into: cleartext]) {
+        free(cleartext);
         return nil;
-    return cleartext;
+    }
+    return [NSData dataWithBytesNoCopy: cleartext length: msgLen freeWhenDone: YES];
 }
 
 
@@ -128,19 +146,45 @@
          fromSender: (CBEncryptingPublicKey*)sender
 {
     NSParameterAssert(ciphertext != nil);
-    NSParameterAssert(sender != nil);
 
     if (ciphertext.length < sizeof(CBNonce) + crypto_box_MACBYTES)
         return nil;
     size_t cipherLen = ciphertext.length - sizeof(CBNonce);
     size_t msgLen = cipherLen - crypto_box_MACBYTES;
-    NSMutableData* cleartext = [NSMutableData dataWithLength: msgLen];
-    if (0 != crypto_box_open_easy(cleartext.mutableBytes,
-                                  ciphertext.bytes + sizeof(CBNonce), cipherLen,
-                                  ciphertext.bytes,
-                                  sender.rawKey.bytes, self.rawKey.bytes))
+    void* cleartext = malloc(MAX(msgLen, 1u));
+    if (![self decryptBytes: (const uint8_t*)ciphertext.bytes + sizeof(CBNonce) length: cipherLen
+                  withNonce: *(const CBNonce*)ciphertext.bytes
+                 fromSender: sender into: cleartext]) {
+        free(cleartext);
         return nil;
-    return cleartext;
+    }
+    return [NSData dataWithBytesNoCopy: cleartext length: msgLen freeWhenDone: YES];
+}
+
+
+- (BOOL) decrypt: (NSData*)ciphertext
+      fromSender: (CBEncryptingPublicKey*)sender
+        appendTo: (NSMutableData*)output
+{
+    NSParameterAssert(ciphertext != nil);
+
+    if (ciphertext.length < sizeof(CBNonce) + crypto_box_MACBYTES)
+        return NO;
+    size_t cipherLen = ciphertext.length - sizeof(CBNonce);
+    size_t outputLen = output.length;
+    output.length += cipherLen - crypto_box_MACBYTES;
+    if (![self decryptBytes: (const uint8_t*)ciphertext.bytes + sizeof(CBNonce) length: cipherLen
+                  withNonce: *(const CBNonce*)ciphertext.bytes
+                 fromSender: sender into: (uint8_t*)output.mutableBytes + outputLen]) {
+        output.length = outputLen;
+        return NO;
+    }
+    return YES;
+}
+
+
+- (CBEncryptingSession*) sessionWithPeer: (CBEncryptingPublicKey*)peer {
+    return [[CBEncryptingSession alloc] initWithPrivateKey: self peer: peer];
 }
 
 
@@ -0,0 +1,73 @@
+//
+//  CBEncryptingSession.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBEncryptingPrivateKey.h"
+
+
+/** Encrypts and decrypts messages exchanged between a specific CBEncryptingPrivateKey and a peer's
+    public key. The expensive Curve25519 key agreement is done once, when the session is created,
+    instead of on every message, which makes this much faster than calling the CBEncryptingPrivateKey
+    methods when many messages are exchanged with the same peer.
+    The ciphertext formats are identical to the corresponding CBEncryptingPrivateKey methods, so
+    either side can use a session or not.
+    A session is immutable, so it can safely be cached and used on multiple threads at once. */
+@interface CBEncryptingSession : NSObject
+
+/** Creates a session by computing the shared secret of a private key and a peer's public key. */
+- (instancetype) initWithPrivateKey: (CBEncryptingPrivateKey*)privateKey
+                               peer: (CBEncryptingPublicKey*)peer NS_DESIGNATED_INITIALIZER;
+
+/** The public key of the local private key. */
+@property (readonly) CBEncryptingPublicKey* publicKey;
+
+/** The peer's public key. */
+@property (readonly) CBEncryptingPublicKey* peer;
+
+/** Encrypts a message to the peer, prefixed with a random nonce.
+    Equivalent to -[CBEncryptingPrivateKey encrypt:forRecipient:]. */
+- (NSData*) encrypt: (NSData*)cleartext;
+
+/** Encrypts a message to the peer with the given nonce.
+    Equivalent to -[CBEncryptingPrivateKey encrypt:withNonce:forRecipient:]. */
+- (NSData*) encrypt: (NSData*)cleartext
+          withNonce: (CBNonce)nonce;
+
+/** Same as -encrypt:withNonce:, but appends the result to `output`. */
+- (void) encrypt: (NSData*)cleartext
+       withNonce: (CBNonce)nonce
+        appendTo: (NSMutableData*)output;
+
+/** Encrypts `length` bytes at `cleartext`, writing the result to `ciphertext`, which must have room
+    for `length + kCBEncryptionOverhead` bytes. */
+- (void) encryptBytes: (const void*)cleartext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+                 into: (void*)ciphertext;
+
+/** Decrypts a message from the peer that's prefixed with its nonce.
+    Equivalent to -[CBEncryptingPrivateKey decrypt:fromSender:]. */
+- (NSData*) decrypt: (NSData*)ciphertext;
+
+/** Decrypts a message from the peer using the given nonce.
+    Equivalent to -[CBEncryptingPrivateKey decrypt:withNonce:fromSender:]. */
+- (NSData*) decrypt: (NSData*)ciphertext
+          withNonce: (CBNonce)nonce;
+
+/** Same as -decrypt:, but appends the result to `output`. Returns NO (leaving `output` unchanged)
+    if decryption fails. */
+- (BOOL) decrypt: (NSData*)ciphertext
+        appendTo: (NSMutableData*)output;
+
+/** Decrypts `length` bytes at `ciphertext`, writing the result to `cleartext`, which must have room
+    for `length - kCBEncryptionOverhead` bytes. Returns NO if decryption fails. */
+- (BOOL) decryptBytes: (const void*)ciphertext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+                 into: (void*)cleartext;
+
+@end
@@ -0,0 +1,180 @@
+//
+//  CBEncryptingSession.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+//  <https://download.libsodium.org/doc/public-key_cryptography/authenticated_encryption.html>
+//  (see "Precalculation interface")
+
+#import "CBEncryptingSession.h"
+#import "CBKey+Private.h"
+#import "sodium.h"
+
+
+@implementation CBEncryptingSession
+{
+    uint8_t _sharedKey[crypto_box_BEFORENMBYTES];
+}
+
+@synthesize publicKey=_publicKey, peer=_peer;
+
+
+- (instancetype) init {
+    @throw [NSException exceptionWithName: NSInternalInconsistencyException
+                                   reason: @"CBEncryptingSession needs keys" userInfo: nil];
+    return [self initWithPrivateKey: nil peer: nil];
+}
+
+
+- (instancetype) initWithPrivateKey: (CBEncryptingPrivateKey*)privateKey
+                               peer: (CBEncryptingPublicKey*)peer
+{
+    NSParameterAssert(privateKey != nil);
+    NSParameterAssert(peer != nil);
+    self = [super init];
+    if (self) {
+        _publicKey = privateKey.publicKey;
+        _peer = peer;
+        if (crypto_box_beforenm(_sharedKey, peer.rawKey.bytes, privateKey.rawKey.bytes) != 0)
+            return nil;
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    // Don't leave key data lying around in RAM
+    sodium_memzero(_sharedKey, sizeof(_sharedKey));
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%@ <-> %@]",
+            [self class], _publicKey.keyData, _peer.keyData];
+}
+
+
+- (void) encryptBytes: (const void*)cleartext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+                 into: (void*)ciphertext
+{
+    crypto_box_easy_afternm(ciphertext, cleartext, length, nonce.bytes, _sharedKey);
+}
+
+
+- (BOOL) decryptBytes: (const void*)ciphertext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+                 into: (void*)cleartext
+{
+    if (length < crypto_box_MACBYTES)
+        return NO;
+    return 0 == crypto_box_open_easy_afternm(cleartext, ciphertext, length, nonce.bytes,
+                                             _sharedKey);
+}
+
+
+- (CBGroupHint) groupHintForNonce: (CBNonce)nonce {
+    uint8_t hash[crypto_generichash_BYTES_MIN];
+    crypto_generichash(hash, sizeof(hash), nonce.bytes, sizeof(nonce.bytes),
+                       _sharedKey, sizeof(_sharedKey));
+    CBGroupHint hint;
+    memcpy(&hint, hash, sizeof(hint));
+    return hint;
+}
+
+
+- (NSData*) encrypt: (NSData*)cleartext {
+    size_t clearLen = cleartext.length;
+    size_t cipherLen = sizeof(CBNonce) + clearLen + crypto_box_MACBYTES;
+    void* ciphertext = malloc(cipherLen);
+    CBNonce* nonce = (CBNonce*)ciphertext;
+    *nonce = [CBKey randomNonce];
+    [self encryptBytes: cleartext.bytes length: clearLen withNonce: *nonce
+                  into: (uint8_t*)ciphertext + sizeof(CBNonce)];
+    return [NSData dataWithBytesNoCopy: ciphertext length: cipherLen freeWhenDone: YES];
+}
+
+
+- (NSData*) encrypt: (NSData*)cleartext
+          withNonce: (CBNonce)nonce
+{
+    size_t clearLen = cleartext.length;
+    size_t cipherLen = clearLen + crypto_box_MACBYTES;
+    void* ciphertext = malloc(cipherLen);
+    [self encryptBytes: cleartext.bytes length: clearLen withNonce: nonce into: ciphertext];
+    return [NSData dataWithBytesNoCopy: ciphertext length: cipherLen freeWhenDone: YES];
+}
+
+
+- (void) encrypt: (NSData*)cleartext
+       withNonce: (CBNonce)nonce
+        appendTo: (NSMutableData*)output
+{
+    size_t clearLen = cleartext.length;
+    size_t outputLen = output.length;
+    output.length += clearLen + crypto_box_MACBYTES;
+    [self encryptBytes: cleartext.bytes length: clearLen withNonce: nonce
+                  into: (uint8_t*)output.mutableBytes + outputLen];
+}
+
+
+- (NSData*) decrypt: (NSData*)ciphertext {
+    NSParameterAssert(ciphertext != nil);
+
+    if (ciphertext.length < sizeof(CBNonce) + crypto_box_MACBYTES)
+        return nil;
+    size_t cipherLen = ciphertext.length - sizeof(CBNonce);
+    size_t msgLen = cipherLen - crypto_box_MACBYTES;
+    void* cleartext = malloc(MAX(msgLen, 1u));
+    if (![self decryptBytes: (const uint8_t*)ciphertext.bytes + sizeof(CBNonce) length: cipherLen
+                  withNonce: *(const CBNonce*)ciphertext.bytes into: cleartext]) {
+        free(cleartext);
+        return nil;
+    }
+    return [NSData dataWithBytesNoCopy: cleartext length: msgLen freeWhenDone: YES];
+}
+
+
+- (NSData*) decrypt: (NSData*)ciphertext
+          withNonce: (CBNonce)nonce
+{
+    NSParameterAssert(ciphertext != nil);
+
+    if (ciphertext.length < crypto_box_MACBYTES)
+        return nil;
+    size_t msgLen = ciphertext.length - crypto_box_MACBYTES;
+    void* cleartext = malloc(MAX(msgLen, 1u));
+    if (![self decryptBytes: ciphertext.bytes length: ciphertext.length withNonce: nonce
+                       into: cleartext]) {
+        free(cleartext);
+        return nil;
+    }
+    return [NSData dataWithBytesNoCopy: cleartext length: msgLen freeWhenDone: YES];
+}
+
+
+- (BOOL) decrypt: (NSData*)ciphertext
+        appendTo: (NSMutableData*)output
+{
+    NSParameterAssert(ciphertext != nil);
+
+    if (ciphertext.length < sizeof(CBNonce) + crypto_box_MACBYTES)
+        return NO;
+    size_t cipherLen = ciphertext.length - sizeof(CBNonce);
+    size_t outputLen = output.length;
+    output.length += cipherLen - crypto_box_MACBYTES;
+    if (![self decryptBytes: (const uint8_t*)ciphertext.bytes + sizeof(CBNonce) length: cipherLen
+                  withNonce: *(const CBNonce*)ciphertext.bytes
+                       into: (uint8_t*)output.mutableBytes + outputLen]) {
+        output.length = outputLen;
+        return NO;
+    }
+    return YES;
+}
+
+
+@end
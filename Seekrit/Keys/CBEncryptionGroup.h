@@ -0,0 +1,65 @@
+//
+//  CBEncryptionGroup.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBEncryptingPrivateKey.h"
+
+
+/** A persistent set of group members, for sending and receiving many group messages.
+    It keeps a CBEncryptingSession with each member, so the expensive Curve25519 key agreement is
+    done once when a member is added, instead of on every message; encrypting a message then costs
+    one symmetric encryption per recipient.
+    Messages are in the same format as -[CBEncryptingPrivateKey encryptGroupMessage:forRecipients:],
+    so either side can use a group or not.
+    A group can be used on multiple threads at once. */
+@interface CBEncryptionGroup : NSObject
+
+/** Creates a group whose messages are encrypted and decrypted with the given private key.
+    @param privateKey  The local key.
+    @param members  An array of CBEncryptingPublicKey objects; may be nil. */
+- (instancetype) initWithPrivateKey: (CBEncryptingPrivateKey*)privateKey
+                            members: (NSArray*)members NS_DESIGNATED_INITIALIZER;
+
+/** The public key of the local private key. */
+@property (readonly) CBEncryptingPublicKey* publicKey;
+
+/** The members' public keys, in the order they were added. */
+@property (readonly) NSArray* members;
+
+/** The number of members. */
+@property (readonly) NSUInteger count;
+
+- (BOOL) containsMember: (CBEncryptingPublicKey*)member;
+
+/** Adds a member, computing its shared key. Returns NO if it was already a member. */
+- (BOOL) addMember: (CBEncryptingPublicKey*)member;
+
+/** Removes a member. Returns NO if it wasn't a member. */
+- (BOOL) removeMember: (CBEncryptingPublicKey*)member;
+
+/** Encrypts a message so that any current member can decipher it. */
+- (NSData*) encryptMessage: (NSData*)cleartext;
+
+/** Decrypts a group message. If the sender is a member, its cached session is used; otherwise
+    this is as expensive as -[CBEncryptingPrivateKey decryptGroupMessage:fromSender:]. */
+- (NSData*) decryptMessage: (NSData*)ciphertext
+                fromSender: (CBEncryptingPublicKey*)sender;
+
+/** Encrypts a stream so that any current member can decipher it.
+    Same as -[CBEncryptingPrivateKey encryptGroupStream:toStream:forRecipients:error:]. */
+- (BOOL) encryptStream: (NSInputStream*)input
+              toStream: (NSOutputStream*)output
+                 error: (NSError**)outError;
+
+/** Decrypts a streaming group message.
+    Same as -[CBEncryptingPrivateKey decryptGroupStream:toStream:fromSender:error:]. */
+- (BOOL) decryptStream: (NSInputStream*)input
+              toStream: (NSOutputStream*)output
+            fromSender: (CBEncryptingPublicKey*)sender
+                 error: (NSError**)outError;
+
+@end
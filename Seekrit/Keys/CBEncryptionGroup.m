@@ -0,0 +1,177 @@
+//
+//  CBEncryptionGroup.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBEncryptionGroup.h"
+#import "CBKey+Private.h"
+#import "CBSymmetricKey.h"
+#import "MYErrorUtils.h"
+
+
+@implementation CBEncryptionGroup
+{
+    CBEncryptingPrivateKey* _privateKey;
+    NSMutableArray* _sessions;              // CBEncryptingSessions, in the order added
+    NSMutableDictionary* _sessionsByKey;    // member's keyData -> CBEncryptingSession
+}
+
+
+- (instancetype) init {
+    @throw [NSException exceptionWithName: NSInternalInconsistencyException
+                                   reason: @"CBEncryptionGroup needs a key" userInfo: nil];
+    return [self initWithPrivateKey: nil members: nil];
+}
+
+
+- (instancetype) initWithPrivateKey: (CBEncryptingPrivateKey*)privateKey
+                            members: (NSArray*)members
+{
+    NSParameterAssert(privateKey != nil);
+    self = [super init];
+    if (self) {
+        _privateKey = privateKey;
+        _sessions = [[NSMutableArray alloc] initWithCapacity: members.count];
+        _sessionsByKey = [[NSMutableDictionary alloc] initWithCapacity: members.count];
+        for (CBEncryptingPublicKey* member in members)
+            [self addMember: member];
+    }
+    return self;
+}
+
+
+- (NSString*) description {
+    return [NSString stringWithFormat: @"%@[%@, %lu members]",
+            [self class], _privateKey.publicKey.keyData, (unsigned long)self.count];
+}
+
+
+- (CBEncryptingPublicKey*) publicKey {
+    return _privateKey.publicKey;
+}
+
+
+- (NSArray*) members {
+    @synchronized(self) {
+        NSMutableArray* members = [NSMutableArray arrayWithCapacity: _sessions.count];
+        for (CBEncryptingSession* session in _sessions)
+            [members addObject: session.peer];
+        return members;
+    }
+}
+
+
+- (NSUInteger) count {
+    @synchronized(self) {
+        return _sessions.count;
+    }
+}
+
+
+- (BOOL) containsMember: (CBEncryptingPublicKey*)member {
+    return [self sessionWithMember: member] != nil;
+}
+
+
+- (CBEncryptingSession*) sessionWithMember: (CBEncryptingPublicKey*)member {
+    NSData* keyData = member.keyData;
+    @synchronized(self) {
+        return _sessionsByKey[keyData];
+    }
+}
+
+
+- (BOOL) addMember: (CBEncryptingPublicKey*)member {
+    NSData* keyData = member.keyData;
+    @synchronized(self) {
+        if (_sessionsByKey[keyData])
+            return NO;
+    }
+    // Do the key agreement outside the lock, so it doesn't block other threads:
+    CBEncryptingSession* session = [_privateKey sessionWithPeer: member];
+    if (!session)
+        return NO;
+    @synchronized(self) {
+        if (_sessionsByKey[keyData])
+            return NO;  // another thread added it meanwhile
+        _sessionsByKey[keyData] = session;
+        [_sessions addObject: session];
+        return YES;
+    }
+}
+
+
+- (BOOL) removeMember: (CBEncryptingPublicKey*)member {
+    NSData* keyData = member.keyData;
+    @synchronized(self) {
+        CBEncryptingSession* session = _sessionsByKey[keyData];
+        if (!session)
+            return NO;
+        [_sessionsByKey removeObjectForKey: keyData];
+        [_sessions removeObjectIdenticalTo: session];
+        return YES;
+    }
+}
+
+
+- (NSArray*) sessions {
+    @synchronized(self) {
+        return [_sessions copy];
+    }
+}
+
+
+- (NSData*) encryptMessage: (NSData*)cleartext {
+    NSArray* sessions = self.sessions;
+    return CBEncryptGroupMessage(cleartext, sessions.count,
+                                 ^CBEncryptingSession*(NSUInteger i) { return sessions[i]; },
+                                 [CBEncryptingPrivateKey randomNonce],
+                                 [CBSymmetricKey generate],
+                                 YES);
+}
+
+
+- (NSData*) decryptMessage: (NSData*)ciphertext
+                fromSender: (CBEncryptingPublicKey*)sender
+{
+    CBEncryptingSession* session = [self sessionWithMember: sender]
+                                        ?: [_privateKey sessionWithPeer: sender];
+    if (!session)
+        return nil;
+    return CBDecryptGroupMessage(ciphertext, session);
+}
+
+
+- (BOOL) encryptStream: (NSInputStream*)input
+              toStream: (NSOutputStream*)output
+                 error: (NSError**)outError
+{
+    NSParameterAssert(input && output);
+    NSArray* sessions = self.sessions;
+    return CBEncryptGroupStream(CBReaderForStream(input), CBWriterForStream(output),
+                                sessions.count,
+                                ^CBEncryptingSession*(NSUInteger i) { return sessions[i]; },
+                                outError);
+}
+
+
+- (BOOL) decryptStream: (NSInputStream*)input
+              toStream: (NSOutputStream*)output
+            fromSender: (CBEncryptingPublicKey*)sender
+                 error: (NSError**)outError
+{
+    NSParameterAssert(input && output);
+    CBEncryptingSession* session = [self sessionWithMember: sender]
+                                        ?: [_privateKey sessionWithPeer: sender];
+    if (!session)
+        return MYReturnError(outError, kCBKeyErrorDecryptionFailed, CBKeyErrorDomain,
+                             @"Invalid sender key");
+    return CBDecryptGroupStream(CBReaderForStream(input), CBWriterForStream(output), session,
+                                outError);
+}
+
+
+@end
@@ -0,0 +1,88 @@
+//
+//  CBGroupKeyTree.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBEncryptingPrivateKey.h"
+#import "CBSigningPrivateKey.h"
+@class CBSymmetricKey;
+
+
+/** Manages the shared key of a large, changing group, using a Logical Key Hierarchy (LKH.)
+    The members are the leaves of a balanced binary tree, and every node of the tree has a
+    CBSymmetricKey. Each member holds the keys on its path to the root, and the root's key is the
+    group key that messages are encrypted with.
+    When a member joins or leaves, only the keys on its path are replaced, and each new key is sent
+    encrypted with the keys of the node's two children. So a "rekey message" contains O(log n)
+    encrypted keys, instead of one per member, and costs no public-key operations except for a
+    joining member's own leaf key.
+    The manager is the only party that knows the whole tree, and signs every rekey message; members
+    use CBGroupKeyRing.
+    A tree can be used on multiple threads at once. */
+@interface CBGroupKeyTree : NSObject
+
+/** Creates an empty group. The manager's key signs the rekey messages, and (converted to an
+    encrypting key) sends each joining member its leaf key. */
+- (instancetype) initWithSigningKey: (CBSigningPrivateKey*)managerKey NS_DESIGNATED_INITIALIZER;
+
+/** The manager's public key, which members need to create a CBGroupKeyRing. */
+@property (readonly) CBVerifyingPublicKey* publicKey;
+
+/** The number of members. */
+@property (readonly) NSUInteger count;
+
+/** Incremented by every membership change. */
+@property (readonly) uint32_t epoch;
+
+/** The current group key (the root of the tree), or nil if there are no members. */
+@property (readonly) CBSymmetricKey* groupKey;
+
+- (BOOL) containsMember: (CBEncryptingPublicKey*)member;
+
+/** Adds a member, returning the rekey message that must be delivered to all the members
+    (including the new one), or nil if it was already a member. */
+- (NSData*) addMember: (CBEncryptingPublicKey*)member;
+
+/** Removes a member, returning the rekey message that must be delivered to all the remaining
+    members, or nil if it wasn't a member. The removed member can't read the message, or anything
+    encrypted with the new group key. */
+- (NSData*) removeMember: (CBEncryptingPublicKey*)member;
+
+/** Encrypts a message with the current group key. */
+- (NSData*) encrypt: (NSData*)cleartext;
+
+@end
+
+
+
+/** A member's copy of the keys of a CBGroupKeyTree: the keys on its path to the root.
+    Every rekey message has to be processed, in order, to stay in sync with the group; messages not
+    signed by the manager are rejected.
+    A key ring can be used on multiple threads at once. */
+@interface CBGroupKeyRing : NSObject
+
+/** Creates a key ring for a member, which will be able to process rekey messages after the
+    member is added to the manager's tree. */
+- (instancetype) initWithPrivateKey: (CBEncryptingPrivateKey*)memberKey
+                            manager: (CBVerifyingPublicKey*)manager NS_DESIGNATED_INITIALIZER;
+
+/** The epoch of the last rekey message processed. */
+@property (readonly) uint32_t epoch;
+
+/** The current group key, or nil if this isn't (or is no longer) a member. */
+@property (readonly) CBSymmetricKey* groupKey;
+
+/** Updates the keys from a rekey message returned by -[CBGroupKeyTree addMember:] or
+    -removeMember:. Fails if the message is corrupt, out of date or not signed by the manager, or
+    if this ring can't derive the new group key because it isn't a member; in that last case the
+    ring forgets all its keys, and its groupKey becomes nil. */
+- (BOOL) processRekeyMessage: (NSData*)message
+                       error: (NSError**)outError;
+
+/** Decrypts a message encrypted by -[CBGroupKeyTree encrypt:] in the current epoch. */
+- (NSData*) decrypt: (NSData*)ciphertext;
+
+@end
@@ -0,0 +1,523 @@
+//
+//  CBGroupKeyTree.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBGroupKeyTree.h"
+#import "CBKey+Private.h"
+#import "CBSigningPrivateKey.h"
+#import "CBSymmetricKey.h"
+#import "MYErrorUtils.h"
+#import "sodium.h"
+
+
+/*
+ Rekey message format:
+    Format byte (0xC5)           1 byte
+    Epoch                        4 bytes (big-endian)
+    Root node ID                 4 bytes (big-endian; 0 if the group is empty)
+    Welcome flag                 1 byte (1 if a welcome follows, else 0)
+    Welcome                     76 bytes: new leaf's node ID and key, encrypted by the manager for
+                                          the joining member (nonce + 36 bytes + 16 bytes overhead)
+    Entry count                  4 bytes (big-endian)
+    for each entry {
+        node ID                  4 bytes
+        wrapping node ID         4 bytes
+        node's new key          73 bytes, encrypted with the wrapping node's key, with the epoch
+                                          and both node IDs as associated data
+    }
+    Signature                   64 bytes: the manager's Ed25519 signature of all the above
+
+ Entries are ordered from the bottom of the changed path to the root, so a member can unwrap them
+ in a single pass: each new key is wrapped with the keys of both of the node's children, one of
+ which the member already has (or has just unwrapped.) An entry also tells the member which node is
+the parent of the wrapping node, so it can find its path to the root, and keep only the keys on it.
+
+ Payload format:
+    Epoch                        4 bytes (big-endian)
+    cleartext encrypted with the group key (-encrypt:associatedData:, the epoch being the AD)
+ */
+
+#define kRekeyFormat 0xC5
+
+#define kWelcomeSize        (sizeof(CBNonce) + sizeof(uint32_t) + sizeof(CBRawKey) \
+                             + kCBEncryptionOverhead)
+#define kWrappedKeySize     (sizeof(CBRawKey) + kCBAssociatedDataOverhead)
+#define kEntrySize          (2 * sizeof(uint32_t) + kWrappedKeySize)
+#define kHeaderSize         (1 + 4 + 4 + 1)
+
+
+static BOOL mkError(NSInteger code, NSString* message, NSError** outError) {
+    return MYReturnError(outError, code, CBKeyErrorDomain, @"%@", message);
+}
+
+
+static void writeUInt32(uint8_t* dst, uint32_t n) {
+    n = CFSwapInt32HostToBig(n);
+    memcpy(dst, &n, sizeof(n));
+}
+
+static uint32_t readUInt32(const uint8_t* src) {
+    uint32_t n;
+    memcpy(&n, src, sizeof(n));
+    return CFSwapInt32BigToHost(n);
+}
+
+
+// The associated data authenticated along with a wrapped key, so an entry can't be replayed in a
+// different epoch or moved to a different node.
+static NSData* wrapAssociatedData(uint32_t epoch, uint32_t nodeID, uint32_t wrapperID) {
+    uint8_t ad[3 * sizeof(uint32_t)];
+    writeUInt32(&ad[0], epoch);
+    writeUInt32(&ad[4], nodeID);
+    writeUInt32(&ad[8], wrapperID);
+    return [NSData dataWithBytes: ad length: sizeof(ad)];
+}
+
+
+static NSData* epochData(uint32_t epoch) {
+    uint8_t bytes[sizeof(uint32_t)];
+    writeUInt32(bytes, epoch);
+    return [NSData dataWithBytes: bytes length: sizeof(bytes)];
+}
+
+
+
+
+// A node in the manager's tree. Leaves have a member and no children; interior nodes have two.
+@interface CBKeyTreeNode : NSObject
+{
+    @package
+    uint32_t _nodeID;
+    CBSymmetricKey* _key;
+    __unsafe_unretained CBKeyTreeNode* _parent;
+    CBKeyTreeNode *_left, *_right;
+    CBEncryptingPublicKey* _member;
+    NSUInteger _leafCount;
+}
+@end
+
+@implementation CBKeyTreeNode
+@end
+
+
+
+
+@implementation CBGroupKeyTree
+{
+    CBSigningPrivateKey* _signingKey;
+    CBEncryptingPrivateKey* _privateKey;
+    CBKeyTreeNode* _root;
+    NSMutableDictionary* _leaves;       // member's keyData -> leaf CBKeyTreeNode
+    uint32_t _epoch;
+    uint32_t _lastNodeID;
+}
+
+
+- (instancetype) init {
+    @throw [NSException exceptionWithName: NSInternalInconsistencyException
+                                   reason: @"CBGroupKeyTree needs a key" userInfo: nil];
+    return [self initWithSigningKey: nil];
+}
+
+
+- (instancetype) initWithSigningKey: (CBSigningPrivateKey*)managerKey {
+    NSParameterAssert(managerKey != nil);
+    self = [super init];
+    if (self) {
+        _signingKey = managerKey;
+        _privateKey = managerKey.asEncryptingKey;
+        _leaves = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+- (CBVerifyingPublicKey*) publicKey {
+    return _signingKey.publicKey;
+}
+
+
+- (NSUInteger) count {
+    @synchronized(self) {
+        return _leaves.count;
+    }
+}
+
+
+- (uint32_t) epoch {
+    @synchronized(self) {
+        return _epoch;
+    }
+}
+
+
+- (CBSymmetricKey*) groupKey {
+    @synchronized(self) {
+        return _root ? _root->_key : nil;
+    }
+}
+
+
+- (BOOL) containsMember: (CBEncryptingPublicKey*)member {
+    NSData* keyData = member.keyData;
+    @synchronized(self) {
+        return _leaves[keyData] != nil;
+    }
+}
+
+
+- (CBKeyTreeNode*) newNode {
+    CBKeyTreeNode* node = [[CBKeyTreeNode alloc] init];
+    node->_nodeID = ++_lastNodeID;
+    return node;
+}
+
+
+// Puts `node` in `old`'s place in the tree.
+- (void) replaceNode: (CBKeyTreeNode*)old with: (CBKeyTreeNode*)node {
+    CBKeyTreeNode* parent = old->_parent;
+    node->_parent = parent;
+    if (!parent)
+        _root = node;
+    else if (parent->_left == old)
+        parent->_left = node;
+    else
+        parent->_right = node;
+}
+
+
+// Gives every node from `node` up to the root a new key, and appends entries to `entries` that
+// wrap each new key with the keys of its children.
+- (uint32_t) rekeyPathFrom: (CBKeyTreeNode*)node into: (NSMutableData*)entries {
+    uint32_t count = 0;
+    for (; node; node = node->_parent) {
+        node->_key = [CBSymmetricKey generate];
+        NSData* keyData = node->_key.keyData;
+        for (CBKeyTreeNode* child in @[node->_left, node->_right]) {
+            uint8_t ids[2 * sizeof(uint32_t)];
+            writeUInt32(&ids[0], node->_nodeID);
+            writeUInt32(&ids[4], child->_nodeID);
+            [entries appendBytes: ids length: sizeof(ids)];
+            [child->_key encrypt: keyData
+                  associatedData: wrapAssociatedData(_epoch, node->_nodeID, child->_nodeID)
+                        appendTo: entries];
+            ++count;
+        }
+    }
+    return count;
+}
+
+
+- (NSData*) rekeyMessageWithWelcome: (NSData*)welcome
+                            entries: (NSData*)entries
+                              count: (uint32_t)count
+{
+    NSMutableData* message = [NSMutableData dataWithLength: kHeaderSize];
+    uint8_t* header = message.mutableBytes;
+    header[0] = kRekeyFormat;
+    writeUInt32(&header[1], _epoch);
+    writeUInt32(&header[5], _root ? _root->_nodeID : 0);
+    header[9] = (welcome != nil);
+    if (welcome)
+        [message appendData: welcome];
+    uint8_t countBytes[sizeof(uint32_t)];
+    writeUInt32(countBytes, count);
+    [message appendBytes: countBytes length: sizeof(countBytes)];
+    [message appendData: entries];
+    CBSignature signature = [_signingKey signData: message];
+    [message appendBytes: &signature length: sizeof(signature)];
+    return message;
+}
+
+
+- (NSData*) addMember: (CBEncryptingPublicKey*)member {
+    NSData* keyData = member.keyData;
+    @synchronized(self) {
+        if (_leaves[keyData])
+            return nil;
+        CBKeyTreeNode* leaf = [self newNode];
+        leaf->_member = member;
+        leaf->_key = [CBSymmetricKey generate];
+        leaf->_leafCount = 1;
+        _leaves[keyData] = leaf;
+        ++_epoch;
+
+        // Send the member its leaf key:
+        uint8_t welcome[sizeof(uint32_t) + sizeof(CBRawKey)];
+        writeUInt32(welcome, leaf->_nodeID);
+        CBRawKey rawKey = leaf->_key.rawKey;
+        memcpy(&welcome[sizeof(uint32_t)], &rawKey, sizeof(rawKey));
+        NSData* welcomeData = [_privateKey encrypt: [NSData dataWithBytes: welcome
+                                                                   length: sizeof(welcome)]
+                                      forRecipient: member];
+        sodium_memzero(&rawKey, sizeof(rawKey));
+        sodium_memzero(welcome, sizeof(welcome));
+
+        NSMutableData* entries = [NSMutableData data];
+        uint32_t count = 0;
+        if (!_root) {
+            _root = leaf;
+        } else {
+            // Split the leaf with the fewest leaves on the way to it, keeping the tree balanced:
+            CBKeyTreeNode* target = _root;
+            while (target->_left) {
+                ++target->_leafCount;
+                target = (target->_left->_leafCount <= target->_right->_leafCount)
+                                ? target->_left : target->_right;
+            }
+            CBKeyTreeNode* parent = [self newNode];
+            [self replaceNode: target with: parent];
+            parent->_left = target;
+            parent->_right = leaf;
+            parent->_leafCount = 2;
+            target->_parent = leaf->_parent = parent;
+            count = [self rekeyPathFrom: parent into: entries];
+        }
+        return [self rekeyMessageWithWelcome: welcomeData entries: entries count: count];
+    }
+}
+
+
+- (NSData*) removeMember: (CBEncryptingPublicKey*)member {
+    NSData* keyData = member.keyData;
+    @synchronized(self) {
+        CBKeyTreeNode* leaf = _leaves[keyData];
+        if (!leaf)
+            return nil;
+        [_leaves removeObjectForKey: keyData];
+        ++_epoch;
+
+        NSMutableData* entries = [NSMutableData data];
+        uint32_t count = 0;
+        CBKeyTreeNode* parent = leaf->_parent;
+        if (!parent) {
+            _root = nil;
+        } else {
+            // The leaf's sibling takes its parent's place, and everything above gets new keys.
+            // (If the sibling becomes the root, the leaving member never had its key anyway.)
+            CBKeyTreeNode* sibling = (parent->_left == leaf) ? parent->_right : parent->_left;
+            [self replaceNode: parent with: sibling];
+            for (CBKeyTreeNode* node = sibling->_parent; node; node = node->_parent)
+                --node->_leafCount;
+            count = [self rekeyPathFrom: sibling->_parent into: entries];
+        }
+        return [self rekeyMessageWithWelcome: nil entries: entries count: count];
+    }
+}
+
+
+- (NSData*) encrypt: (NSData*)cleartext {
+    uint32_t epoch;
+    CBSymmetricKey* groupKey;
+    @synchronized(self) {
+        epoch = _epoch;
+        groupKey = _root ? _root->_key : nil;
+    }
+    if (!groupKey)
+        return nil;
+    NSData* epochBytes = epochData(epoch);
+    NSMutableData* output = [epochBytes mutableCopy];
+    [groupKey encrypt: cleartext associatedData: epochBytes appendTo: output];
+    return output;
+}
+
+
+@end
+
+
+
+
+@implementation CBGroupKeyRing
+{
+    CBVerifyingPublicKey* _manager;
+    CBEncryptingSession* _managerSession;
+    uint32_t _leafID;
+    NSMutableDictionary* _keys;             // node ID (NSNumber) -> CBSymmetricKey, on my path
+    NSMutableDictionary* _parents;          // node ID (NSNumber) -> parent's node ID, on my path
+    uint32_t _epoch;
+    CBSymmetricKey* _groupKey;
+}
+
+
+- (instancetype) init {
+    @throw [NSException exceptionWithName: NSInternalInconsistencyException
+                                   reason: @"CBGroupKeyRing needs keys" userInfo: nil];
+    return [self initWithPrivateKey: nil manager: nil];
+}
+
+
+- (instancetype) initWithPrivateKey: (CBEncryptingPrivateKey*)memberKey
+                            manager: (CBVerifyingPublicKey*)manager
+{
+    NSParameterAssert(memberKey != nil);
+    NSParameterAssert(manager != nil);
+    self = [super init];
+    if (self) {
+        _manager = manager;
+        // Welcomes are decrypted with a session, so only the first one costs a key agreement:
+        _managerSession = [memberKey sessionWithPeer: manager.asEncryptingPublicKey];
+        if (!_managerSession)
+            return nil;
+        _keys = [[NSMutableDictionary alloc] init];
+        _parents = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+- (uint32_t) epoch {
+    @synchronized(self) {
+        return _epoch;
+    }
+}
+
+
+- (CBSymmetricKey*) groupKey {
+    @synchronized(self) {
+        return _groupKey;
+    }
+}
+
+
+- (BOOL) processRekeyMessage: (NSData*)message
+                       error: (NSError**)outError
+{
+    const uint8_t* bytes = message.bytes;
+    size_t length = message.length;
+    if (length < kHeaderSize + sizeof(CBSignature))
+        return mkError(kCBKeyErrorTruncated, @"Rekey message is truncated", outError);
+    if (bytes[0] != kRekeyFormat || bytes[9] > 1)
+        return mkError(kCBKeyErrorUnknownFormat, @"Unknown rekey message format", outError);
+
+    // Only the manager can change the group's keys; any member could otherwise wrap a key of its
+    // choosing for the others:
+    length -= sizeof(CBSignature);
+    CBSignature signature;
+    memcpy(&signature, &bytes[length], sizeof(signature));
+    NSData* signedData = [[NSData alloc] initWithBytesNoCopy: (void*)bytes
+                                                      length: length
+                                                freeWhenDone: NO];
+    if (![_manager verifySignature: signature ofData: signedData])
+        return mkError(kCBKeyErrorDecryptionFailed, @"Rekey message isn't signed by the manager",
+                       outError);
+
+    uint32_t epoch = readUInt32(&bytes[1]);
+    uint32_t rootID = readUInt32(&bytes[5]);
+    BOOL hasWelcome = bytes[9];
+    size_t pos = kHeaderSize + (hasWelcome ? kWelcomeSize : 0);
+    if (length < pos + sizeof(uint32_t))
+        return mkError(kCBKeyErrorTruncated, @"Rekey message is truncated", outError);
+    uint32_t count = readUInt32(&bytes[pos]);
+    pos += sizeof(uint32_t);
+    if ((length - pos) / kEntrySize < count)
+        return mkError(kCBKeyErrorTruncated, @"Rekey message is truncated", outError);
+
+    @synchronized(self) {
+        if (epoch <= _epoch)
+            return mkError(kCBKeyErrorDecryptionFailed, @"Rekey message is out of date",
+                           outError);
+        uint32_t leafID = _leafID;
+        NSMutableDictionary* keys = [_keys mutableCopy];
+        NSMutableDictionary* parents = [_parents mutableCopy];
+
+        // A welcome that decrypts is addressed to me, so I've (re)joined with a new leaf:
+        if (hasWelcome) {
+            NSData* welcome = [[NSData alloc] initWithBytesNoCopy: (void*)&bytes[kHeaderSize]
+                                                           length: kWelcomeSize
+                                                     freeWhenDone: NO];
+            NSData* leaf = [_managerSession decrypt: welcome];
+            if (leaf.length == sizeof(uint32_t) + sizeof(CBRawKey)) {
+                leafID = readUInt32(leaf.bytes);
+                [keys removeAllObjects];
+                [parents removeAllObjects];
+                keys[@(leafID)] = [[CBSymmetricKey alloc] initWithKeyData:
+                                   [leaf subdataWithRange: NSMakeRange(sizeof(uint32_t),
+                                                                       sizeof(CBRawKey))]];
+            }
+        }
+
+        // Note each wrapping node's parent, and forget the old keys of the nodes being rekeyed, so
+        // a stale key can't pass for a new one:
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t nodeID = readUInt32(&bytes[pos + i * kEntrySize]);
+            uint32_t wrapperID = readUInt32(&bytes[pos + i * kEntrySize + sizeof(uint32_t)]);
+            parents[@(wrapperID)] = @(nodeID);
+            [keys removeObjectForKey: @(nodeID)];
+        }
+
+        // Unwrap every entry whose wrapping key I have:
+        for (uint32_t i = 0; i < count; i++, pos += kEntrySize) {
+            uint32_t nodeID = readUInt32(&bytes[pos]);
+            uint32_t wrapperID = readUInt32(&bytes[pos + sizeof(uint32_t)]);
+            CBSymmetricKey* wrapper = keys[@(wrapperID)];
+            if (!wrapper)
+                continue;
+            NSData* wrapped = [[NSData alloc] initWithBytesNoCopy:
+                                                    (void*)&bytes[pos + 2 * sizeof(uint32_t)]
+                                                           length: kWrappedKeySize
+                                                     freeWhenDone: NO];
+            NSData* keyData = [wrapper decrypt: wrapped
+                                associatedData: wrapAssociatedData(epoch, nodeID, wrapperID)];
+            if (keyData.length != sizeof(CBRawKey))
+                return mkError(kCBKeyErrorDecryptionFailed, @"Rekey message is corrupt",
+                               outError);
+            keys[@(nodeID)] = [[CBSymmetricKey alloc] initWithKeyData: keyData];
+        }
+
+        // Keep only the keys on the path from my leaf to the root. Any others (like the key of a
+        // parent node removed along with a sibling) would let me read rekeys meant for others.
+        NSMutableDictionary* pathKeys = [NSMutableDictionary dictionary];
+        NSMutableDictionary* pathParents = [NSMutableDictionary dictionary];
+        CBSymmetricKey* groupKey = nil;
+        NSNumber* node = leafID ? @(leafID) : nil;
+        for (NSUInteger steps = 0; node && keys[node] && steps <= parents.count; ++steps) {
+            pathKeys[node] = keys[node];
+            if (node.unsignedIntValue == rootID) {
+                groupKey = keys[node];
+                break;
+            }
+            NSNumber* parent = parents[node];
+            if (parent)
+                pathParents[node] = parent;
+            node = parent;
+        }
+
+        _epoch = epoch;
+        if (!groupKey) {
+            // I've been removed, so forget everything:
+            _leafID = 0;
+            [_keys removeAllObjects];
+            [_parents removeAllObjects];
+            _groupKey = nil;
+            return mkError(kCBKeyErrorDecryptionFailed, @"Not a member of the group", outError);
+        }
+        _leafID = leafID;
+        _keys = pathKeys;
+        _parents = pathParents;
+        _groupKey = groupKey;
+        return YES;
+    }
+}
+
+
+- (NSData*) decrypt: (NSData*)ciphertext {
+    if (ciphertext.length < sizeof(uint32_t))
+        return nil;
+    uint32_t epoch = readUInt32(ciphertext.bytes);
+    CBSymmetricKey* groupKey;
+    @synchronized(self) {
+        if (epoch != _epoch)
+            return nil;
+        groupKey = _groupKey;
+    }
+    NSRange range = NSMakeRange(sizeof(uint32_t), ciphertext.length - sizeof(uint32_t));
+    NSData* encrypted = [ciphertext subdataWithRange: range];
+    return [groupKey decrypt: encrypted associatedData: epochData(epoch)];
+}
+
+
+@end
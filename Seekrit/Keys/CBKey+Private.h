@@ -7,6 +7,7 @@
 //
 
 #import "CBKey.h"
+#import "CBEncryptingSession.h"
 
 
 /** Seed data to create a key-pair. (256 bits, 32 bytes) */
@@ -27,3 +28,75 @@ typedef struct {
 + (void) useTestKeychain; // Unit tests should use this
 #endif
 @end
+
+
+/** Reads up to `length` bytes. Returns the number of bytes read, which will be less than `length`
+    only at EOF, or -1 on error. */
+typedef ssize_t (^CBStreamReader)(void* buffer, size_t length, NSError** outError);
+
+/** Writes `length` bytes. */
+typedef BOOL (^CBStreamWriter)(const void* buffer, size_t length, NSError** outError);
+
+CBStreamReader CBReaderForStream(NSInputStream* stream);
+CBStreamWriter CBWriterForStream(NSOutputStream* stream);
+CBStreamReader CBReaderForFD(int fd);
+CBStreamWriter CBWriterForFD(int fd);
+
+/** Encrypts everything `reader` returns, writing the streaming format of
+    CBSymmetricKey+Streaming (header and chunks) to `writer`. */
+BOOL CBEncryptChunks(const CBRawKey* key,
+                     CBStreamReader reader, CBStreamWriter writer,
+                     NSError** outError);
+
+/** Decrypts the streaming format read from `reader`, writing each chunk to `writer` as soon as
+    it's been authenticated. Fails if anything follows the last chunk. */
+BOOL CBDecryptChunks(const CBRawKey* key,
+                     CBStreamReader reader, CBStreamWriter writer,
+                     NSError** outError);
+
+
+/** A short tag for a recipient's slot in a group message, that can only be computed by the sender
+    and the recipient. (A hash of the message's nonce, keyed with the session's shared key.) */
+typedef UInt32 CBGroupHint;
+
+@interface CBEncryptingSession ()
+- (CBGroupHint) groupHintForNonce: (CBNonce)nonce;
+@end
+
+
+@class CBSymmetricKey;
+
+/** Encodes a group message addressed to the peers of `count` sessions, using the given nonce and
+    session key. `sessionAtIndex` may be called on multiple threads at once if `parallel` is YES.
+    Returns nil if it returns nil for any recipient. */
+NSData* CBEncryptGroupMessage(NSData* cleartext,
+                              NSUInteger count,
+                              CBEncryptingSession* (^sessionAtIndex)(NSUInteger),
+                              CBNonce nonce,
+                              CBSymmetricKey* sessionKey,
+                              BOOL parallel);
+
+/** Decrypts a group message using the session between the recipient and the sender. */
+NSData* CBDecryptGroupMessage(NSData* input, CBEncryptingSession* session);
+
+/** Encrypts everything `reader` returns as a streaming (version 2) group message.
+    Fails without writing anything if `sessionAtIndex` returns nil for any recipient. */
+BOOL CBEncryptGroupStream(CBStreamReader reader, CBStreamWriter writer,
+                          NSUInteger count,
+                          CBEncryptingSession* (^sessionAtIndex)(NSUInteger),
+                          NSError** outError);
+
+/** Decrypts a streaming group message, writing each chunk to `writer` once it's authenticated. */
+BOOL CBDecryptGroupStream(CBStreamReader reader, CBStreamWriter writer,
+                          CBEncryptingSession* session,
+                          NSError** outError);
+
+@interface CBEncryptingPrivateKey (GroupEncryptionInternal)
+/** Group encryption with a given nonce and session key. If `parallel` is NO, the recipients are
+    processed one at a time on the current thread; the output is the same either way. */
+- (NSData*) encryptGroupMessage: (NSData*)cleartext
+                  forRecipients: (NSArray*)recipients
+                      withNonce: (CBNonce)nonce
+                     sessionKey: (CBSymmetricKey*)sessionKey
+                       parallel: (BOOL)parallel;
+@end
@@ -19,6 +19,22 @@ typedef struct {
     uint8_t bytes[24];
 } CBNonce;
 
+/** The number of bytes by which an encrypted message is longer than its cleartext; this is the
+    size of the authentication code (MAC) added to it. Methods that prefix the ciphertext with a
+    nonce add another sizeof(CBNonce) bytes. */
+#define kCBEncryptionOverhead 16
+
+
+/** NSError domain for errors returned by the key classes. */
+extern NSString* const CBKeyErrorDomain;
+
+enum {
+    kCBKeyErrorDecryptionFailed = 1,    // Ciphertext is corrupt or wasn't encrypted with this key
+    kCBKeyErrorTruncated,               // Ciphertext ended prematurely
+    kCBKeyErrorUnknownFormat,           // Ciphertext is in an unknown format or version
+    kCBKeyErrorInvalidKey,              // A public key given as input is invalid
+};
+
 
 
 @protocol CBEncrypting <NSObject>
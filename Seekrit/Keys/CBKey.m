@@ -38,6 +38,9 @@ static NSString* secErrorString(OSStatus code);
         assert(crypto_box_SECRETKEYBYTES == sizeof(CBRawKey));
         assert(crypto_box_SEEDBYTES == sizeof(CBKeySeed));
         assert(crypto_box_NONCEBYTES == sizeof(CBNonce));
+        assert(crypto_secretbox_NONCEBYTES == sizeof(CBNonce));
+        assert(crypto_box_MACBYTES == kCBEncryptionOverhead);
+        assert(crypto_secretbox_MACBYTES == kCBEncryptionOverhead);
         assert(crypto_sign_PUBLICKEYBYTES == sizeof(CBRawKey));
         assert(crypto_sign_SEEDBYTES == sizeof(CBKeySeed));
         assert(crypto_sign_BYTES == sizeof(CBSignature));
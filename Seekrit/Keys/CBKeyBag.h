@@ -6,13 +6,17 @@
 //  Copyright (c) 2014 The Mooseyard. All rights reserved.
 //
 
-#import "CBKey.h"
-@class CBSymmetricKey;
+#import "CBSymmetricKey.h"
 
 
 /** Simple, lightweight (but secure) database of CBSymmetricKeys.
-    The KeyBag is persisted to a single file that's encrypted using a master symmetric key
-    stored in the Keychain. */
+    The KeyBag is persisted to a file whose contents are encrypted using a master symmetric key
+    stored in the Keychain. The file is memory-mapped and indexed by clue, so opening a KeyBag is
+    fast regardless of its size, and each key is only decrypted when it's first used.
+    Changes are appended to an encrypted journal file alongside it (with a ".journal" extension),
+    which is periodically merged into the main file in the background.
+    A KeyBag can be used on multiple threads at once. Lookups and decryption don't lock, so
+    decryption throughput scales with the number of cores; changes are serialized. */
 @interface CBKeyBag : NSObject <CBDecrypting>
 
 /** Opens or creates a KeyBag with an app-defined identifier.
@@ -33,9 +37,15 @@
 /** The filesystem path to which the KeyBag is saved. */
 @property (readonly) NSString* path;
 
-/** Saves the KeyBag immediately. (The KeyBag will also auto-save changes.) */
+/** Ensures all changes are durably saved to disk. (Changes are written to the journal as they're
+    made, but it isn't flushed to disk until this is called.) */
 - (BOOL) save: (NSError**)outError;
 
+/** Rewrites the KeyBag file to include all changes, and deletes the journal. This happens
+    automatically in the background once the journal gets long enough, so it's rarely necessary
+    to call this. */
+- (BOOL) compact: (NSError**)outError;
+
 /** Adds a key. Returns YES if the key was new, NO if it already exists. */
 - (BOOL) addKey: (CBSymmetricKey*)key;
 
@@ -49,9 +59,20 @@
 /** Returns all identifiers that have keys associcated. */
 @property (readonly) NSArray* allIdentifiers;
 
+/** The secret key the KeyBag uses to compute keyed clues. It's randomly generated when the KeyBag
+    is created, and saved with it. */
+@property (readonly) CBClueKey clueKey;
+
+/** Encrypts a message with the given key, prefixing it with a keyed clue computed with this
+    KeyBag's clueKey. This allows the KeyBag to find the right key to decrypt it with in constant
+    time, no matter how many keys it holds. (The key should already be in the KeyBag, or else
+    the KeyBag won't be able to decrypt the message!) */
+- (NSData*) encrypt: (NSData*)cleartext
+            withKey: (CBSymmetricKey*)key;
+
 /** Decrypts a ciphertext, trying all appropriate keys.
     IMPORTANT: The ciphertext must contain a clue, i.e. must have been generated using
-    -[CBSymmetricKey encryptWithClue:]. */
+    -[CBKeyBag encrypt:withKey:] or -[CBSymmetricKey encryptWithClue:]. */
 - (NSData*) decrypt: (NSData*)ciphertext;
 
 /** Decrypts a ciphertext, trying all appropriate keys.
@@ -59,4 +80,10 @@
 - (NSData*) decrypt: (NSData*)encrypted
             usedKey: (CBSymmetricKey**)outKey;
 
+/** Decrypts a ciphertext, trying all appropriate keys, and appends the cleartext to `output`.
+    Returns the key that decrypted it, or nil on failure (leaving `output` unchanged.)
+    Reusing the same `output` buffer avoids allocating memory for every message. */
+- (CBSymmetricKey*) decrypt: (NSData*)encrypted
+                   appendTo: (NSMutableData*)output;
+
 @end
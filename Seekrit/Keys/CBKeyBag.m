@@ -7,15 +7,150 @@
 //
 
 #import "CBKeyBag.h"
+#import "CBKeyBagFile.h"
+#import "CBKeyBagJournal.h"
 #import "CBKey+Private.h"
 #import "CBSymmetricKey.h"
-#import "MYBlockUtils.h"
 #import "MYErrorUtils.h"
 #import "Test.h"
 #import <CommonCrypto/CommonCrypto.h>
 
 
+/*
+ The saved state of a KeyBag is its file (see CBKeyBagFile) plus a journal (see CBKeyBagJournal)
+ of the keys and identifiers added since the file was written. Each change is appended to the
+ journal as it's made, on a serial background queue. Once the journal gets long relative to the
+ file, the file is rewritten in the background to include the changes ("compaction") and the
+ journal is deleted. Opening a KeyBag replays the journal on top of the file. Replaying is
+ idempotent, so it's harmless if a crash leaves behind a journal that's already been compacted.
+
+ The in-memory contents are an immutable CBKeyBagState. Readers just grab the current state and
+ use it without locking. Writers, serialized by @synchronized, create a modified copy of the
+ state and publish it by setting the (atomic) state property. Journal ivars are only accessed on
+ the I/O queue.
+ */
+
+#define kMinCompactionEntries   256 // Journal must have at least this many entries to compact...
+#define kCompactionRatio        4   // ...and at least 1/kCompactionRatio as many as the file
+
+
+/** Immutable snapshot of the contents of a CBKeyBag: its file, plus the changes made since the
+    file was written. */
+@interface CBKeyBagState : NSObject
+{
+    @public
+    CBKeyBagFile* _file;            // the saved state, or nil if never saved
+    CBClueKey _clueKey;
+    // The following only contain changes made since the file was written:
+    NSArray* _unsavedKeys;          // keys in the order they were added
+    NSDictionary* _byClue;          // maps clues to arrays of keys, newest first
+    NSDictionary* _byKeyedClue;     // maps keyed clues to arrays of keys, newest first
+    NSDictionary* _byIdentifier;
+}
+@end
+
+
+@implementation CBKeyBagState
+
+
+- (instancetype) initWithFile: (CBKeyBagFile*)file clueKey: (CBClueKey)clueKey {
+    self = [super init];
+    if (self) {
+        _file = file;
+        _clueKey = clueKey;
+        _unsavedKeys = @[];
+        _byClue = @{};
+        _byKeyedClue = @{};
+        _byIdentifier = @{};
+    }
+    return self;
+}
+
+- (instancetype) copyState {
+    CBKeyBagState* state = [[CBKeyBagState alloc] initWithFile: _file clueKey: _clueKey];
+    state->_unsavedKeys = _unsavedKeys;
+    state->_byClue = _byClue;
+    state->_byKeyedClue = _byKeyedClue;
+    state->_byIdentifier = _byIdentifier;
+    return state;
+}
+
+- (void) dealloc {
+    memset(&_clueKey, 0, sizeof(_clueKey));
+}
+
+
+// Returns a copy of an index with a key inserted at the start of a bucket.
+static NSDictionary* addToIndex(NSDictionary* index, id clue, CBSymmetricKey* key) {
+    NSMutableDictionary* newIndex = [index mutableCopy];
+    NSArray* keys = index[clue];
+    newIndex[clue] = keys ? [@[key] arrayByAddingObjectsFromArray: keys] : @[key];
+    return newIndex;
+}
+
+
+- (BOOL) containsKey: (CBSymmetricKey*)key {
+    return [_byKeyedClue[@([key keyedClueWithClueKey: _clueKey])] containsObject: key]
+        || [_file containsKey: key];
+}
+
+- (CBSymmetricKey*) keyWithIdentifier: (NSString*)identifier {
+    return _byIdentifier[identifier] ?: [_file keyWithIdentifier: identifier];
+}
+
+- (NSArray*) allIdentifiers {
+    if (!_file)
+        return _byIdentifier.allKeys;
+    NSMutableSet* identifiers = [NSMutableSet setWithArray: _file.allIdentifiers];
+    [identifiers addObjectsFromArray: _byIdentifier.allKeys];
+    return identifiers.allObjects;
+}
+
+
+- (CBKeyBagState*) stateByAddingKey: (CBSymmetricKey*)key {
+    CBKeyBagState* state = [self copyState];
+    state->_unsavedKeys = [_unsavedKeys arrayByAddingObject: key];
+    state->_byClue = addToIndex(_byClue, @(key.clue), key);
+    state->_byKeyedClue = addToIndex(_byKeyedClue, @([key keyedClueWithClueKey: _clueKey]), key);
+    return state;
+}
+
+- (CBKeyBagState*) stateBySettingKey: (CBSymmetricKey*)key forIdentifier: (NSString*)identifier {
+    CBKeyBagState* state = [self copyState];
+    NSMutableDictionary* byIdentifier = [_byIdentifier mutableCopy];
+    byIdentifier[identifier] = key;
+    state->_byIdentifier = byIdentifier;
+    return state;
+}
+
+// Returns a state based on a newly-written file that contains the first `savedKeyCount` unsaved
+// keys, and the given identifiers.
+- (CBKeyBagState*) stateWithFile: (CBKeyBagFile*)file
+                   savedKeyCount: (NSUInteger)savedKeyCount
+                savedIdentifiers: (NSDictionary*)savedIdentifiers
+{
+    Assert(savedKeyCount <= _unsavedKeys.count);
+    CBKeyBagState* state = [[CBKeyBagState alloc] initWithFile: file clueKey: _clueKey];
+    NSRange unsaved = NSMakeRange(savedKeyCount, _unsavedKeys.count - savedKeyCount);
+    for (CBSymmetricKey* key in [_unsavedKeys subarrayWithRange: unsaved])
+        state = [state stateByAddingKey: key];
+    NSMutableDictionary* byIdentifier = [_byIdentifier mutableCopy];
+    for (NSString* identifier in savedIdentifiers) {
+        if (byIdentifier[identifier] == savedIdentifiers[identifier])
+            [byIdentifier removeObjectForKey: identifier];
+    }
+    state->_byIdentifier = byIdentifier;
+    return state;
+}
+
+
+@end
+
+
+
+
 @interface CBKeyBag  () <NSCoding>
+@property (atomic, strong) CBKeyBagState* state;
 @end
 
 
@@ -23,13 +158,15 @@
 {
     NSString* _path;
     CBSymmetricKey* _masterKey;
-    NSMutableDictionary* _store;        // maps clues to arrays of keys
-    NSMutableDictionary* _byIdentifier;
-    BOOL _dirty;
-    BOOL _autosaving;
+    CBClueKey _clueKey;
+    BOOL _compacting;                   // a compaction is scheduled (guarded by @synchronized)
+    // These are only used on _ioQueue:
+    dispatch_queue_t _ioQueue;
+    CBKeyBagJournal* _journal;
+    NSError* _ioError;                  // an error from a background write, not yet reported
 }
 
-@synthesize path=_path;
+@synthesize path=_path, clueKey=_clueKey, state=_state;
 
 
 + (NSString*) pathForIdentifier: (NSString*)identifier {
@@ -63,18 +200,26 @@
                           error: (NSError**)outError
 {
     Assert(path);
+    CBKeyBag* bag;
     NSError* error;
-    NSData* contents = [NSData dataWithContentsOfFile: path options: 0 error: &error];
-    if (!contents) {
-        if (!error.my_isFileNotFoundError) {
-            if (outError)
-                *outError = error;
-            return nil;
-        }
-        // Create empty instance
+    CBKeyBagFile* file = [CBKeyBagFile openPath: path masterKey: masterKey error: &error];
+    if (file) {
+        LogTo(KeyBag, @"Opened %@ (%lu keys) with key %@",
+              path, (unsigned long)file.count, masterKey);
+        bag = [[CBKeyBag alloc] initWithFile: file path: path masterKey: masterKey];
+    } else if (error.my_isFileNotFoundError) {
         LogTo(KeyBag, @"Created at %@ with key %@", path, masterKey);
-        return [[CBKeyBag alloc] initNewWithPath: path masterKey: masterKey];
+        bag = [[CBKeyBag alloc] initNewWithPath: path masterKey: masterKey];
+    } else if (![error.domain isEqualToString: CBKeyErrorDomain]
+                    || error.code != kCBKeyErrorUnknownFormat) {
+        if (outError)
+            *outError = error;
+        return nil;
     } else {
+        // File is in the older archived format; load it, and it'll be saved in the new format:
+        NSData* contents = [NSData dataWithContentsOfFile: path options: 0 error: outError];
+        if (!contents)
+            return nil;
         if (masterKey) {
             contents = [masterKey decrypt: contents];
             if (!contents) {
@@ -82,16 +227,23 @@
                 return nil;
             }
         }
-        CBKeyBag* bag = [NSKeyedUnarchiver unarchiveObjectWithData: contents];
+        bag = [NSKeyedUnarchiver unarchiveObjectWithData: contents];
         if (!bag) {
             MYReturnError(outError, kCCDecodeError, NSOSStatusErrorDomain, @"Can't unarchive KeyBag");
             return nil;
         }
         bag->_path = path;
         bag->_masterKey = masterKey;
-        LogTo(KeyBag, @"Loaded from %@ with key %@", path, masterKey);
-        return bag;
+        LogTo(KeyBag, @"Upgrading %@ with key %@", path, masterKey);
     }
+
+    if (![bag replayJournal: outError])
+        return nil;
+    // Write the file now if there isn't one (or it's in the old format), so the clue key is saved
+    // before any messages are encrypted with it:
+    if (!bag.state->_file && ![bag compact: outError])
+        return nil;
+    return bag;
 }
 
 
@@ -100,119 +252,344 @@
     if (self) {
         _path = path.copy;
         _masterKey = masterKey;
-        _store = [[NSMutableDictionary alloc] init];
-        _byIdentifier = [[NSMutableDictionary alloc] init];
+        _clueKey = [CBSymmetricKey randomClueKey];
+        _state = [[CBKeyBagState alloc] initWithFile: nil clueKey: _clueKey];
+        _ioQueue = dispatch_queue_create("CBKeyBag", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (instancetype) initWithFile: (CBKeyBagFile*)file
+                         path: (NSString*)path
+                    masterKey: (CBSymmetricKey*)masterKey
+{
+    self = [self initNewWithPath: path masterKey: masterKey];
+    if (self) {
+        _clueKey = file.clueKey;
+        _state = [[CBKeyBagState alloc] initWithFile: file clueKey: _clueKey];
     }
     return self;
 }
 
+// Only used to read KeyBags saved in the older NSKeyedArchiver-based format.
 - (instancetype) initWithCoder: (NSCoder*)decoder {
-    self = [super init];
+    self = [self initNewWithPath: nil masterKey: nil];
     if (self) {
-        _store = [decoder decodeObjectForKey: @"store"];
-        _byIdentifier = [decoder decodeObjectForKey: @"byIdentifier"];
+        NSDictionary* store = [decoder decodeObjectForKey: @"store"];
+        NSDictionary* byIdentifier = [decoder decodeObjectForKey: @"byIdentifier"];
+        if (!store || !byIdentifier)
+            return nil;
+        NSUInteger length;
+        const void* clueKey = [decoder decodeBytesForKey: @"clueKey" returnedLength: &length];
+        if (clueKey && length == sizeof(CBClueKey)) {
+            memcpy(&_clueKey, clueKey, sizeof(CBClueKey));
+            _state = [[CBKeyBagState alloc] initWithFile: nil clueKey: _clueKey];
+        }
+        // (else the bag was saved by an older version, and keeps the random clue key)
+        for (NSArray* keys in store.objectEnumerator) {
+            for (CBSymmetricKey* key in keys.reverseObjectEnumerator)
+                [self addKey: key identifier: nil journal: NO];
+        }
+        for (NSString* identifier in byIdentifier)
+            [self addKey: byIdentifier[identifier] identifier: identifier journal: NO];
     }
     return self;
 }
 
+// Writes the older format. Only used for testing upgrades.
 - (void) encodeWithCoder:(NSCoder *)encoder {
-    [encoder encodeObject: _store forKey: @"store"];
-    [encoder encodeObject: _byIdentifier forKey: @"byIdentifier"];
+    CBKeyBagState* state = self.state;
+    NSMutableDictionary* store = [NSMutableDictionary dictionary];
+    for (NSArray* keys in @[state->_file.allKeys ?: @[], state->_unsavedKeys]) {
+        for (CBSymmetricKey* key in keys) {
+            id clue = @(key.clue);
+            if (!store[clue])
+                store[clue] = [NSMutableArray array];
+            [store[clue] insertObject: key atIndex: 0];
+        }
+    }
+    NSMutableDictionary* byIdentifier = [NSMutableDictionary dictionary];
+    for (NSString* identifier in [state allIdentifiers])
+        byIdentifier[identifier] = [state keyWithIdentifier: identifier];
+    [encoder encodeObject: store forKey: @"store"];
+    [encoder encodeObject: byIdentifier forKey: @"byIdentifier"];
+    [encoder encodeBytes: _clueKey.bytes length: sizeof(_clueKey) forKey: @"clueKey"];
 }
 
+- (void) dealloc {
+    memset(&_clueKey, 0, sizeof(_clueKey));
+}
 
-- (BOOL) save: (NSError**)outError {
-    if (!_dirty)
-        return YES;
-    LogTo(KeyBag, @"Saving");
-    Assert(_path);
-    NSData* contents = [NSKeyedArchiver archivedDataWithRootObject: self];
-    NSAssert(contents, @"archiving failed");
-    if (_masterKey)
-        contents = [_masterKey encrypt: contents];
-    if (![contents writeToFile: _path options: NSDataWritingAtomic error: outError])
-        return NO;
-    _dirty = NO;
-    return YES;
-}
-
-- (void) autosave {
-    if (_dirty && !_autosaving) {
-        _autosaving = YES;
-        MYAfterDelay(0.5, ^{
-            self->_autosaving = NO;
-            NSError* error;
-            if (![self save: &error])
-                Warn(@"Failed to save %@: %@", self, error);
+
+#pragma mark - PERSISTENCE:
+
+
+// Must be called on _ioQueue.
+- (CBKeyBagJournal*) journal {
+    if (!_journal) {
+        Assert(_path);
+        _journal = [[CBKeyBagJournal alloc] initWithPath: [_path stringByAppendingPathExtension:
+                                                                                    @"journal"]
+                                               masterKey: _masterKey];
+    }
+    return _journal;
+}
+
+
+- (BOOL) replayJournal: (NSError**)outError {
+    __block BOOL ok;
+    __block NSError* error;
+    dispatch_sync(_ioQueue, ^{
+        NSError* replayError;
+        ok = [self.journal replay: ^(CBSymmetricKey* key, NSString* identifier) {
+            @synchronized(self) {
+                [self addKey: key identifier: identifier journal: NO];
+            }
+        } error: &replayError];
+        error = replayError;
+        if (ok && self->_journal.count > 0)
+            LogTo(KeyBag, @"Replayed %lu journal entries", (unsigned long)self->_journal.count);
+    });
+    if (!ok && outError)
+        *outError = error;
+    return ok;
+}
+
+
+// Appends a change to the journal in the background. Must be called under @synchronized.
+- (void) journalKey: (CBSymmetricKey*)key identifier: (NSString*)identifier {
+    CBKeyBagFile* file = _state->_file;
+    if (!file && !_compacting) {
+        // First change to a new bag: write the file instead, which saves the clue key too.
+        [self compactInBackground: YES error: NULL];
+        return;
+    }
+    NSUInteger fileCount = file.count;
+    dispatch_async(_ioQueue, ^{
+        NSError* error;
+        CBKeyBagJournal* journal = self.journal;
+        if (![journal appendKey: key identifier: identifier error: &error]) {
+            Warn(@"CBKeyBag: Couldn't write to journal %@: %@", journal.path, error);
+            if (!self->_ioError)
+                self->_ioError = error;
+        } else if (journal.count >= kMinCompactionEntries
+                        && journal.count >= fileCount / kCompactionRatio) {
+            [self compactInBackground: YES error: NULL];
+        }
+    });
+}
+
+
+// Schedules a compaction on _ioQueue. If `background` is NO, waits for it and returns the result.
+- (BOOL) compactInBackground: (BOOL)background error: (NSError**)outError {
+    __block BOOL ok = YES;
+    __block NSError* error;
+    @synchronized(self) {
+        if (background && _compacting)
+            return YES;
+        _compacting = YES;
+        // The state is captured when the compaction runs, not now: an earlier compaction may
+        // still be queued, and it will have saved some of the keys that are unsaved now. Every
+        // change journaled before this runs is already in the state at that point.
+        dispatch_async(_ioQueue, ^{
+            NSError* compactError;
+            ok = [self compactState: self.state error: &compactError];
+            if (!ok)
+                Warn(@"CBKeyBag: Couldn't save %@: %@", self->_path, compactError);
+            error = compactError;
         });
     }
+    if (background)
+        return YES;
+    dispatch_sync(_ioQueue, ^{ });     // wait for it, and any compaction queued before it
+    if (!ok && outError)
+        *outError = error;
+    return ok;
 }
 
-- (void) setNeedsSave {
-    _dirty = YES;
-    [self autosave];
+
+// Writes a new file containing everything in `state`, then deletes the journal.
+// Must be called on _ioQueue, with the current state; since compactions are serialized on that
+// queue, no other compaction can remove any of its unsaved keys before this one finishes.
+- (BOOL) compactState: (CBKeyBagState*)state error: (NSError**)outError {
+    NSArray* keys = state->_unsavedKeys;
+    NSDictionary* identifiers = state->_byIdentifier;
+    LogTo(KeyBag, @"Compacting: adding %lu keys to %lu",
+          (unsigned long)keys.count, (unsigned long)state->_file.count);
+    CBKeyBagFile* newFile = nil;
+    if ([CBKeyBagFile writeToPath: _path
+                        masterKey: _masterKey
+                          clueKey: _clueKey
+                     existingFile: state->_file
+                          newKeys: keys
+                   newIdentifiers: identifiers
+                            error: outError])
+        newFile = [CBKeyBagFile openPath: _path masterKey: _masterKey error: outError];
+
+    @synchronized(self) {
+        _compacting = NO;
+        if (!newFile)
+            return NO;
+        // Drop the in-memory changes that are now in the file:
+        self.state = [_state stateWithFile: newFile
+                             savedKeyCount: keys.count
+                          savedIdentifiers: identifiers];
+    }
+    // Any changes made since the state was captured haven't been journaled yet (their appends
+    // are queued behind this), so the entire journal is now redundant:
+    _ioError = nil;
+    return [self.journal remove: outError];
 }
 
 
-- (NSArray*) getKeysForClue: (CBKeyClue)clue {
-    return _store[@(clue)];
+- (BOOL) compact: (NSError**)outError {
+    return [self compactInBackground: NO error: outError];
 }
 
 
-- (BOOL) addKey: (CBSymmetricKey*)key {
+- (BOOL) save: (NSError**)outError {
+    BOOL needsFile;
+    @synchronized(self) {
+        needsFile = !_state->_file && !_compacting;
+    }
+    if (needsFile)
+        return [self compact: outError];
+    __block BOOL ok = YES, failedEarlier = NO;
+    __block NSError* error;
+    dispatch_sync(_ioQueue, ^{
+        NSError* syncError;
+        if (self->_ioError) {
+            failedEarlier = YES;
+        } else if (![self->_journal sync: &syncError]) {
+            ok = NO;
+            error = syncError;
+        }
+    });
+    if (failedEarlier) {
+        // Some changes didn't make it into the journal, so write the whole file:
+        return [self compact: outError];
+    }
+    if (!ok && outError)
+        *outError = error;
+    return ok;
+}
+
+
+#pragma mark - KEYS:
+
+
+// Adds a key, and associates it with the identifier if that's non-nil. If `journal` is YES, the
+// change is journaled. Returns YES if the key is new. Must be called under @synchronized.
+- (BOOL) addKey: (CBSymmetricKey*)key
+     identifier: (NSString*)identifier
+        journal: (BOOL)journal
+{
     Assert(key);
-    id clue = @(key.clue);
-    NSMutableArray* keys = _store[clue];
-    if (!keys) {
-        _store[clue] = [[NSMutableArray alloc] initWithObjects: key, nil];
-        [self setNeedsSave];
+    CBKeyBagState* state = _state;
+    BOOL added = NO;
+    if (![state containsKey: key]) {
+        state = [state stateByAddingKey: key];
         LogTo(KeyBag, @"Added %@", key);
-        return YES;
-    } else if (![keys containsObject: key]) {
-        [keys insertObject: key atIndex: 0]; // newest keys go first
-        [self setNeedsSave];
-        LogTo(KeyBag, @"Added %@", key);
-        return YES;
+        added = YES;
+    }
+    if (identifier && ![key isEqual: [state keyWithIdentifier: identifier]]) {
+        state = [state stateBySettingKey: key forIdentifier: identifier];
+        LogTo(KeyBag, @"'%@' --> %@", identifier, key);
+    } else {
+        identifier = nil;
+    }
+    if (state != _state) {
+        self.state = state;
+        if (journal)
+            [self journalKey: key identifier: identifier];
+    }
+    return added;
+}
+
+
+- (BOOL) addKey: (CBSymmetricKey*)key {
+    @synchronized(self) {
+        return [self addKey: key identifier: nil journal: YES];
     }
-    return NO;
 }
 
 
 - (void) addKey: (CBSymmetricKey*)key identifier: (NSString*)identifier {
-    [self addKey: key];
-    if (![key isEqual: _byIdentifier[identifier]]) {
-        _byIdentifier[identifier] = key;
-        [self setNeedsSave];
-        LogTo(KeyBag, @"'%@' --> %@", identifier, key);
+    Assert(identifier);
+    @synchronized(self) {
+        [self addKey: key identifier: identifier journal: YES];
     }
 }
 
 - (CBSymmetricKey*) keyWithIdentifier:(NSString *)identifier {
-    return _byIdentifier[identifier];
+    return [self.state keyWithIdentifier: identifier];
 }
 
 - (NSArray*) allIdentifiers {
-    return _byIdentifier.allKeys;
+    return [self.state allIdentifiers];
 }
 
 
-- (NSData*) decrypt: (NSData*)encrypted
-            usedKey: (CBSymmetricKey**)outUsedKey
+- (NSData*) encrypt: (NSData*)cleartext
+            withKey: (CBSymmetricKey*)key
 {
+    return [key encrypt: cleartext withClueKey: _clueKey];
+}
+
+
+- (CBSymmetricKey*) decrypt: (NSData*)encrypted
+                   appendTo: (NSMutableData*)output
+{
+    CBKeyBagState* state = self.state;  // no locking; this snapshot won't change
+    CBKeyedClue keyedClue;
+    if ([CBSymmetricKey getKeyedClue: &keyedClue forEncryptedData: encrypted]) {
+        for (CBSymmetricKey* key in state->_byKeyedClue[@(keyedClue)]) {
+            if ([key decrypt: encrypted withClueKey: _clueKey appendTo: output]) {
+                LogTo(KeyBag, @"Decrypted message using %@", key);
+                return key;
+            }
+        }
+        CBSymmetricKey* key = [state->_file keyWithKeyedClue: keyedClue
+                                                 passingTest: ^BOOL(CBSymmetricKey* k) {
+            return [k decrypt: encrypted withClueKey: self->_clueKey appendTo: output];
+        }];
+        if (key) {
+            LogTo(KeyBag, @"Decrypted message using %@", key);
+            return key;
+        }
+        // ...else it may be a message with a 16-bit clue that happens to look like a keyed one
+    }
+
     CBKeyClue clue = [CBSymmetricKey clueForEncryptedData: encrypted];
-    for (CBSymmetricKey* key in _store[@(clue)]) {
-        NSData* decrypted = [key decryptWithClue: encrypted];
-        if (decrypted) {
+    for (CBSymmetricKey* key in state->_byClue[@(clue)]) {
+        if ([key decryptWithClue: encrypted appendTo: output]) {
             LogTo(KeyBag, @"Decrypted message using %@", key);
-            if (outUsedKey)
-                *outUsedKey = key;
-            return decrypted;
+            return key;
         }
     }
+    CBSymmetricKey* key = [state->_file keyWithClue: clue passingTest: ^BOOL(CBSymmetricKey* k) {
+        return [k decryptWithClue: encrypted appendTo: output];
+    }];
+    if (key) {
+        LogTo(KeyBag, @"Decrypted message using %@", key);
+        return key;
+    }
     LogTo(KeyBag, @"Failed to decrypt message (clue=%04x)", clue);
     return nil;
 }
 
+- (NSData*) decrypt: (NSData*)encrypted
+            usedKey: (CBSymmetricKey**)outUsedKey
+{
+    NSMutableData* decrypted = [NSMutableData dataWithCapacity: encrypted.length];
+    CBSymmetricKey* key = [self decrypt: encrypted appendTo: decrypted];
+    if (!key)
+        return nil;
+    if (outUsedKey)
+        *outUsedKey = key;
+    return decrypted;
+}
+
 - (NSData*) decrypt: (NSData*)encrypted {
     return [self decrypt: encrypted usedKey: NULL];
 }
@@ -0,0 +1,66 @@
+//
+//  CBKeyBagFile.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBSymmetricKey.h"
+
+
+/** Internal class that provides read access to a saved CBKeyBag file, and writes new ones.
+    The file is memory-mapped, and contains a table of individually-encrypted keys sorted by their
+    keyed clues, so opening it takes constant time and keys are only decrypted when looked up.
+    Instances are immutable (aside from internal caches) and safe to use on multiple threads. */
+@interface CBKeyBagFile : NSObject
+
+/** Returns masterKey, or if it's nil, the all-zero key used in its place. */
++ (CBSymmetricKey*) effectiveMasterKey: (CBSymmetricKey*)masterKey;
+
+/** Opens a KeyBag file. If the file isn't in this format, fails with kCBKeyErrorUnknownFormat.
+    If masterKey is nil, an all-zero key is used; this means the keys aren't protected! */
++ (instancetype) openPath: (NSString*)path
+                masterKey: (CBSymmetricKey*)masterKey
+                    error: (NSError**)outError;
+
+/** Writes a KeyBag file containing all the keys and identifiers of an existing file (if any)
+    plus the given new keys and identifiers. Identifiers in `newIdentifiers` override existing
+    ones. Existing keys are copied without being decrypted. The file is written atomically. */
++ (BOOL) writeToPath: (NSString*)path
+           masterKey: (CBSymmetricKey*)masterKey
+             clueKey: (CBClueKey)clueKey
+        existingFile: (CBKeyBagFile*)existingFile
+             newKeys: (NSArray*)newKeys
+      newIdentifiers: (NSDictionary*)newIdentifiers
+               error: (NSError**)outError;
+
+/** The clue key stored in the file. */
+@property (readonly) CBClueKey clueKey;
+
+/** The number of keys in the file. */
+@property (readonly) NSUInteger count;
+
+/** Calls the test block on each key with the given keyed clue, until it returns YES.
+    Returns that key, or nil if none passed. */
+- (CBSymmetricKey*) keyWithKeyedClue: (CBKeyedClue)clue
+                         passingTest: (BOOL(^)(CBSymmetricKey*))test;
+
+/** Calls the test block on each key with the given 16-bit clue, until it returns YES.
+    Returns that key, or nil if none passed. */
+- (CBSymmetricKey*) keyWithClue: (CBKeyClue)clue
+                    passingTest: (BOOL(^)(CBSymmetricKey*))test;
+
+/** Returns YES if the file contains this key. */
+- (BOOL) containsKey: (CBSymmetricKey*)key;
+
+/** Returns the key associated with the identifier, or nil. */
+- (CBSymmetricKey*) keyWithIdentifier: (NSString*)identifier;
+
+/** All identifiers in the file. */
+@property (readonly) NSArray* allIdentifiers;
+
+/** All keys in the file. This decrypts every key, so it's expensive for a large file. */
+@property (readonly) NSArray* allKeys;
+
+@end
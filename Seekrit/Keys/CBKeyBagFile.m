@@ -0,0 +1,486 @@
+//
+//  CBKeyBagFile.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBKeyBagFile.h"
+#import "CBKey+Private.h"
+#import "MYErrorUtils.h"
+#import "Logging.h"
+#import "sodium.h"
+#import <stdatomic.h>
+
+
+/*
+ File format (all integers are big-endian):
+    Header                          80 bytes
+        Magic number ("CBKB")        4 bytes
+        Format version (2)           1 byte
+        Reserved (zero)              3 bytes
+        Record count                 4 bytes
+        Identifier table length      4 bytes
+        Sealed clue key             57 bytes
+        Padding (zero)               7 bytes
+    Records, sorted by keyed clue   80 bytes each
+        Keyed clue                   4 bytes
+        16-bit clue                  2 bytes
+        Reserved (zero)              2 bytes
+        Nonce                       24 bytes
+        Sealed key                  48 bytes
+    Clue index                       4 bytes per record: record numbers, sorted by 16-bit clue
+    Identifier table                 (length given in header)
+
+ The clue key is encrypted with the master key using -encrypt:associatedData:, with the first
+ 16 bytes of the header as associated data. Each key is encrypted with the master key using its
+ record's nonce. The identifier table is encrypted like the clue key; its cleartext is a sequence
+ of entries, each consisting of a 4-byte record number, 2-byte length, and a UTF-8 identifier.
+ */
+
+
+#define kFormatVersion 2
+static const uint8_t kMagic[4] = {'C', 'B', 'K', 'B'};
+
+#define kMaxRecordCount (1u << 24)
+
+typedef struct {
+    uint8_t  magic[4];
+    uint8_t  version;
+    uint8_t  reserved[3];
+    uint32_t recordCount;
+    uint32_t identifiersLength;
+    uint8_t  sealedClueKey[kCBAssociatedDataOverhead + sizeof(CBClueKey)];
+    uint8_t  padding[7];
+} FileHeader;
+
+#define kAuthenticatedHeaderSize offsetof(FileHeader, sealedClueKey)
+
+typedef struct {
+    uint32_t keyedClue;
+    uint16_t clue;
+    uint8_t  reserved[2];
+    CBNonce  nonce;
+    uint8_t  sealedKey[sizeof(CBRawKey) + kCBEncryptionOverhead];
+} Record;
+
+
+static BOOL mkError(NSInteger code, NSString* message, NSError** outError) {
+    return MYReturnError(outError, code, CBKeyErrorDomain, @"%@", message);
+}
+
+
+@implementation CBKeyBagFile
+{
+    NSData* _data;                  // the memory-mapped file
+    CBSymmetricKey* _masterKey;
+    const FileHeader* _header;
+    const Record* _records;
+    const uint32_t* _clueIndex;
+    NSUInteger _count;
+    _Atomic(void*) _identifiers;    // retained NSDictionary, identifier -> record number; lazy
+    _Atomic(void*)* _keys;          // retained CBSymmetricKeys, indexed by record number; lazy
+    CBClueKey _clueKey;
+}
+
+@synthesize clueKey=_clueKey, count=_count;
+
+
++ (CBSymmetricKey*) effectiveMasterKey: (CBSymmetricKey*)masterKey {
+    if (masterKey)
+        return masterKey;
+    CBRawKey zero = {{0}};
+    return [[CBSymmetricKey alloc] initWithRawKey: zero];
+}
+
+
++ (instancetype) openPath: (NSString*)path
+                masterKey: (CBSymmetricKey*)masterKey
+                    error: (NSError**)outError
+{
+    NSData* data = [NSData dataWithContentsOfFile: path
+                                          options: NSDataReadingMappedAlways
+                                            error: outError];
+    if (!data)
+        return nil;
+    return [[self alloc] initWithData: data masterKey: [self effectiveMasterKey: masterKey] error: outError];
+}
+
+
+- (instancetype) initWithData: (NSData*)data
+                    masterKey: (CBSymmetricKey*)masterKey
+                        error: (NSError**)outError
+{
+    self = [super init];
+    if (self) {
+        _data = data;
+        _masterKey = masterKey;
+        _header = data.bytes;
+        if (data.length < sizeof(FileHeader) || memcmp(_header->magic, kMagic, sizeof(kMagic)) != 0
+                                             || _header->version != kFormatVersion) {
+            mkError(kCBKeyErrorUnknownFormat, @"Not a KeyBag file", outError);
+            return nil;
+        }
+        _count = ntohl(_header->recordCount);
+        uint64_t length = sizeof(FileHeader) + (uint64_t)_count * (sizeof(Record) + sizeof(uint32_t))
+                        + ntohl(_header->identifiersLength);
+        if (_count > kMaxRecordCount || data.length != length) {
+            mkError(kCBKeyErrorTruncated, @"KeyBag file is truncated or corrupt", outError);
+            return nil;
+        }
+        _records = (const Record*)(_header + 1);
+        _clueIndex = (const uint32_t*)(_records + _count);
+
+        NSMutableData* clueKey = [NSMutableData dataWithCapacity: sizeof(CBClueKey)];
+        if (![_masterKey decrypt: [self subdata: _header->sealedClueKey
+                                         length: sizeof(_header->sealedClueKey)]
+                  associatedData: [self subdata: _header length: kAuthenticatedHeaderSize]
+                        appendTo: clueKey]
+                || clueKey.length != sizeof(CBClueKey)) {
+            mkError(kCBKeyErrorDecryptionFailed, @"Can't decrypt KeyBag", outError);
+            return nil;
+        }
+        memcpy(&_clueKey, clueKey.bytes, sizeof(_clueKey));
+        sodium_memzero(clueKey.mutableBytes, clueKey.length);
+
+        _keys = calloc(MAX(_count, 1), sizeof(_Atomic(void*)));
+        if (!_keys) {
+            MYReturnError(outError, ENOMEM, NSPOSIXErrorDomain, @"Out of memory");
+            return nil;
+        }
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    if (_keys) {
+        for (NSUInteger i = 0; i < _count; ++i) {
+            void* key = atomic_load(&_keys[i]);
+            if (key)
+                CFRelease(key);
+        }
+        free(_keys);
+    }
+    void* identifiers = atomic_load(&_identifiers);
+    if (identifiers)
+        CFRelease(identifiers);
+    sodium_memzero(&_clueKey, sizeof(_clueKey));
+}
+
+
+// Returns an NSData that points into the mapped file without copying.
+- (NSData*) subdata: (const void*)bytes length: (size_t)length {
+    return [[NSData alloc] initWithBytesNoCopy: (void*)bytes length: length freeWhenDone: NO];
+}
+
+
+#pragma mark - KEYS:
+
+
+// Decrypts the key in a record, or returns it from the cache.
+// This doesn't lock; if two threads race to decrypt the same key, the loser's copy is discarded.
+- (CBSymmetricKey*) keyAtIndex: (NSUInteger)index {
+    CBSymmetricKey* key = (__bridge CBSymmetricKey*)atomic_load(&_keys[index]);
+    if (!key) {
+        const Record* record = &_records[index];
+        CBRawKey rawKey;
+        if (![_masterKey decryptBytes: record->sealedKey length: sizeof(record->sealedKey)
+                            withNonce: record->nonce into: &rawKey]) {
+            Warn(@"CBKeyBagFile: Can't decrypt key #%lu", (unsigned long)index);
+            return nil;
+        }
+        key = [[CBSymmetricKey alloc] initWithRawKey: rawKey];
+        sodium_memzero(&rawKey, sizeof(rawKey));
+        if ([key keyedClueWithClueKey: _clueKey] != ntohl(record->keyedClue)) {
+            Warn(@"CBKeyBagFile: Key #%lu has the wrong clue", (unsigned long)index);
+            return nil;
+        }
+        void* retained = (void*)CFBridgingRetain(key);
+        void* existing = NULL;
+        if (!atomic_compare_exchange_strong(&_keys[index], &existing, retained)) {
+            CFRelease(retained);
+            key = (__bridge CBSymmetricKey*)existing;
+        }
+    }
+    return key;
+}
+
+
+// Returns the record number of the first key with the given keyed clue that passes the test,
+// or NSNotFound.
+- (NSUInteger) indexOfKeyedClue: (CBKeyedClue)clue
+                    passingTest: (BOOL(^)(CBSymmetricKey*))test
+{
+    // Binary search for the first record with this clue:
+    NSUInteger lo = 0, hi = _count;
+    while (lo < hi) {
+        NSUInteger mid = (lo + hi) / 2;
+        if (ntohl(_records[mid].keyedClue) < clue)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (NSUInteger i = lo; i < _count && ntohl(_records[i].keyedClue) == clue; ++i) {
+        CBSymmetricKey* key = [self keyAtIndex: i];
+        if (key && test(key))
+            return i;
+    }
+    return NSNotFound;
+}
+
+
+- (CBSymmetricKey*) keyWithKeyedClue: (CBKeyedClue)clue
+                         passingTest: (BOOL(^)(CBSymmetricKey*))test
+{
+    NSUInteger index = [self indexOfKeyedClue: clue passingTest: test];
+    return index != NSNotFound ? [self keyAtIndex: index] : nil;
+}
+
+
+- (CBSymmetricKey*) keyWithClue: (CBKeyClue)clue
+                    passingTest: (BOOL(^)(CBSymmetricKey*))test
+{
+    NSUInteger lo = 0, hi = _count;
+    while (lo < hi) {
+        NSUInteger mid = (lo + hi) / 2;
+        if (ntohs(_records[ntohl(_clueIndex[mid])].clue) < clue)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (NSUInteger i = lo; i < _count; ++i) {
+        NSUInteger index = ntohl(_clueIndex[i]);
+        if (index >= _count || ntohs(_records[index].clue) != clue)
+            break;
+        CBSymmetricKey* key = [self keyAtIndex: index];
+        if (key && test(key))
+            return key;
+    }
+    return nil;
+}
+
+
+// Returns the record number of a key, or NSNotFound.
+- (NSUInteger) indexOfKey: (CBSymmetricKey*)key {
+    return [self indexOfKeyedClue: [key keyedClueWithClueKey: _clueKey]
+                      passingTest: ^BOOL(CBSymmetricKey* k) { return [k isEqual: key]; }];
+}
+
+
+- (BOOL) containsKey: (CBSymmetricKey*)key {
+    return [self indexOfKey: key] != NSNotFound;
+}
+
+
+- (NSArray*) allKeys {
+    NSMutableArray* keys = [NSMutableArray arrayWithCapacity: _count];
+    for (NSUInteger i = 0; i < _count; ++i) {
+        CBSymmetricKey* key = [self keyAtIndex: i];
+        if (key)
+            [keys addObject: key];
+    }
+    return keys;
+}
+
+
+#pragma mark - IDENTIFIERS:
+
+
+// Lazily decrypts the identifier table. Like -keyAtIndex:, this doesn't lock.
+- (NSDictionary*) identifiers {
+    NSDictionary* identifiers = (__bridge NSDictionary*)atomic_load(&_identifiers);
+    if (!identifiers) {
+        identifiers = [self readIdentifiers];
+        void* retained = (void*)CFBridgingRetain(identifiers);
+        void* existing = NULL;
+        if (!atomic_compare_exchange_strong(&_identifiers, &existing, retained)) {
+            CFRelease(retained);
+            identifiers = (__bridge NSDictionary*)existing;
+        }
+    }
+    return identifiers;
+}
+
+
+- (NSDictionary*) readIdentifiers {
+    NSMutableDictionary* identifiers = [NSMutableDictionary dictionary];
+    size_t sealedLength = ntohl(_header->identifiersLength);
+    if (sealedLength == 0)
+        return identifiers;
+    NSData* sealed = [self subdata: (const uint8_t*)(_clueIndex + _count) length: sealedLength];
+    NSData* table = [_masterKey decrypt: sealed
+                         associatedData: [self subdata: _header length: kAuthenticatedHeaderSize]];
+    if (!table) {
+        Warn(@"CBKeyBagFile: Can't decrypt identifiers");
+        return identifiers;
+    }
+    const uint8_t* pos = table.bytes, *end = pos + table.length;
+    while (end - pos >= 6) {
+        uint32_t index;
+        uint16_t length;
+        memcpy(&index, pos, sizeof(index));
+        memcpy(&length, pos + 4, sizeof(length));
+        index = ntohl(index);
+        length = ntohs(length);
+        pos += 6;
+        if (end - pos < length)
+            break;
+        NSString* identifier = [[NSString alloc] initWithBytes: pos length: length
+                                                      encoding: NSUTF8StringEncoding];
+        pos += length;
+        if (identifier && index < _count)
+            identifiers[identifier] = @(index);
+    }
+    if (pos != end)
+        Warn(@"CBKeyBagFile: Identifier table is corrupt");
+    return identifiers;
+}
+
+
+- (CBSymmetricKey*) keyWithIdentifier: (NSString*)identifier {
+    NSNumber* index = self.identifiers[identifier];
+    return index ? [self keyAtIndex: index.unsignedIntegerValue] : nil;
+}
+
+
+- (NSArray*) allIdentifiers {
+    return self.identifiers.allKeys;
+}
+
+
+#pragma mark - WRITING:
+
+
+typedef struct {
+    uint32_t clue;
+    uint32_t index;
+} SortEntry;
+
+static int compareSortEntries(const void* a, const void* b) {
+    const SortEntry *ea = a, *eb = b;
+    if (ea->clue != eb->clue)
+        return ea->clue < eb->clue ? -1 : 1;
+    // Tie-break on the index to keep the sort stable, so older keys keep their relative order:
+    return ea->index < eb->index ? -1 : (ea->index > eb->index);
+}
+
+
++ (BOOL) writeToPath: (NSString*)path
+           masterKey: (CBSymmetricKey*)masterKey
+             clueKey: (CBClueKey)clueKey
+        existingFile: (CBKeyBagFile*)existingFile
+             newKeys: (NSArray*)newKeys
+      newIdentifiers: (NSDictionary*)newIdentifiers
+               error: (NSError**)outError
+{
+    masterKey = [self effectiveMasterKey: masterKey];
+    NSAssert(!existingFile || ([existingFile->_masterKey isEqual: masterKey] &&
+                               0 == memcmp(&existingFile->_clueKey, &clueKey, sizeof(clueKey))),
+             @"Existing KeyBag file has different keys");
+    NSUInteger oldCount = existingFile.count;
+    NSUInteger count = oldCount + newKeys.count;
+    if (count > kMaxRecordCount)
+        return mkError(kCBKeyErrorUnknownFormat, @"Too many keys in KeyBag", outError);
+
+    // Collect the records in their original order; existing ones are copied as-is:
+    NSMutableData* recordData = [NSMutableData dataWithLength: count * sizeof(Record)];
+    Record* records = recordData.mutableBytes;
+    if (oldCount > 0)
+        memcpy(records, existingFile->_records, oldCount * sizeof(Record));
+    NSMutableDictionary* newKeyIndexes = [NSMutableDictionary dictionary]; // keyData -> index
+    NSUInteger index = oldCount;
+    for (CBSymmetricKey* key in newKeys) {
+        Record* record = &records[index];
+        record->keyedClue = htonl([key keyedClueWithClueKey: clueKey]);
+        record->clue = htons(key.clue);
+        record->nonce = [CBKey randomNonce];
+        CBRawKey rawKey = key.rawKey;
+        [masterKey encryptBytes: &rawKey length: sizeof(rawKey)
+                      withNonce: record->nonce into: record->sealedKey];
+        sodium_memzero(&rawKey, sizeof(rawKey));
+        newKeyIndexes[key.keyData] = @(index);
+        ++index;
+    }
+
+    // Map identifiers to original record numbers:
+    NSMutableDictionary* identifiers = [[existingFile identifiers] mutableCopy]
+                                            ?: [NSMutableDictionary dictionary];
+    for (NSString* identifier in newIdentifiers) {
+        CBSymmetricKey* key = newIdentifiers[identifier];
+        NSNumber* keyIndex = newKeyIndexes[key.keyData];
+        if (!keyIndex) {
+            NSUInteger oldIndex = [existingFile indexOfKey: key];
+            if (oldIndex != NSNotFound)
+                keyIndex = @(oldIndex);
+        }
+        if (keyIndex)
+            identifiers[identifier] = keyIndex;
+        else
+            Warn(@"CBKeyBagFile: Identifier '%@' refers to a key not in the KeyBag", identifier);
+    }
+
+    // Sort the records by keyed clue, and build the index sorted by 16-bit clue:
+    NSMutableData* sortData = [NSMutableData dataWithLength: MAX(count, 1) * sizeof(SortEntry)];
+    SortEntry* sorted = sortData.mutableBytes;
+    for (NSUInteger i = 0; i < count; ++i)
+        sorted[i] = (SortEntry){ntohl(records[i].keyedClue), (uint32_t)i};
+    qsort(sorted, count, sizeof(SortEntry), compareSortEntries);
+
+    NSMutableData* positionData = [NSMutableData dataWithLength: MAX(count, 1) * sizeof(uint32_t)];
+    uint32_t* position = positionData.mutableBytes;        // original index -> sorted index
+    for (NSUInteger i = 0; i < count; ++i)
+        position[sorted[i].index] = (uint32_t)i;
+
+    NSMutableData* clueSortData = [NSMutableData dataWithLength: MAX(count, 1) * sizeof(SortEntry)];
+    SortEntry* clueSorted = clueSortData.mutableBytes;
+    for (NSUInteger i = 0; i < count; ++i)
+        clueSorted[i] = (SortEntry){ntohs(records[i].clue), position[i]};
+    qsort(clueSorted, count, sizeof(SortEntry), compareSortEntries);
+
+    // Build the identifier table:
+    NSMutableData* table = [NSMutableData data];
+    for (NSString* identifier in identifiers) {
+        NSData* utf8 = [identifier dataUsingEncoding: NSUTF8StringEncoding];
+        if (utf8.length > UINT16_MAX) {
+            Warn(@"CBKeyBagFile: Identifier is too long; skipping it");
+            continue;
+        }
+        uint32_t recordNo = htonl(position[[identifiers[identifier] unsignedIntegerValue]]);
+        uint16_t length = htons((uint16_t)utf8.length);
+        [table appendBytes: &recordNo length: sizeof(recordNo)];
+        [table appendBytes: &length length: sizeof(length)];
+        [table appendData: utf8];
+    }
+
+    // Now write it all out:
+    FileHeader header = {.version = kFormatVersion};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.recordCount = htonl((uint32_t)count);
+    header.identifiersLength = htonl(table.length ? (uint32_t)(kCBAssociatedDataOverhead
+                                                               + table.length) : 0);
+    NSData* authenticated = [NSData dataWithBytes: &header length: kAuthenticatedHeaderSize];
+    NSData* sealedClueKey = [masterKey encrypt: [NSData dataWithBytes: &clueKey
+                                                               length: sizeof(clueKey)]
+                                associatedData: authenticated];
+    NSAssert(sealedClueKey.length == sizeof(header.sealedClueKey), @"Unexpected sealed size");
+    memcpy(header.sealedClueKey, sealedClueKey.bytes, sizeof(header.sealedClueKey));
+
+    NSMutableData* output = [NSMutableData dataWithCapacity: sizeof(FileHeader)
+                                 + count * (sizeof(Record) + sizeof(uint32_t)) + table.length
+                                 + kCBAssociatedDataOverhead];
+    [output appendBytes: &header length: sizeof(header)];
+    for (NSUInteger i = 0; i < count; ++i)
+        [output appendBytes: &records[sorted[i].index] length: sizeof(Record)];
+    for (NSUInteger i = 0; i < count; ++i) {
+        uint32_t recordNo = htonl(clueSorted[i].index);
+        [output appendBytes: &recordNo length: sizeof(recordNo)];
+    }
+    if (table.length > 0)
+        [masterKey encrypt: table associatedData: authenticated appendTo: output];
+    return [output writeToFile: path options: NSDataWritingAtomic error: outError];
+}
+
+
+@end
@@ -0,0 +1,49 @@
+//
+//  CBKeyBagJournal.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBSymmetricKey.h"
+
+
+/** Internal class that manages a CBKeyBag's encrypted, append-only journal of changes made since
+    its file was last written. Each change is appended as a small encrypted entry, so the cost of
+    recording it doesn't depend on the size of the KeyBag.
+    Not thread-safe; CBKeyBag only calls it on its I/O queue (or before it's been shared.) */
+@interface CBKeyBagJournal : NSObject
+
+/** Initializes an instance for the journal at the given path. The file isn't touched until
+    the first call to -replay:error: or -appendKey:identifier:error:.
+    If masterKey is nil, an all-zero key is used; this means the keys aren't protected! */
+- (instancetype) initWithPath: (NSString*)path
+                    masterKey: (CBSymmetricKey*)masterKey NS_DESIGNATED_INITIALIZER;
+
+/** The filesystem path of the journal. */
+@property (readonly) NSString* path;
+
+/** The number of entries in the journal. */
+@property (readonly) NSUInteger count;
+
+/** Reads the journal (if it exists), calling the block for each entry in order. The identifier
+    is nil if the entry just adds a key.
+    If the journal ends with an incomplete or corrupt entry, as happens if the process crashes
+    while appending, reading stops there and the journal is truncated to remove the bad data. */
+- (BOOL) replay: (void(^)(CBSymmetricKey* key, NSString* identifier))block
+          error: (NSError**)outError;
+
+/** Appends an entry that adds a key, and associates it with an identifier if that's non-nil.
+    The data isn't guaranteed to be durable until -sync: is called. */
+- (BOOL) appendKey: (CBSymmetricKey*)key
+        identifier: (NSString*)identifier
+             error: (NSError**)outError;
+
+/** Flushes appended entries to disk. */
+- (BOOL) sync: (NSError**)outError;
+
+/** Deletes the journal file, after its contents have been written to the KeyBag file. */
+- (BOOL) remove: (NSError**)outError;
+
+@end
@@ -0,0 +1,251 @@
+//
+//  CBKeyBagJournal.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBKeyBagJournal.h"
+#import "CBKeyBagFile.h"
+#import "CBKey+Private.h"
+#import "MYErrorUtils.h"
+#import "Logging.h"
+#import "sodium.h"
+#import <fcntl.h>
+#import <sys/stat.h>
+
+
+/*
+ Journal format:
+    Header:
+        Magic number ("CBKJ")        4 bytes
+        Format version (1)           1 byte
+        Reserved (zero)              3 bytes
+    for each entry {
+        Length of encrypted entry    4 bytes, big-endian
+        Encrypted entry              (length) bytes
+    }
+
+ Each entry is encrypted with the master key using -encrypt:associatedData:, with the entry's
+ sequence number (0, 1, 2, ...) as an 8-byte big-endian integer for the associated data, so
+ entries can't be reordered or dropped without detection. The cleartext is the 32-byte raw key,
+ optionally followed by a UTF-8 identifier to associate with it.
+ */
+
+#define kFormatVersion 1
+static const uint8_t kMagic[4] = {'C', 'B', 'K', 'J'};
+
+typedef struct {
+    uint8_t magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+} JournalHeader;
+
+
+static BOOL mkError(NSInteger code, NSString* message, NSError** outError) {
+    return MYReturnError(outError, code, CBKeyErrorDomain, @"%@", message);
+}
+
+static BOOL posixError(NSError** outError) {
+    return MYReturnError(outError, errno, NSPOSIXErrorDomain, @"%s", strerror(errno));
+}
+
+
+@implementation CBKeyBagJournal
+{
+    NSString* _path;
+    CBSymmetricKey* _masterKey;
+    int _fd;
+    NSUInteger _count;
+    NSMutableData* _buffer;
+}
+
+@synthesize path=_path, count=_count;
+
+
+- (instancetype) initWithPath: (NSString*)path masterKey: (CBSymmetricKey*)masterKey {
+    self = [super init];
+    if (self) {
+        _path = path.copy;
+        _masterKey = [CBKeyBagFile effectiveMasterKey: masterKey];
+        _fd = -1;
+        _buffer = [[NSMutableData alloc] initWithCapacity: 256];
+    }
+    return self;
+}
+
+- (instancetype) init {
+    @throw [NSException exceptionWithName: NSInternalInconsistencyException
+                                   reason: @"CBKeyBagJournal needs a path" userInfo: nil];
+    return [self initWithPath: nil masterKey: nil];
+}
+
+- (void) dealloc {
+    if (_fd >= 0)
+        close(_fd);
+}
+
+
+// The associated data for an entry; binds it to its position in the journal.
+static NSData* sequenceData(uint64_t sequence) {
+    uint8_t bytes[8];
+    for (int i = 7; i >= 0; --i) {
+        bytes[i] = (uint8_t)sequence;
+        sequence >>= 8;
+    }
+    return [NSData dataWithBytes: bytes length: sizeof(bytes)];
+}
+
+
+- (BOOL) replay: (void(^)(CBSymmetricKey* key, NSString* identifier))block
+          error: (NSError**)outError
+{
+    NSError* error;
+    NSData* data = [NSData dataWithContentsOfFile: _path options: NSDataReadingMappedIfSafe
+                                            error: &error];
+    if (!data) {
+        if (error.my_isFileNotFoundError)
+            return YES;
+        if (outError)
+            *outError = error;
+        return NO;
+    }
+
+    const uint8_t* start = data.bytes, *end = start + data.length;
+    const uint8_t* pos = start;
+    if (data.length >= sizeof(JournalHeader)) {
+        const JournalHeader* header = (const JournalHeader*)start;
+        if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 || header->version != kFormatVersion)
+            return mkError(kCBKeyErrorUnknownFormat, @"Unknown KeyBag journal format", outError);
+        pos += sizeof(JournalHeader);
+
+        NSMutableData* entry = [NSMutableData dataWithCapacity: 256];
+        while (end - pos >= 4) {
+            uint32_t length;
+            memcpy(&length, pos, sizeof(length));
+            length = ntohl(length);
+            if ((size_t)(end - pos - 4) < length)
+                break;
+            NSData* sealed = [[NSData alloc] initWithBytesNoCopy: (void*)(pos + 4) length: length
+                                                    freeWhenDone: NO];
+            entry.length = 0;
+            if (![_masterKey decrypt: sealed associatedData: sequenceData(_count) appendTo: entry]
+                    || entry.length < sizeof(CBRawKey))
+                break;
+            const uint8_t* bytes = entry.bytes;
+            CBSymmetricKey* key = [[CBSymmetricKey alloc] initWithRawKey: *(const CBRawKey*)bytes];
+            NSString* identifier = nil;
+            if (entry.length > sizeof(CBRawKey))
+                identifier = [[NSString alloc] initWithBytes: bytes + sizeof(CBRawKey)
+                                                      length: entry.length - sizeof(CBRawKey)
+                                                    encoding: NSUTF8StringEncoding];
+            sodium_memzero(entry.mutableBytes, entry.length);
+            block(key, identifier);
+            pos += 4 + length;
+            ++_count;
+        }
+    }
+
+    if (pos < end) {
+        // The rest is a partially-written entry (or garbage); get rid of it, so new entries can
+        // be appended after the last good one:
+        Warn(@"CBKeyBagJournal: Ignoring %lu bytes of incomplete data at end of %@",
+             (unsigned long)(end - pos), _path);
+        if (pos == start) {
+            if (unlink(_path.fileSystemRepresentation) < 0)
+                return posixError(outError);
+        } else if (truncate(_path.fileSystemRepresentation, pos - start) < 0) {
+            return posixError(outError);
+        }
+    }
+    return YES;
+}
+
+
+static BOOL writeAll(int fd, const void* bytes, size_t length, NSError** outError) {
+    while (length > 0) {
+        ssize_t n = write(fd, bytes, length);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return posixError(outError);
+        }
+        bytes = (const uint8_t*)bytes + n;
+        length -= n;
+    }
+    return YES;
+}
+
+
+- (BOOL) open: (NSError**)outError {
+    _fd = open(_path.fileSystemRepresentation, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (_fd < 0)
+        return posixError(outError);
+    struct stat info;
+    BOOL ok = (fstat(_fd, &info) == 0) || posixError(outError);
+    if (ok && info.st_size == 0) {
+        JournalHeader header = {.version = kFormatVersion};
+        memcpy(header.magic, kMagic, sizeof(kMagic));
+        ok = writeAll(_fd, &header, sizeof(header), outError);
+    }
+    if (!ok) {
+        close(_fd);
+        _fd = -1;
+    }
+    return ok;
+}
+
+
+- (BOOL) appendKey: (CBSymmetricKey*)key
+        identifier: (NSString*)identifier
+             error: (NSError**)outError
+{
+    if (_fd < 0 && ![self open: outError])
+        return NO;
+
+    CBRawKey rawKey = key.rawKey;
+    NSMutableData* cleartext = [NSMutableData dataWithBytes: &rawKey length: sizeof(rawKey)];
+    sodium_memzero(&rawKey, sizeof(rawKey));
+    if (identifier)
+        [cleartext appendData: [identifier dataUsingEncoding: NSUTF8StringEncoding]];
+
+    // Write the length and the entry with a single write() call, so a crash is very unlikely to
+    // leave anything but a truncated entry behind:
+    _buffer.length = sizeof(uint32_t);
+    [_masterKey encrypt: cleartext associatedData: sequenceData(_count) appendTo: _buffer];
+    sodium_memzero(cleartext.mutableBytes, cleartext.length);
+    uint32_t length = htonl((uint32_t)(_buffer.length - sizeof(uint32_t)));
+    memcpy(_buffer.mutableBytes, &length, sizeof(length));
+    off_t oldLength = lseek(_fd, 0, SEEK_END);
+    if (!writeAll(_fd, _buffer.bytes, _buffer.length, outError)) {
+        // Don't leave a partial entry behind, or later entries would be unreadable:
+        if (oldLength >= 0)
+            (void)ftruncate(_fd, oldLength);
+        return NO;
+    }
+    ++_count;
+    return YES;
+}
+
+
+- (BOOL) sync: (NSError**)outError {
+    if (_fd >= 0 && fsync(_fd) < 0)
+        return posixError(outError);
+    return YES;
+}
+
+
+- (BOOL) remove: (NSError**)outError {
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+    _count = 0;
+    if (unlink(_path.fileSystemRepresentation) < 0 && errno != ENOENT)
+        return posixError(outError);
+    return YES;
+}
+
+
+@end
@@ -7,7 +7,7 @@
 //
 
 #import "CBKey.h"
-@class CBVerifyingPublicKey, CBEncryptingPrivateKey, CBEncryptingPublicKey;
+@class CBVerifyingPublicKey, CBEncryptingPrivateKey, CBEncryptingPublicKey, CBSignaturePrehash;
 
 
 /** An Ed25519 digital signature. (512 bits, 64 bytes) */
@@ -27,9 +27,20 @@ typedef struct {
     @return  The 64-byte signature. */
 - (CBSignature) signData: (NSData*)input;
 
+/** Creates a digital signature of a message that's been hashed incrementally by a
+    CBSignaturePrehash, so the message never has to be in memory all at once.
+    This is NOT the same as signing the message with -signData:. The signature is made with a
+    separate key derived from this one, so it can only be verified by calling
+    -verifySignature:ofPrehash: on the prehashPublicKey. */
+- (CBSignature) signPrehash: (CBSignaturePrehash*)prehash;
+
 /** The corresponding public key. */
 @property (readonly) CBVerifyingPublicKey* publicKey;
 
+/** The public key that verifies signatures made by -signPrehash:. It's unrelated to publicKey as
+    far as anyone else can tell, so it has to be published along with it. */
+@property (readonly) CBVerifyingPublicKey* prehashPublicKey;
+
 /** Converts this key into a key that can be used to encrypt data. */
 - (CBEncryptingPrivateKey*) asEncryptingKey;
 
@@ -48,7 +59,56 @@ typedef struct {
 - (BOOL) verifySignature: (CBSignature)signature
                   ofData: (NSData*)inputData;
 
+/** Verifies a signature created by -signPrehash:. The receiver has to be the signer's
+    prehashPublicKey, not its publicKey.
+    @param signature  The signature to be verified.
+    @param prehash  The hash of the message whose signature is to be verified.
+    @return  YES if the signature was created from this message by the corresponding private key;
+                NO if the signature is invalid or doesn't match. */
+- (BOOL) verifySignature: (CBSignature)signature
+               ofPrehash: (CBSignaturePrehash*)prehash;
+
+/** Verifies a batch of signatures, each with its own key and data, spreading the work across
+    all available CPU cores. This is much faster than calling -verifySignature:ofData: on each
+    one when there are many of them.
+    @param signatures  A C array of signatures, with the same number of items as `inputs`.
+    @param inputs  An array of NSData objects, the data whose signatures are to be verified.
+    @param keys  An array of CBVerifyingPublicKeys, the same size as `inputs`.
+    @param outResults  If non-NULL, this must point to a bitmap with room for one bit per item,
+                i.e. (inputs.count + 7) / 8 bytes. On return, the bit for item `i` (bit `i % 8`
+                of byte `i / 8`) is set if its signature is valid, else cleared.
+    @return  YES if all the signatures are valid, NO if any aren't. */
++ (BOOL) verifySignatures: (const CBSignature*)signatures
+                   ofData: (NSArray*)inputs
+                 withKeys: (NSArray*)keys
+                  results: (uint8_t*)outResults;
+
 /** Converts this key into a public key that can be used to encrypt data. */
 - (CBEncryptingPublicKey*) asEncryptingPublicKey;
 
 @end
+
+
+
+/** Incrementally hashes a message for a prehashed signature, in the style of Ed25519ph: the message
+    is hashed with SHA-512, and the Ed25519 signature is of the domain tag "SeekritEd25519ph"
+    followed by that hash. The message can be fed in chunks of any size, e.g. from a stream or a
+    memory-mapped file, and memory usage stays constant however large it is.
+    The domain tag keeps a prehashed signature from being mistaken for a plain Ed25519 signature
+    of the same message, or vice versa. And since prehashed signatures are made with a key of their
+    own, a plain signature of data that happens to look like a tagged hash can't pass as one.
+    Once the prehash has been signed or verified, no more data can be added to it. */
+@interface CBSignaturePrehash : NSObject
+
+/** Adds the next part of the message. */
+- (void) updateWithBytes: (const void*)bytes length: (size_t)length;
+
+/** Adds the next part of the message. */
+- (void) updateWithData: (NSData*)data;
+
+/** Reads from a file descriptor until EOF, adding the data to the message.
+    The file descriptor is not closed. */
+- (BOOL) updateWithFileDescriptor: (int)fd
+                            error: (NSError**)outError;
+
+@end
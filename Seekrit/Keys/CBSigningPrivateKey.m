@@ -9,9 +9,28 @@
 #import "CBSigningPrivateKey.h"
 #import "CBEncryptingPrivateKey.h"
 #import "CBKey+Private.h"
+#import "MYErrorUtils.h"
 #import "sodium.h"
 
 
+/** The message actually signed by a prehashed signature: a domain tag and the SHA-512 digest. */
+typedef struct {
+    uint8_t tag[16];
+    uint8_t digest[crypto_hash_sha512_BYTES];
+} PrehashMessage;
+
+static const uint8_t kPrehashTag[16] = "SeekritEd25519ph";   // (not NUL-terminated)
+
+// Prehashed signatures are made with a key derived from the seed, never with the key itself, so
+// a plain signature of an attacker-supplied PrehashMessage can't pass as a prehashed signature.
+static const char kPrehashKeyContext[] = "Seekrit prehash signing key";
+
+
+@interface CBSignaturePrehash ()
+- (PrehashMessage) message;
+@end
+
+
 /** libsodium uses a larger key for signing (which actually contains both public & private keys) */
 typedef struct {
     uint8_t bytes[crypto_sign_SECRETKEYBYTES];
@@ -23,10 +42,11 @@ typedef struct {
     // Since libsodium wants a larger key structure for signing, I allocate one here.
     // The inherited _rawKey stores the seed, not the actual key.
     CBRawSigningKey _secretKey;
+    CBRawSigningKey _prehashSecretKey;
 }
 
 
-@synthesize publicKey=_publicKey;
+@synthesize publicKey=_publicKey, prehashPublicKey=_prehashPublicKey;
 
 
 - (instancetype) init {
@@ -42,6 +62,14 @@ typedef struct {
     if (self) {
         crypto_sign_seed_keypair(pub.bytes, _secretKey.bytes, rawKey.bytes); // rawKey is really seed
         _publicKey = [[CBVerifyingPublicKey alloc] initWithRawKey: pub];
+
+        CBKeySeed prehashSeed;
+        crypto_generichash(prehashSeed.bytes, sizeof(prehashSeed),
+                           (const uint8_t*)kPrehashKeyContext, sizeof(kPrehashKeyContext),
+                           rawKey.bytes, sizeof(rawKey));
+        crypto_sign_seed_keypair(pub.bytes, _prehashSecretKey.bytes, prehashSeed.bytes);
+        sodium_memzero(&prehashSeed, sizeof(prehashSeed));
+        _prehashPublicKey = [[CBVerifyingPublicKey alloc] initWithRawKey: pub];
     }
     return self;
 }
@@ -50,6 +78,7 @@ typedef struct {
 - (void) dealloc {
     // Don't leave key data lying around in RAM (remember Heartbleed...)
     memset(&_secretKey, 0, sizeof(_secretKey));
+    memset(&_prehashSecretKey, 0, sizeof(_prehashSecretKey));
 }
 
 
@@ -64,6 +93,19 @@ typedef struct {
 }
 
 
+- (CBSignature) signPrehash: (CBSignaturePrehash*)prehash {
+    NSParameterAssert(prehash != nil);
+    PrehashMessage message = prehash.message;
+    CBSignature signature;
+    uint64_t sigLen;
+    if (crypto_sign_detached(signature.bytes, &sigLen, (const uint8_t*)&message, sizeof(message),
+                             _prehashSecretKey.bytes) != 0)
+        [NSException raise: NSInternalInconsistencyException
+                    format: @"crypto_sign_detached failed"];
+    return signature;
+}
+
+
 - (CBEncryptingPrivateKey*) asEncryptingKey {
     CBRawKey rawEncryptingKey;
     crypto_sign_ed25519_sk_to_curve25519(rawEncryptingKey.bytes, self.rawKey.bytes);
@@ -95,4 +137,149 @@ typedef struct {
 }
 
 
+- (BOOL) verifySignature: (CBSignature)signature
+               ofPrehash: (CBSignaturePrehash*)prehash
+{
+    NSParameterAssert(prehash != nil);
+    PrehashMessage message = prehash.message;
+    return 0 == crypto_sign_verify_detached(signature.bytes, (const uint8_t*)&message,
+                                            sizeof(message), self.rawKey.bytes);
+}
+
+
+// Number of signatures verified by each task in a batch. A multiple of 8, so tasks never write
+// to the same byte of the results bitmap.
+#define kBatchStride 64
+
++ (BOOL) verifySignatures: (const CBSignature*)signatures
+                   ofData: (NSArray*)inputs
+                 withKeys: (NSArray*)keys
+                  results: (uint8_t*)outResults
+{
+    NSUInteger count = inputs.count;
+    NSParameterAssert(keys.count == count);
+    NSParameterAssert(signatures != NULL || count == 0);
+    if (count == 0)
+        return YES;
+
+    // Gather everything into C arrays first, so the concurrent part doesn't touch the arrays:
+    CBRawKey* rawKeys = malloc(count * sizeof(CBRawKey));
+    const uint8_t** bytes = malloc(count * sizeof(const uint8_t*));
+    size_t* lengths = malloc(count * sizeof(size_t));
+    uint8_t* results = outResults ?: malloc((count + 7) / 8);
+    if (!rawKeys || !bytes || !lengths || !results) {
+        free(rawKeys);
+        free(bytes);
+        free(lengths);
+        if (results != outResults)
+            free(results);
+        [NSException raise: NSMallocException format: @"Out of memory"];
+    }
+    for (NSUInteger i = 0; i < count; ++i) {
+        NSData* input = inputs[i];
+        CBVerifyingPublicKey* key = keys[i];
+        rawKeys[i] = key.rawKey;
+        bytes[i] = input.bytes;
+        lengths[i] = input.length;
+    }
+    memset(results, 0, (count + 7) / 8);
+
+    size_t nTasks = (count + kBatchStride - 1) / kBatchStride;
+    dispatch_apply(nTasks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                   ^(size_t task) {
+        NSUInteger end = MIN((task + 1) * kBatchStride, count);
+        for (NSUInteger i = task * kBatchStride; i < end; ++i) {
+            if (0 == crypto_sign_verify_detached(signatures[i].bytes, bytes[i], lengths[i],
+                                                 rawKeys[i].bytes))
+                results[i / 8] |= (uint8_t)(1 << (i % 8));
+        }
+    });
+
+    BOOL allValid = YES;
+    for (NSUInteger i = 0; i < count; ++i) {
+        if (!(results[i / 8] & (1 << (i % 8)))) {
+            allValid = NO;
+            break;
+        }
+    }
+
+    free(rawKeys);
+    free(bytes);
+    free(lengths);
+    if (results != outResults)
+        free(results);
+    return allValid;
+}
+
+
+@end
+
+
+
+
+#define kReadBufferSize 65536
+
+@implementation CBSignaturePrehash
+{
+    crypto_hash_sha512_state _state;
+    PrehashMessage _message;
+    BOOL _finished;
+}
+
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        crypto_hash_sha512_init(&_state);
+    }
+    return self;
+}
+
+
+- (void) updateWithBytes: (const void*)bytes length: (size_t)length {
+    if (_finished)
+        [NSException raise: NSInternalInconsistencyException
+                    format: @"CBSignaturePrehash has already been signed or verified"];
+    crypto_hash_sha512_update(&_state, bytes, length);
+}
+
+
+- (void) updateWithData: (NSData*)data {
+    [self updateWithBytes: data.bytes length: data.length];
+}
+
+
+- (BOOL) updateWithFileDescriptor: (int)fd
+                            error: (NSError**)outError
+{
+    uint8_t* buffer = malloc(kReadBufferSize);
+    if (!buffer)
+        return MYReturnError(outError, ENOMEM, NSPOSIXErrorDomain, @"Out of memory");
+    BOOL ok = YES;
+    for (;;) {
+        ssize_t n = read(fd, buffer, kReadBufferSize);
+        if (n > 0) {
+            [self updateWithBytes: buffer length: n];
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR) {
+            ok = MYReturnError(outError, errno, NSPOSIXErrorDomain, @"%s", strerror(errno));
+            break;
+        }
+    }
+    free(buffer);
+    return ok;
+}
+
+
+- (PrehashMessage) message {
+    if (!_finished) {
+        memcpy(_message.tag, kPrehashTag, sizeof(_message.tag));
+        crypto_hash_sha512_final(&_state, _message.digest);
+        _finished = YES;
+    }
+    return _message;
+}
+
+
 @end
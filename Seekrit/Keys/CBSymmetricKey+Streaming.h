@@ -0,0 +1,50 @@
+//
+//  CBSymmetricKey+Streaming.h
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBSymmetricKey.h"
+
+
+/** The amount of cleartext encrypted in each chunk by the streaming methods. */
+extern const size_t kCBStreamChunkSize;
+
+
+/** Encryption of arbitrarily large data without having to hold it all in memory.
+    The data is split into fixed-size chunks, each of which is encrypted and authenticated
+    separately with a nonce derived from a per-stream random prefix and the chunk's position.
+    The last chunk is flagged as such, so truncation or reordering of the ciphertext is detected.
+    Memory usage is a couple of chunk-sized buffers regardless of the size of the data.
+
+    The streaming format is NOT compatible with -encrypt: / -decrypt:.
+
+    NSStreams will be opened if necessary, but are not closed. File descriptors are not closed. */
+@interface CBSymmetricKey (Streaming)
+
+/** Reads cleartext from `input` until EOF, writing the encrypted form to `output`. */
+- (BOOL) encryptStream: (NSInputStream*)input
+              toStream: (NSOutputStream*)output
+                 error: (NSError**)outError;
+
+/** Reads ciphertext created by -encryptStream:toStream:error: from `input`, writing the decrypted
+    form to `output`.
+    Each chunk is written as soon as it's been authenticated. If this method fails, some data may
+    already have been written, and the caller should discard it. */
+- (BOOL) decryptStream: (NSInputStream*)input
+              toStream: (NSOutputStream*)output
+                 error: (NSError**)outError;
+
+/** Same as -encryptStream:toStream:error:, but operates on file descriptors. */
+- (BOOL) encryptFileDescriptor: (int)inputFD
+              toFileDescriptor: (int)outputFD
+                         error: (NSError**)outError;
+
+/** Same as -decryptStream:toStream:error:, but operates on file descriptors. */
+- (BOOL) decryptFileDescriptor: (int)inputFD
+              toFileDescriptor: (int)outputFD
+                         error: (NSError**)outError;
+
+@end
@@ -0,0 +1,311 @@
+//
+//  CBSymmetricKey+Streaming.m
+//  Seekrit
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+
+#import "CBSymmetricKey+Streaming.h"
+#import "CBKey+Private.h"
+#import "MYErrorUtils.h"
+#import "sodium.h"
+
+
+/*
+ Data format:
+    Header:
+        Magic number ("CBS")         3 bytes
+        Format version (1)           1 byte
+        log2 of chunk size           1 byte
+        Nonce prefix                16 bytes (random)
+    for each chunk {
+        encrypted cleartext          (chunk size) bytes + 16 bytes overhead
+    }
+
+ Every chunk but the last contains exactly (chunk size) bytes of cleartext; the last chunk
+ contains less (possibly zero.) The nonce of each chunk consists of the 16-byte prefix, followed by
+ the chunk number as a 56-bit big-endian integer, followed by a byte that is 1 for the last chunk
+ and 0 otherwise. So reordering, dropping or truncating chunks will cause decryption to fail.
+ */
+
+#define kChunkSizeLog2      16
+#define kMinChunkSizeLog2   10
+#define kMaxChunkSizeLog2   24
+#define kMaxChunkCount      (1ull << 56)
+
+const size_t kCBStreamChunkSize = 1 << kChunkSizeLog2;
+
+static const uint8_t kMagic[3] = {'C', 'B', 'S'};
+#define kFormatVersion 1
+
+typedef struct {
+    uint8_t magic[3];
+    uint8_t version;
+    uint8_t chunkSizeLog2;
+    uint8_t noncePrefix[16];
+} StreamHeader;
+
+
+static BOOL mkError(NSInteger code, NSString* message, NSError** outError) {
+    return MYReturnError(outError, code, CBKeyErrorDomain, @"%@", message);
+}
+
+
+static void chunkNonce(CBNonce* nonce, const uint8_t prefix[16], uint64_t chunkNo, BOOL last) {
+    memcpy(nonce->bytes, prefix, 16);
+    for (int i = 22; i >= 16; --i) {
+        nonce->bytes[i] = (uint8_t)chunkNo;
+        chunkNo >>= 8;
+    }
+    nonce->bytes[23] = last ? 1 : 0;
+}
+
+
+BOOL CBEncryptChunks(const CBRawKey* key,
+                     CBStreamReader reader, CBStreamWriter writer,
+                     NSError** outError)
+{
+    StreamHeader header = {.version = kFormatVersion, .chunkSizeLog2 = kChunkSizeLog2};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    randombytes_buf(header.noncePrefix, sizeof(header.noncePrefix));
+    if (!writer(&header, sizeof(header), outError))
+        return NO;
+
+    const size_t chunkSize = 1 << kChunkSizeLog2;
+    uint8_t* cleartext = malloc(chunkSize);
+    uint8_t* ciphertext = malloc(chunkSize + crypto_secretbox_MACBYTES);
+    if (!cleartext || !ciphertext) {
+        free(cleartext);
+        free(ciphertext);
+        return MYReturnError(outError, ENOMEM, NSPOSIXErrorDomain, @"Out of memory");
+    }
+
+    BOOL ok = YES, last = NO;
+    for (uint64_t chunkNo = 0; !last; ++chunkNo) {
+        ssize_t clearLen = reader(cleartext, chunkSize, outError);
+        if (clearLen < 0) {
+            ok = NO;
+            break;
+        } else if (chunkNo >= kMaxChunkCount) {
+            ok = mkError(kCBKeyErrorUnknownFormat, @"Stream too long", outError);
+            break;
+        }
+        last = ((size_t)clearLen < chunkSize);
+        CBNonce nonce;
+        chunkNonce(&nonce, header.noncePrefix, chunkNo, last);
+        crypto_secretbox_easy(ciphertext, cleartext, clearLen, nonce.bytes, key->bytes);
+        if (!writer(ciphertext, clearLen + crypto_secretbox_MACBYTES, outError)) {
+            ok = NO;
+            break;
+        }
+    }
+
+    sodium_memzero(cleartext, chunkSize);
+    free(cleartext);
+    free(ciphertext);
+    return ok;
+}
+
+
+BOOL CBDecryptChunks(const CBRawKey* key,
+                     CBStreamReader reader, CBStreamWriter writer,
+                     NSError** outError)
+{
+    StreamHeader header;
+    ssize_t n = reader(&header, sizeof(header), outError);
+    if (n < 0)
+        return NO;
+    else if ((size_t)n < sizeof(header))
+        return mkError(kCBKeyErrorTruncated, @"Encrypted stream is truncated", outError);
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kFormatVersion
+            || header.chunkSizeLog2 < kMinChunkSizeLog2 || header.chunkSizeLog2 > kMaxChunkSizeLog2)
+        return mkError(kCBKeyErrorUnknownFormat, @"Unknown encrypted stream format", outError);
+
+    const size_t chunkSize = (size_t)1 << header.chunkSizeLog2;
+    const size_t cipherChunkSize = chunkSize + crypto_secretbox_MACBYTES;
+    uint8_t* ciphertext = malloc(cipherChunkSize);
+    uint8_t* cleartext = malloc(chunkSize);
+    if (!cleartext || !ciphertext) {
+        free(cleartext);
+        free(ciphertext);
+        return MYReturnError(outError, ENOMEM, NSPOSIXErrorDomain, @"Out of memory");
+    }
+
+    BOOL ok = YES, last = NO;
+    for (uint64_t chunkNo = 0; !last; ++chunkNo) {
+        ssize_t cipherLen = reader(ciphertext, cipherChunkSize, outError);
+        if (cipherLen < 0) {
+            ok = NO;
+            break;
+        } else if ((size_t)cipherLen < crypto_secretbox_MACBYTES) {
+            ok = mkError(kCBKeyErrorTruncated, @"Encrypted stream is truncated", outError);
+            break;
+        }
+        // A short chunk has to be the last one:
+        last = ((size_t)cipherLen < cipherChunkSize);
+        CBNonce nonce;
+        chunkNonce(&nonce, header.noncePrefix, chunkNo, last);
+        if (0 != crypto_secretbox_open_easy(cleartext, ciphertext, cipherLen,
+                                            nonce.bytes, key->bytes)) {
+            ok = mkError(kCBKeyErrorDecryptionFailed, @"Encrypted stream is corrupt", outError);
+            break;
+        }
+        if (!writer(cleartext, cipherLen - crypto_secretbox_MACBYTES, outError)) {
+            ok = NO;
+            break;
+        }
+    }
+
+    if (ok) {
+        // Make sure nothing follows the last chunk:
+        uint8_t extra;
+        n = reader(&extra, 1, outError);
+        if (n < 0)
+            ok = NO;
+        else if (n > 0)
+            ok = mkError(kCBKeyErrorUnknownFormat, @"Unexpected data after encrypted stream",
+                         outError);
+    }
+
+    sodium_memzero(cleartext, chunkSize);
+    free(cleartext);
+    free(ciphertext);
+    return ok;
+}
+
+
+#pragma mark - I/O ADAPTERS:
+
+
+CBStreamReader CBReaderForStream(NSInputStream* stream) {
+    if (stream.streamStatus == NSStreamStatusNotOpen)
+        [stream open];
+    return ^ssize_t(void* buffer, size_t length, NSError** outError) {
+        size_t total = 0;
+        while (total < length) {
+            NSInteger n = [stream read: (uint8_t*)buffer + total maxLength: length - total];
+            if (n < 0) {
+                if (outError)
+                    *outError = stream.streamError;
+                return -1;
+            } else if (n == 0) {
+                break;
+            }
+            total += n;
+        }
+        return total;
+    };
+}
+
+
+CBStreamWriter CBWriterForStream(NSOutputStream* stream) {
+    if (stream.streamStatus == NSStreamStatusNotOpen)
+        [stream open];
+    return ^BOOL(const void* buffer, size_t length, NSError** outError) {
+        size_t total = 0;
+        while (total < length) {
+            NSInteger n = [stream write: (const uint8_t*)buffer + total maxLength: length - total];
+            if (n < 0) {
+                if (outError)
+                    *outError = stream.streamError;
+                return NO;
+            } else if (n == 0) {
+                return MYReturnError(outError, ENOSPC, NSPOSIXErrorDomain, @"Output stream is full");
+            }
+            total += n;
+        }
+        return YES;
+    };
+}
+
+
+CBStreamReader CBReaderForFD(int fd) {
+    return ^ssize_t(void* buffer, size_t length, NSError** outError) {
+        size_t total = 0;
+        while (total < length) {
+            ssize_t n = read(fd, (uint8_t*)buffer + total, length - total);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                MYReturnError(outError, errno, NSPOSIXErrorDomain, @"%s", strerror(errno));
+                return -1;
+            } else if (n == 0) {
+                break;
+            }
+            total += n;
+        }
+        return total;
+    };
+}
+
+
+CBStreamWriter CBWriterForFD(int fd) {
+    return ^BOOL(const void* buffer, size_t length, NSError** outError) {
+        size_t total = 0;
+        while (total < length) {
+            ssize_t n = write(fd, (const uint8_t*)buffer + total, length - total);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return MYReturnError(outError, errno, NSPOSIXErrorDomain, @"%s", strerror(errno));
+            }
+            total += n;
+        }
+        return YES;
+    };
+}
+
+
+@implementation CBSymmetricKey (Streaming)
+
+
+- (BOOL) encryptStream: (NSInputStream*)input
+              toStream: (NSOutputStream*)output
+                 error: (NSError**)outError
+{
+    NSParameterAssert(input && output);
+    CBRawKey key = self.rawKey;
+    BOOL ok = CBEncryptChunks(&key, CBReaderForStream(input), CBWriterForStream(output),
+                              outError);
+    sodium_memzero(&key, sizeof(key));
+    return ok;
+}
+
+
+- (BOOL) decryptStream: (NSInputStream*)input
+              toStream: (NSOutputStream*)output
+                 error: (NSError**)outError
+{
+    NSParameterAssert(input && output);
+    CBRawKey key = self.rawKey;
+    BOOL ok = CBDecryptChunks(&key, CBReaderForStream(input), CBWriterForStream(output),
+                              outError);
+    sodium_memzero(&key, sizeof(key));
+    return ok;
+}
+
+
+- (BOOL) encryptFileDescriptor: (int)inputFD
+              toFileDescriptor: (int)outputFD
+                         error: (NSError**)outError
+{
+    CBRawKey key = self.rawKey;
+    BOOL ok = CBEncryptChunks(&key, CBReaderForFD(inputFD), CBWriterForFD(outputFD), outError);
+    sodium_memzero(&key, sizeof(key));
+    return ok;
+}
+
+
+- (BOOL) decryptFileDescriptor: (int)inputFD
+              toFileDescriptor: (int)outputFD
+                         error: (NSError**)outError
+{
+    CBRawKey key = self.rawKey;
+    BOOL ok = CBDecryptChunks(&key, CBReaderForFD(inputFD), CBWriterForFD(outputFD), outError);
+    sodium_memzero(&key, sizeof(key));
+    return ok;
+}
+
+
+@end
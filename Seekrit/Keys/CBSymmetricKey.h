@@ -12,6 +12,15 @@
 /** A short identifier sent along with an encrypted message to narrow down the choice of keys. */
 typedef UInt16 CBKeyClue;
 
+/** A wider clue that's derived from the key using a secret CBClueKey, so it reveals nothing about
+    the key to anyone who doesn't have the clue key. */
+typedef UInt32 CBKeyedClue;
+
+/** A secret key used to compute CBKeyedClues. (128 bits, 16 bytes) */
+typedef struct {
+    uint8_t bytes[16];
+} CBClueKey;
+
 
 /** A symmetric key that both encrypts and decrypts.
     Uses the libsodium "crypto_secretbox" API, encrypting with XSalsa20 and authenticating with
@@ -54,6 +63,90 @@ typedef UInt16 CBKeyClue;
 - (NSData*) decrypt: (NSData*)ciphertext;
 
 
+// NON-ALLOCATING VARIANTS:
+
+/** Encrypts `length` bytes at `cleartext`, writing the result to `ciphertext`, which must have room
+    for `length + kCBEncryptionOverhead` bytes. For details, see -encrypt:withNonce:. */
+- (void) encryptBytes: (const void*)cleartext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+                 into: (void*)ciphertext;
+
+/** Decrypts `length` bytes at `ciphertext`, writing the result to `cleartext`, which must have room
+    for `length - kCBEncryptionOverhead` bytes. Returns NO if decryption fails, in which case the
+    contents of `cleartext` are undefined. For details, see -decrypt:withNonce:. */
+- (BOOL) decryptBytes: (const void*)ciphertext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+                 into: (void*)cleartext;
+
+/** Encrypts `length` bytes at `cleartext`, prefixed with a random nonce, writing the result to
+    `ciphertext`, which must have room for `sizeof(CBNonce) + length + kCBEncryptionOverhead`
+    bytes. This is the same format produced by -encrypt:. */
+- (void) encryptBytes: (const void*)cleartext
+               length: (size_t)length
+                 into: (void*)ciphertext;
+
+/** Decrypts `length` bytes at `ciphertext` (as produced by -encrypt: or -encryptBytes:length:into:)
+    writing the result to `cleartext`, which must have room for
+    `length - sizeof(CBNonce) - kCBEncryptionOverhead` bytes. Returns NO if decryption fails. */
+- (BOOL) decryptBytes: (const void*)ciphertext
+               length: (size_t)length
+                 into: (void*)cleartext;
+
+/** Same as -encrypt:withNonce:, but appends the result to `output`. */
+- (void) encrypt: (NSData*)cleartext
+       withNonce: (CBNonce)nonce
+        appendTo: (NSMutableData*)output;
+
+/** Same as -encrypt:, but appends the result to `output`. */
+- (void) encrypt: (NSData*)cleartext
+        appendTo: (NSMutableData*)output;
+
+/** Same as -decrypt:, but appends the result to `output`. Returns NO (leaving `output` unchanged)
+    if decryption fails. */
+- (BOOL) decrypt: (NSData*)ciphertext
+        appendTo: (NSMutableData*)output;
+
+
+// AUTHENTICATED ENCRYPTION WITH ASSOCIATED DATA:
+
+/** The number of bytes by which the output of -encrypt:associatedData: is longer than the input. */
+#define kCBAssociatedDataOverhead (1 + sizeof(CBNonce) + kCBEncryptionOverhead)
+
+/** Encrypts a data block, and also authenticates `associatedData`, which is NOT encrypted or
+    included in the result. The same associated data has to be passed to -decrypt:associatedData:,
+    otherwise decryption will fail. This is useful for binding cleartext metadata (like a document
+    ID or revision) to the ciphertext without having to copy it into the encrypted payload.
+    Uses ChaCha20-Poly1305, with a random 24-byte nonce. The result starts with a format byte that
+    distinguishes it from the output of -encrypt:, followed by the nonce.
+    @param cleartext  The message to be encrypted.
+    @param associatedData  Data to be authenticated along with the message; may be nil.
+    @return  The encrypted message. */
+- (NSData*) encrypt: (NSData*)cleartext
+     associatedData: (NSData*)associatedData;
+
+/** Decrypts a data block created by -encrypt:associatedData:. For compatibility, if
+    `associatedData` is empty this will also decrypt data created by -encrypt:.
+    @param ciphertext  The encrypted message.
+    @param associatedData  The same associated data that was given when encrypting; may be nil.
+    @return  The decrypted message, or nil if it could not be decrypted (because this isn't the
+                encrypting key, the associated data doesn't match, or the ciphertext is corrupt.) */
+- (NSData*) decrypt: (NSData*)ciphertext
+     associatedData: (NSData*)associatedData;
+
+/** Same as -encrypt:associatedData:, but appends the result to `output`. */
+- (void) encrypt: (NSData*)cleartext
+  associatedData: (NSData*)associatedData
+        appendTo: (NSMutableData*)output;
+
+/** Same as -decrypt:associatedData:, but appends the result to `output`. Returns NO (leaving
+    `output` unchanged) if decryption fails. */
+- (BOOL) decrypt: (NSData*)ciphertext
+  associatedData: (NSData*)associatedData
+        appendTo: (NSMutableData*)output;
+
+
 // CLUES:
 
 /** A 16-bit integer derived from the key data. Knowing this can help identify which key to use
@@ -66,7 +159,51 @@ typedef UInt16 CBKeyClue;
 /** Decrypts a data block that's been prepended with a clue. */
 - (NSData*) decryptWithClue: (NSData*)ciphertext;
 
+/** Same as -encryptWithClue:, but appends the result to `output`. */
+- (void) encryptWithClue: (NSData*)cleartext
+                appendTo: (NSMutableData*)output;
+
+/** Same as -decryptWithClue:, but appends the result to `output`. Returns NO (leaving `output`
+    unchanged) if decryption fails. */
+- (BOOL) decryptWithClue: (NSData*)ciphertext
+                appendTo: (NSMutableData*)output;
+
 /** Returns the clue prepended to the encrypted data by -encryptWithClue:. */
 + (CBKeyClue) clueForEncryptedData: (NSData*)ciphertext;
 
+
+// KEYED CLUES:
+
+/** Generates a random clue key. */
++ (CBClueKey) randomClueKey;
+
+/** A 32-bit SipHash of the key data, keyed with `clueKey`. With a 32-bit clue, a set of a million
+    keys will have very few collisions, so identifying the key to decrypt with is nearly free. */
+- (CBKeyedClue) keyedClueWithClueKey: (CBClueKey)clueKey;
+
+/** Encrypts a data block, prepending a format byte and the key's keyed clue. */
+- (NSData*) encrypt: (NSData*)cleartext
+        withClueKey: (CBClueKey)clueKey;
+
+/** Same as -encrypt:withClueKey:, but appends the result to `output`. */
+- (void) encrypt: (NSData*)cleartext
+     withClueKey: (CBClueKey)clueKey
+        appendTo: (NSMutableData*)output;
+
+/** Decrypts a data block created by -encrypt:withClueKey:. Returns nil if the clue doesn't match. */
+- (NSData*) decrypt: (NSData*)ciphertext
+        withClueKey: (CBClueKey)clueKey;
+
+/** Same as -decrypt:withClueKey:, but appends the result to `output`. Returns NO (leaving
+    `output` unchanged) if decryption fails. */
+- (BOOL) decrypt: (NSData*)ciphertext
+     withClueKey: (CBClueKey)clueKey
+        appendTo: (NSMutableData*)output;
+
+/** Gets the keyed clue prepended to the encrypted data by -encrypt:withClueKey:.
+    Returns NO if the data isn't in that format. (Data from -encryptWithClue: has a 1/256 chance of
+    looking like it is, so if decryption fails the caller should fall back to the 16-bit clue.) */
++ (BOOL) getKeyedClue: (CBKeyedClue*)outClue
+     forEncryptedData: (NSData*)ciphertext;
+
 @end
@@ -41,17 +41,76 @@
 }
 
 
+- (void) encryptBytes: (const void*)cleartext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+                 into: (void*)ciphertext
+{
+    crypto_secretbox_easy(ciphertext, cleartext, length, nonce.bytes, self.rawKey.bytes);
+}
+
+
+- (BOOL) decryptBytes: (const void*)ciphertext
+               length: (size_t)length
+            withNonce: (CBNonce)nonce
+                 into: (void*)cleartext
+{
+    if (length < crypto_secretbox_MACBYTES)
+        return NO;
+    return 0 == crypto_secretbox_open_easy(cleartext, ciphertext, length,
+                                           nonce.bytes, self.rawKey.bytes);
+}
+
+
+- (void) encryptBytes: (const void*)cleartext
+               length: (size_t)length
+                 into: (void*)output
+{
+    // Encrypted data is prefixed with the nonce
+    CBNonce *nonce = output;
+    *nonce = [CBKey randomNonce];
+    [self encryptBytes: cleartext length: length withNonce: *nonce
+                  into: (uint8_t*)output + sizeof(CBNonce)];
+}
+
+
+- (BOOL) decryptBytes: (const void*)ciphertext
+               length: (size_t)length
+                 into: (void*)output
+{
+    if (length < sizeof(CBNonce))
+        return NO;
+    const CBNonce *nonce = ciphertext;    // Recover the nonce used to encrypt
+    return [self decryptBytes: (const uint8_t*)ciphertext + sizeof(CBNonce)
+                       length: length - sizeof(CBNonce)
+                    withNonce: *nonce
+                         into: output];
+}
+
+
 - (NSData*) encrypt: (NSData*)cleartext
           withNonce: (CBNonce)nonce
 {
     size_t clearLen = cleartext.length;
     size_t cipherLen = clearLen + crypto_secretbox_MACBYTES;
     void* ciphertext = malloc(cipherLen);
-    crypto_secretbox_easy(ciphertext, cleartext.bytes, clearLen, nonce.bytes, self.rawKey.bytes);
+    [self encryptBytes: cleartext.bytes length: clearLen withNonce: nonce into: ciphertext];
     return [NSData dataWithBytesNoCopy: ciphertext length: cipherLen freeWhenDone: YES];
 }
 
 
+- (void) encrypt: (NSData*)cleartext
+       withNonce: (CBNonce)nonce
+        appendTo: (NSMutableData*)output
+{
+    size_t clearLen = cleartext.length;
+    size_t outputLen = output.length;
+    output.length += clearLen + crypto_secretbox_MACBYTES;
+    [self encryptBytes: cleartext.bytes length: clearLen withNonce: nonce
+                  into: (uint8_t*)output.mutableBytes + outputLen];
+}
+
+
 - (NSData*) decrypt: (NSData*)ciphertext
           withNonce: (CBNonce)nonce
 {
@@ -60,44 +119,181 @@
     if (ciphertext.length < crypto_secretbox_MACBYTES)
         return nil;
     size_t msgLen = ciphertext.length - crypto_secretbox_MACBYTES;
-    NSMutableData* cleartext = [NSMutableData dataWithLength: msgLen];
-    if (0 != crypto_secretbox_open_easy(cleartext.mutableBytes,
-                                        ciphertext.bytes, ciphertext.length,
-                                        nonce.bytes, self.rawKey.bytes))
+    void* cleartext = malloc(MAX(msgLen, 1u));
+    if (![self decryptBytes: ciphertext.bytes length: ciphertext.length
+                  withNonce: nonce into: cleartext]) {
+        free(cleartext);
         return nil;
-    return cleartext;
+    }
+    return [NSData dataWithBytesNoCopy: cleartext length: msgLen freeWhenDone: YES];
 }
 
 
 - (NSData*) encrypt: (NSData*)cleartext {
     size_t clearLen = cleartext.length;
-    size_t cipherLen = clearLen + crypto_secretbox_MACBYTES;
-    size_t outputLen = cipherLen + sizeof(CBNonce);
+    size_t outputLen = sizeof(CBNonce) + clearLen + crypto_secretbox_MACBYTES;
     void* ciphertext = malloc(outputLen);
-    // Encrypted data is prefixed with the nonce
-    CBNonce *nonce = ciphertext;
-    *nonce = [CBKey randomNonce];
-    crypto_secretbox_easy(ciphertext + sizeof(CBNonce), cleartext.bytes, clearLen,
-                          nonce->bytes, self.rawKey.bytes);
+    [self encryptBytes: cleartext.bytes length: clearLen into: ciphertext];
     return [NSData dataWithBytesNoCopy: ciphertext length: outputLen freeWhenDone: YES];
 }
 
 
+- (void) encrypt: (NSData*)cleartext
+        appendTo: (NSMutableData*)output
+{
+    size_t clearLen = cleartext.length;
+    size_t outputLen = output.length;
+    output.length += sizeof(CBNonce) + clearLen + crypto_secretbox_MACBYTES;
+    [self encryptBytes: cleartext.bytes length: clearLen
+                  into: (uint8_t*)output.mutableBytes + outputLen];
+}
+
+
 - (NSData*) decrypt: (NSData*)ciphertext {
     NSParameterAssert(ciphertext != nil);
 
     if (ciphertext.length < crypto_secretbox_MACBYTES + sizeof(CBNonce))
         return nil;
-    const CBNonce *nonce = ciphertext.bytes;    // Recover the nonce used to encrypt
-
-    size_t cipherLen = ciphertext.length - sizeof(CBNonce);
-    size_t msgLen = cipherLen - crypto_secretbox_MACBYTES;
-    NSMutableData* cleartext = [NSMutableData dataWithLength: msgLen];
-    if (0 != crypto_secretbox_open_easy(cleartext.mutableBytes,
-                                        ciphertext.bytes + sizeof(CBNonce), cipherLen,
-                                        nonce->bytes, self.rawKey.bytes))
+    size_t msgLen = ciphertext.length - sizeof(CBNonce) - crypto_secretbox_MACBYTES;
+    void* cleartext = malloc(MAX(msgLen, 1u));
+    if (![self decryptBytes: ciphertext.bytes length: ciphertext.length into: cleartext]) {
+        free(cleartext);
         return nil;
-    return cleartext;
+    }
+    return [NSData dataWithBytesNoCopy: cleartext length: msgLen freeWhenDone: YES];
+}
+
+
+- (BOOL) decrypt: (NSData*)ciphertext
+        appendTo: (NSMutableData*)output
+{
+    NSParameterAssert(ciphertext != nil);
+
+    if (ciphertext.length < crypto_secretbox_MACBYTES + sizeof(CBNonce))
+        return NO;
+    size_t msgLen = ciphertext.length - sizeof(CBNonce) - crypto_secretbox_MACBYTES;
+    size_t outputLen = output.length;
+    output.length += msgLen;
+    if (![self decryptBytes: ciphertext.bytes length: ciphertext.length
+                       into: (uint8_t*)output.mutableBytes + outputLen]) {
+        output.length = outputLen;
+        return NO;
+    }
+    return YES;
+}
+
+
+#pragma mark - AEAD:
+
+
+/*
+ AEAD data format:
+    Format byte (0xA1)           1 byte
+    Nonce                       24 bytes (random)
+    Ciphertext                  same length as cleartext
+    MAC                         16 bytes
+
+ The vendored ChaCha20-Poly1305 only takes a 64-bit nonce, which is too small to pick at random.
+ So a per-message subkey is derived from the first 16 bytes of the nonce, and the last 8 bytes
+ become the ChaCha20 nonce. The subkey is a BLAKE2b hash of a context string and those 16 bytes,
+ keyed with the key. (It isn't derived with HSalsa20 like secretbox's, so a key used for both
+ formats never produces the same subkey in each.)
+ */
+
+#define kAEADFormat 0xA1
+
+
+static const char kAEADContext[] = "Seekrit AEAD subkey";
+
+- (void) getAEADSubkey: (uint8_t*)subkey forNonce: (const CBNonce*)nonce {
+    CBRawKey key = self.rawKey;
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, key.bytes, sizeof(key),
+                            crypto_aead_chacha20poly1305_KEYBYTES);
+    crypto_generichash_update(&state, (const uint8_t*)kAEADContext, sizeof(kAEADContext));
+    crypto_generichash_update(&state, nonce->bytes, 16);
+    crypto_generichash_final(&state, subkey, crypto_aead_chacha20poly1305_KEYBYTES);
+    sodium_memzero(&key, sizeof(key));
+    sodium_memzero(&state, sizeof(state));
+}
+
+
+- (void) encrypt: (NSData*)cleartext
+  associatedData: (NSData*)associatedData
+        appendTo: (NSMutableData*)output
+{
+    assert(crypto_aead_chacha20poly1305_ABYTES == kCBEncryptionOverhead);
+    size_t clearLen = cleartext.length;
+    size_t outputLen = output.length;
+    output.length += kCBAssociatedDataOverhead + clearLen;
+    uint8_t* dst = (uint8_t*)output.mutableBytes + outputLen;
+
+    dst[0] = kAEADFormat;
+    CBNonce* nonce = (CBNonce*)&dst[1];
+    *nonce = [CBKey randomNonce];
+    uint8_t subkey[crypto_aead_chacha20poly1305_KEYBYTES];
+    [self getAEADSubkey: subkey forNonce: nonce];
+    unsigned long long cipherLen;
+    crypto_aead_chacha20poly1305_encrypt(&dst[1 + sizeof(CBNonce)], &cipherLen,
+                                         cleartext.bytes, clearLen,
+                                         associatedData.bytes, associatedData.length,
+                                         NULL, &nonce->bytes[16], subkey);
+    sodium_memzero(subkey, sizeof(subkey));
+}
+
+
+- (NSData*) encrypt: (NSData*)cleartext
+     associatedData: (NSData*)associatedData
+{
+    NSMutableData* output = [NSMutableData dataWithCapacity: kCBAssociatedDataOverhead
+                                                            + cleartext.length];
+    [self encrypt: cleartext associatedData: associatedData appendTo: output];
+    return output;
+}
+
+
+- (BOOL) decrypt: (NSData*)ciphertext
+  associatedData: (NSData*)associatedData
+        appendTo: (NSMutableData*)output
+{
+    NSParameterAssert(ciphertext != nil);
+
+    size_t length = ciphertext.length;
+    const uint8_t* src = ciphertext.bytes;
+    if (length >= kCBAssociatedDataOverhead && src[0] == kAEADFormat) {
+        const CBNonce* nonce = (const CBNonce*)&src[1];
+        uint8_t subkey[crypto_aead_chacha20poly1305_KEYBYTES];
+        [self getAEADSubkey: subkey forNonce: nonce];
+        size_t outputLen = output.length;
+        output.length += length - kCBAssociatedDataOverhead;
+        unsigned long long msgLen;
+        int err = crypto_aead_chacha20poly1305_decrypt((uint8_t*)output.mutableBytes + outputLen,
+                                                       &msgLen, NULL,
+                                                       &src[1 + sizeof(CBNonce)],
+                                                       length - 1 - sizeof(CBNonce),
+                                                       associatedData.bytes, associatedData.length,
+                                                       &nonce->bytes[16], subkey);
+        sodium_memzero(subkey, sizeof(subkey));
+        if (err == 0)
+            return YES;
+        output.length = outputLen;
+    }
+    // Fall back to the older -encrypt: format, which has no format byte. (There's a 1/256 chance
+    // that such a message starts with kAEADFormat, which is why this happens even if the AEAD
+    // decryption above failed.) That format can't authenticate associated data.
+    if (associatedData.length == 0)
+        return [self decrypt: ciphertext appendTo: output];
+    return NO;
+}
+
+
+- (NSData*) decrypt: (NSData*)ciphertext
+     associatedData: (NSData*)associatedData
+{
+    NSMutableData* output = [NSMutableData dataWithCapacity: ciphertext.length];
+    if (![self decrypt: ciphertext associatedData: associatedData appendTo: output])
+        return nil;
+    return output;
 }
 
 
@@ -115,24 +311,166 @@
 
 
 - (NSData*) encryptWithClue: (NSData*)cleartext {
-    CBKeyClue clue = NSSwapHostShortToBig(self.clue);
-    NSMutableData* ciphertext = [[self encrypt: cleartext] mutableCopy];
-    [ciphertext replaceBytesInRange: NSMakeRange(0, 0) withBytes: &clue length: sizeof(clue)];
+    NSMutableData* ciphertext = [NSMutableData dataWithCapacity: sizeof(CBKeyClue)
+                                 + sizeof(CBNonce) + cleartext.length + crypto_secretbox_MACBYTES];
+    [self encryptWithClue: cleartext appendTo: ciphertext];
     return ciphertext;
 }
 
 
+- (void) encryptWithClue: (NSData*)cleartext
+                appendTo: (NSMutableData*)output
+{
+    CBKeyClue clue = NSSwapHostShortToBig(self.clue);
+    [output appendBytes: &clue length: sizeof(clue)];
+    [self encrypt: cleartext appendTo: output];
+}
+
+
 - (NSData*) decryptWithClue: (NSData*)ciphertext {
-    if (ciphertext.length < 2)
+    size_t length = ciphertext.length;
+    if (length < sizeof(CBKeyClue) + sizeof(CBNonce) + crypto_secretbox_MACBYTES)
         return nil;
     if ([[self class] clueForEncryptedData: ciphertext] != self.clue)
         return nil;
-    return [self decrypt: [ciphertext subdataWithRange: NSMakeRange(2, ciphertext.length-2)]];
+    size_t msgLen = length - sizeof(CBKeyClue) - sizeof(CBNonce) - crypto_secretbox_MACBYTES;
+    void* cleartext = malloc(MAX(msgLen, 1u));
+    if (![self decryptBytes: (const uint8_t*)ciphertext.bytes + sizeof(CBKeyClue)
+                     length: length - sizeof(CBKeyClue)
+                       into: cleartext]) {
+        free(cleartext);
+        return nil;
+    }
+    return [NSData dataWithBytesNoCopy: cleartext length: msgLen freeWhenDone: YES];
+}
+
+
+- (BOOL) decryptWithClue: (NSData*)ciphertext
+                appendTo: (NSMutableData*)output
+{
+    size_t length = ciphertext.length;
+    if (length < sizeof(CBKeyClue) + sizeof(CBNonce) + crypto_secretbox_MACBYTES)
+        return NO;
+    if ([[self class] clueForEncryptedData: ciphertext] != self.clue)
+        return NO;
+    size_t msgLen = length - sizeof(CBKeyClue) - sizeof(CBNonce) - crypto_secretbox_MACBYTES;
+    size_t outputLen = output.length;
+    output.length += msgLen;
+    if (![self decryptBytes: (const uint8_t*)ciphertext.bytes + sizeof(CBKeyClue)
+                     length: length - sizeof(CBKeyClue)
+                       into: (uint8_t*)output.mutableBytes + outputLen]) {
+        output.length = outputLen;
+        return NO;
+    }
+    return YES;
 }
 
 
 + (CBKeyClue) clueForEncryptedData: (NSData*)ciphertext {
-    return NSSwapBigShortToHost(*(CBKeyClue*)ciphertext.bytes);
+    if (ciphertext.length < sizeof(CBKeyClue))
+        return 0;
+    return NSSwapBigShortToHost(*(const CBKeyClue*)ciphertext.bytes);
+}
+
+
+#pragma mark - KEYED CLUES:
+
+
+/*
+ Keyed-clue data format:
+    Format byte (0xC2)           1 byte
+    Keyed clue                   4 bytes (big-endian)
+    Nonce                       24 bytes
+    Ciphertext                  cleartext length + 16 bytes
+ */
+
+#define kKeyedClueFormat 0xC2
+#define kKeyedClueHeaderSize (1 + sizeof(CBKeyedClue))
+
+
++ (CBClueKey) randomClueKey {
+    CBClueKey clueKey;
+    randombytes_buf(clueKey.bytes, sizeof(clueKey.bytes));
+    return clueKey;
+}
+
+
+- (CBKeyedClue) keyedClueWithClueKey: (CBClueKey)clueKey {
+    uint8_t hash[crypto_shorthash_BYTES];
+    crypto_shorthash(hash, self.rawKey.bytes, sizeof(CBRawKey), clueKey.bytes);
+    // Decode the hash as little-endian, so the clue is the same on every platform:
+    CBKeyedClue clue;
+    memcpy(&clue, hash, sizeof(clue));
+    return NSSwapLittleIntToHost(clue);
+}
+
+
+- (void) encrypt: (NSData*)cleartext
+     withClueKey: (CBClueKey)clueKey
+        appendTo: (NSMutableData*)output
+{
+    uint8_t header[kKeyedClueHeaderSize] = {kKeyedClueFormat};
+    CBKeyedClue clue = NSSwapHostIntToBig([self keyedClueWithClueKey: clueKey]);
+    memcpy(&header[1], &clue, sizeof(clue));
+    [output appendBytes: header length: sizeof(header)];
+    [self encrypt: cleartext appendTo: output];
+}
+
+
+- (NSData*) encrypt: (NSData*)cleartext
+        withClueKey: (CBClueKey)clueKey
+{
+    NSMutableData* ciphertext = [NSMutableData dataWithCapacity: kKeyedClueHeaderSize
+                                 + sizeof(CBNonce) + cleartext.length + crypto_secretbox_MACBYTES];
+    [self encrypt: cleartext withClueKey: clueKey appendTo: ciphertext];
+    return ciphertext;
+}
+
+
+- (BOOL) decrypt: (NSData*)ciphertext
+     withClueKey: (CBClueKey)clueKey
+        appendTo: (NSMutableData*)output
+{
+    CBKeyedClue clue;
+    if (![[self class] getKeyedClue: &clue forEncryptedData: ciphertext]
+            || clue != [self keyedClueWithClueKey: clueKey])
+        return NO;
+    size_t length = ciphertext.length;
+    if (length < kKeyedClueHeaderSize + sizeof(CBNonce) + crypto_secretbox_MACBYTES)
+        return NO;
+    size_t msgLen = length - kKeyedClueHeaderSize - sizeof(CBNonce) - crypto_secretbox_MACBYTES;
+    size_t outputLen = output.length;
+    output.length += msgLen;
+    if (![self decryptBytes: (const uint8_t*)ciphertext.bytes + kKeyedClueHeaderSize
+                     length: length - kKeyedClueHeaderSize
+                       into: (uint8_t*)output.mutableBytes + outputLen]) {
+        output.length = outputLen;
+        return NO;
+    }
+    return YES;
+}
+
+
+- (NSData*) decrypt: (NSData*)ciphertext
+        withClueKey: (CBClueKey)clueKey
+{
+    NSMutableData* output = [NSMutableData dataWithCapacity: ciphertext.length];
+    if (![self decrypt: ciphertext withClueKey: clueKey appendTo: output])
+        return nil;
+    return output;
+}
+
+
++ (BOOL) getKeyedClue: (CBKeyedClue*)outClue
+     forEncryptedData: (NSData*)ciphertext
+{
+    const uint8_t* bytes = ciphertext.bytes;
+    if (ciphertext.length < kKeyedClueHeaderSize || bytes[0] != kKeyedClueFormat)
+        return NO;
+    CBKeyedClue clue;
+    memcpy(&clue, &bytes[1], sizeof(clue));
+    *outClue = NSSwapBigIntToHost(clue);
+    return YES;
 }
 
 
@@ -10,5 +10,9 @@
 #import "CBSigningPrivateKey.h"
 #import "CBEncryptingPrivateKey.h"
 #import "CBEncryptingPrivateKey+Group.h"
+#import "CBEncryptingSession.h"
+#import "CBEncryptionGroup.h"
+#import "CBGroupKeyTree.h"
 #import "CBSymmetricKey.h"
+#import "CBSymmetricKey+Streaming.h"
 #import "CBKeyBag.h"
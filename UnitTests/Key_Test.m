@@ -11,6 +11,12 @@
 #import "CBKey+Private.h"
 #import "CBEncryptingPrivateKey.h"
 #import "CBEncryptingPrivateKey+Group.h"
+#import "CBEncryptingSession.h"
+#import "CBEncryptionGroup.h"
+#import "CBGroupKeyTree.h"
+#import "CBSymmetricKey.h"
+#import "CBSymmetricKey+Streaming.h"
+#import <fcntl.h>
 
 
 @interface Key_Test : XCTestCase
@@ -45,6 +51,40 @@
     XCTAssertEqualObjects(decrypted, clear);
 }
 
+- (void) testBoxAppend {
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    NSData* cipher = [alice encrypt: clear forRecipient: bob.publicKey];
+    NSMutableData* output = [NSMutableData dataWithBytes: "HDR" length: 3];
+    XCTAssert([bob decrypt: cipher fromSender: alice.publicKey appendTo: output]);
+    XCTAssertEqual(output.length, 3 + clear.length);
+    XCTAssertEqualObjects([output subdataWithRange: NSMakeRange(3, clear.length)], clear);
+    XCTAssertFalse([alice decrypt: cipher fromSender: alice.publicKey appendTo: output]);
+    XCTAssertEqual(output.length, 3 + clear.length);
+}
+
+- (void) testSession {
+    CBEncryptingSession* aliceToBob = [alice sessionWithPeer: bob.publicKey];
+    CBEncryptingSession* bobToAlice = [bob sessionWithPeer: alice.publicKey];
+    XCTAssertEqualObjects(aliceToBob.peer, bob.publicKey);
+    XCTAssertEqualObjects(aliceToBob.publicKey, alice.publicKey);
+
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    CBNonce nonce = {{0x01, 0x02, 0x03}}; // rest all zeroes
+    NSData* cipher = [aliceToBob encrypt: clear withNonce: nonce];
+    // Sessions produce the same ciphertext as the key methods:
+    XCTAssertEqualObjects(cipher, [alice encrypt: clear withNonce: nonce forRecipient: bob.publicKey]);
+    XCTAssertEqualObjects([bobToAlice decrypt: cipher withNonce: nonce], clear);
+
+    cipher = [aliceToBob encrypt: clear];
+    XCTAssertEqualObjects([bobToAlice decrypt: cipher], clear);
+    XCTAssertEqualObjects([bob decrypt: cipher fromSender: alice.publicKey], clear);
+    cipher = [bob encrypt: clear forRecipient: alice.publicKey];
+    XCTAssertEqualObjects([aliceToBob decrypt: cipher], clear);
+
+    CBEncryptingSession* mallory = [[CBEncryptingPrivateKey generate] sessionWithPeer: bob.publicKey];
+    XCTAssertNil([mallory decrypt: cipher]);
+}
+
 - (void) testRecoverPublicKey {
     CBEncryptingPrivateKey* alice2 = [[CBEncryptingPrivateKey alloc] initWithKeyData: alice.keyData];
     XCTAssertEqualObjects(alice2.publicKey.keyData, alice.publicKey.keyData);
@@ -115,6 +155,421 @@
 
     CBEncryptingPrivateKey* stranger = [CBEncryptingPrivateKey generate];
     XCTAssertNil([stranger decryptGroupMessage: cipher fromSender: me.publicKey]);
+
+    // Each recipient's slot is found by its hint, so corrupting the hint makes it unreadable:
+    NSMutableData* corrupted = [cipher mutableCopy];
+    ((uint8_t*)corrupted.mutableBytes)[1 + 24 + 4 + 3 * (4 + 48)] ^= 0x01;
+    XCTAssertNil([groupPrivate[3] decryptGroupMessage: corrupted fromSender: me.publicKey]);
+    XCTAssertEqualObjects([groupPrivate[4] decryptGroupMessage: corrupted fromSender: me.publicKey],
+                          clear);
+
+    // Messages in the legacy format (nonce, count, encrypted session keys, ciphertext) still
+    // decrypt, including one whose nonce happens to begin with the new format byte:
+    for (int formatByte = 0; formatByte < 2; formatByte++) {
+        CBNonce nonce = [CBEncryptingPrivateKey randomNonce];
+        if (formatByte)
+            nonce.bytes[0] = 0xC3;
+        CBSymmetricKey* sessionKey = [CBSymmetricKey generate];
+        NSMutableData* legacy = [NSMutableData dataWithBytes: &nonce length: sizeof(nonce)];
+        uint32_t bigCount = CFSwapInt32HostToBig((uint32_t)n);
+        [legacy appendBytes: &bigCount length: sizeof(bigCount)];
+        for (CBEncryptingPublicKey* recipient in groupPublic)
+            [me encrypt: sessionKey.keyData withNonce: nonce forRecipient: recipient
+               appendTo: legacy];
+        [legacy appendData: [sessionKey encrypt: clear withNonce: nonce]];
+        for (CBEncryptingPrivateKey* member in groupPrivate)
+            XCTAssertEqualObjects([member decryptGroupMessage: legacy fromSender: me.publicKey],
+                                  clear);
+        XCTAssertNil([stranger decryptGroupMessage: legacy fromSender: me.publicKey]);
+    }
+}
+
+- (void) testEncryptionGroup {
+    NSMutableArray* groupPrivate = [NSMutableArray array];
+    NSMutableArray* groupPublic = [NSMutableArray array];
+    for (size_t i=0; i<10; ++i) {
+        CBEncryptingPrivateKey* priv = [CBEncryptingPrivateKey generate];
+        [groupPrivate addObject: priv];
+        [groupPublic addObject: priv.publicKey];
+    }
+    CBEncryptionGroup* group = [[CBEncryptionGroup alloc] initWithPrivateKey: alice
+                                                                     members: groupPublic];
+    XCTAssertEqual(group.count, 10u);
+    XCTAssertEqualObjects(group.members, groupPublic);
+    XCTAssertFalse([group addMember: groupPublic[3]]);
+    XCTAssert([group containsMember: groupPublic[3]]);
+    XCTAssertFalse([group containsMember: bob.publicKey]);
+
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    NSData* cipher = [group encryptMessage: clear];
+    for (CBEncryptingPrivateKey* member in groupPrivate)
+        XCTAssertEqualObjects([member decryptGroupMessage: cipher fromSender: alice.publicKey],
+                              clear);
+    XCTAssertNil([bob decryptGroupMessage: cipher fromSender: alice.publicKey]);
+
+    // Members come and go:
+    XCTAssert([group addMember: bob.publicKey]);
+    XCTAssert([group removeMember: groupPublic[3]]);
+    XCTAssertFalse([group removeMember: groupPublic[3]]);
+    XCTAssertEqual(group.count, 10u);
+    cipher = [group encryptMessage: clear];
+    XCTAssertEqualObjects([bob decryptGroupMessage: cipher fromSender: alice.publicKey], clear);
+    XCTAssertNil([groupPrivate[3] decryptGroupMessage: cipher fromSender: alice.publicKey]);
+    XCTAssertEqualObjects([groupPrivate[4] decryptGroupMessage: cipher fromSender: alice.publicKey],
+                          clear);
+
+    // The receiving side can use a group too, including for messages from non-members:
+    CBEncryptionGroup* bobsGroup = [[CBEncryptionGroup alloc] initWithPrivateKey: bob
+                                                                         members: @[alice.publicKey]];
+    XCTAssertEqualObjects([bobsGroup decryptMessage: cipher fromSender: alice.publicKey], clear);
+    CBEncryptingPrivateKey* carol = [CBEncryptingPrivateKey generate];
+    cipher = [carol encryptGroupMessage: clear forRecipients: @[bob.publicKey]];
+    XCTAssertEqualObjects([bobsGroup decryptMessage: cipher fromSender: carol.publicKey], clear);
+    XCTAssertNil([bobsGroup decryptMessage: cipher fromSender: alice.publicKey]);
+}
+
+- (void) testGroupStreaming {
+    // More recipients than the decoder reads at once:
+    const size_t n = 70;
+    NSMutableArray* groupPrivate = [NSMutableArray array];
+    NSMutableArray* groupPublic = [NSMutableArray array];
+    for (size_t i=0; i<n; ++i) {
+        CBEncryptingPrivateKey* priv = [CBEncryptingPrivateKey generate];
+        [groupPrivate addObject: priv];
+        [groupPublic addObject: priv.publicKey];
+    }
+    CBEncryptingPrivateKey* me = [CBEncryptingPrivateKey generate];
+
+    const size_t sizes[] = {0, 100, 3*kCBStreamChunkSize + 5};
+    for (int s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s) {
+        NSMutableData* clear = [NSMutableData dataWithLength: sizes[s]];
+        SecRandomCopyBytes(kSecRandomDefault, clear.length, clear.mutableBytes);
+        NSOutputStream* output = [NSOutputStream outputStreamToMemory];
+        NSError* error;
+        XCTAssert([me encryptGroupStream: [NSInputStream inputStreamWithData: clear]
+                                toStream: output
+                           forRecipients: groupPublic
+                                   error: &error], @"Encrypt failed: %@", error);
+        NSData* cipher = [output propertyForKey: NSStreamDataWrittenToMemoryStreamKey];
+        XCTAssertEqual(((const uint8_t*)cipher.bytes)[0], 0xC4);
+
+        for (NSUInteger i = 0; i < n; i += 23) {
+            output = [NSOutputStream outputStreamToMemory];
+            XCTAssert([groupPrivate[i] decryptGroupStream: [NSInputStream inputStreamWithData: cipher]
+                                                 toStream: output
+                                               fromSender: me.publicKey
+                                                    error: &error], @"Decrypt failed: %@", error);
+            XCTAssertEqualObjects([output propertyForKey: NSStreamDataWrittenToMemoryStreamKey],
+                                  clear);
+            // It can be decrypted in memory too:
+            XCTAssertEqualObjects([groupPrivate[i] decryptGroupMessage: cipher
+                                                            fromSender: me.publicKey], clear);
+        }
+
+        output = [NSOutputStream outputStreamToMemory];
+        XCTAssertFalse([bob decryptGroupStream: [NSInputStream inputStreamWithData: cipher]
+                                      toStream: output
+                                    fromSender: me.publicKey
+                                         error: &error]);
+        XCTAssertEqual(error.code, kCBKeyErrorDecryptionFailed);
+        XCTAssertNil([bob decryptGroupMessage: cipher fromSender: me.publicKey]);
+    }
+
+    // Corruption in a later chunk is detected when it's reached, after the earlier chunks have
+    // been written:
+    NSMutableData* clear = [NSMutableData dataWithLength: 3*kCBStreamChunkSize];
+    CBEncryptionGroup* group = [[CBEncryptionGroup alloc] initWithPrivateKey: me
+                                                                     members: groupPublic];
+    NSOutputStream* output = [NSOutputStream outputStreamToMemory];
+    NSError* error;
+    XCTAssert([group encryptStream: [NSInputStream inputStreamWithData: clear]
+                          toStream: output error: &error], @"Encrypt failed: %@", error);
+    NSMutableData* corrupted = [[output propertyForKey: NSStreamDataWrittenToMemoryStreamKey]
+                                                                                mutableCopy];
+    ((uint8_t*)corrupted.mutableBytes)[corrupted.length - kCBStreamChunkSize] ^= 0x10;
+    output = [NSOutputStream outputStreamToMemory];
+    CBEncryptionGroup* receiver = [[CBEncryptionGroup alloc] initWithPrivateKey: groupPrivate[5]
+                                                                        members: @[me.publicKey]];
+    XCTAssertFalse([receiver decryptStream: [NSInputStream inputStreamWithData: corrupted]
+                                  toStream: output
+                                fromSender: me.publicKey
+                                     error: &error]);
+    XCTAssertEqual(error.code, kCBKeyErrorDecryptionFailed);
+    XCTAssertEqual([[output propertyForKey: NSStreamDataWrittenToMemoryStreamKey] length],
+                   2*kCBStreamChunkSize);
+
+    // Truncating the header:
+    output = [NSOutputStream outputStreamToMemory];
+    NSData* truncated = [corrupted subdataWithRange: NSMakeRange(0, 1 + 24 + 4 + 10 * (4 + 48))];
+    XCTAssertFalse([groupPrivate[5] decryptGroupStream: [NSInputStream inputStreamWithData: truncated]
+                                              toStream: output
+                                            fromSender: me.publicKey
+                                                 error: &error]);
+    XCTAssertEqual(error.code, kCBKeyErrorTruncated);
+
+    // A recipient without a valid key fails the stream before anything is written:
+    output = [NSOutputStream outputStreamToMemory];
+    NSInputStream* input = [NSInputStream inputStreamWithData: clear];
+    XCTAssertFalse(CBEncryptGroupStream(CBReaderForStream(input), CBWriterForStream(output), 2,
+                                        ^CBEncryptingSession*(NSUInteger i) {
+                                            return i ? nil : [me sessionWithPeer: bob.publicKey];
+                                        }, &error));
+    XCTAssertEqual(error.code, kCBKeyErrorInvalidKey);
+    XCTAssertEqual([[output propertyForKey: NSStreamDataWrittenToMemoryStreamKey] length], 0u);
+}
+
+- (void) testAddGroupRecipients {
+    NSMutableArray* groupPrivate = [NSMutableArray array];
+    NSMutableArray* groupPublic = [NSMutableArray array];
+    for (size_t i=0; i<5; ++i) {
+        CBEncryptingPrivateKey* priv = [CBEncryptingPrivateKey generate];
+        [groupPrivate addObject: priv];
+        [groupPublic addObject: priv.publicKey];
+    }
+    CBEncryptingPrivateKey* carol = [CBEncryptingPrivateKey generate];
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    NSData* cipher = [alice encryptGroupMessage: clear forRecipients: groupPublic];
+    XCTAssertNil([carol decryptGroupMessage: cipher fromSender: alice.publicKey]);
+
+    // Add Carol (twice), and an existing recipient who should be skipped:
+    NSError* error;
+    NSData* newCipher = [alice addRecipients: @[carol.publicKey, groupPublic[2], carol.publicKey]
+                              toGroupMessage: cipher
+                              knownRecipient: groupPublic[4]
+                                       error: &error];
+    XCTAssertNotNil(newCipher, @"Failed: %@", error);
+    const size_t headerLen = 1 + 24 + 4 + 5 * (4 + 48);
+    XCTAssertEqual(newCipher.length, cipher.length + 4 + 48);
+    // The body is untouched:
+    XCTAssertEqualObjects([newCipher subdataWithRange: NSMakeRange(headerLen + 4 + 48,
+                                                                   cipher.length - headerLen)],
+                          [cipher subdataWithRange: NSMakeRange(headerLen,
+                                                                cipher.length - headerLen)]);
+    XCTAssertEqualObjects([carol decryptGroupMessage: newCipher fromSender: alice.publicKey], clear);
+    for (CBEncryptingPrivateKey* member in groupPrivate)
+        XCTAssertEqualObjects([member decryptGroupMessage: newCipher fromSender: alice.publicKey],
+                              clear);
+
+    // Only the sender can add recipients, and it has to know one of them:
+    XCTAssertNil([alice addRecipients: @[bob.publicKey] toGroupMessage: cipher
+                       knownRecipient: carol.publicKey error: &error]);
+    XCTAssertEqual(error.code, kCBKeyErrorDecryptionFailed);
+    XCTAssertNil([bob addRecipients: @[bob.publicKey] toGroupMessage: cipher
+                     knownRecipient: groupPublic[0] error: &error]);
+
+    // Now a streamed message in a file:
+    NSMutableData* bigClear = [NSMutableData dataWithLength: 3*kCBStreamChunkSize + 5];
+    SecRandomCopyBytes(kSecRandomDefault, bigClear.length, bigClear.mutableBytes);
+    NSString* dir = NSTemporaryDirectory();
+    NSString* clearPath = [dir stringByAppendingPathComponent: @"group_clear"];
+    NSString* cipherPath = [dir stringByAppendingPathComponent: @"group_cipher"];
+    NSString* newCipherPath = [dir stringByAppendingPathComponent: @"group_cipher2"];
+    XCTAssert([bigClear writeToFile: clearPath atomically: NO]);
+    int inFD = open(clearPath.fileSystemRepresentation, O_RDONLY);
+    int outFD = open(cipherPath.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    XCTAssert([alice encryptGroupFileDescriptor: inFD toFileDescriptor: outFD
+                                  forRecipients: groupPublic error: &error]);
+    close(inFD);
+    close(outFD);
+    inFD = open(cipherPath.fileSystemRepresentation, O_RDONLY);
+    outFD = open(newCipherPath.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    XCTAssert([alice addRecipients: @[carol.publicKey]
+      toGroupMessageFileDescriptor: inFD
+                  toFileDescriptor: outFD
+                    knownRecipient: groupPublic[0]
+                             error: &error], @"Failed: %@", error);
+    close(inFD);
+    close(outFD);
+    newCipher = [NSData dataWithContentsOfFile: newCipherPath];
+    XCTAssertEqual(newCipher.length,
+                   [NSData dataWithContentsOfFile: cipherPath].length + 4 + 48);
+    XCTAssertEqualObjects([carol decryptGroupMessage: newCipher fromSender: alice.publicKey],
+                          bigClear);
+    XCTAssertEqualObjects([groupPrivate[3] decryptGroupMessage: newCipher
+                                                    fromSender: alice.publicKey], bigClear);
+
+    // A bogus recipient count is caught when the slots run out, without allocating for it:
+    NSMutableData* bogus = [[newCipher subdataWithRange: NSMakeRange(0, 1000)] mutableCopy];
+    uint32_t bigCount = CFSwapInt32HostToBig(UINT32_MAX);
+    [bogus replaceBytesInRange: NSMakeRange(1 + sizeof(CBNonce), 4) withBytes: &bigCount];
+    XCTAssert([bogus writeToFile: cipherPath atomically: NO]);
+    inFD = open(cipherPath.fileSystemRepresentation, O_RDONLY);
+    outFD = open(newCipherPath.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    XCTAssertFalse([alice addRecipients: @[carol.publicKey]
+           toGroupMessageFileDescriptor: inFD
+                       toFileDescriptor: outFD
+                         knownRecipient: groupPublic[0]
+                                  error: &error]);
+    XCTAssertEqual(error.code, kCBKeyErrorTruncated);
+    close(inFD);
+    close(outFD);
+    for (NSString* path in @[clearPath, cipherPath, newCipherPath])
+        [[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+}
+
+static NSArray* generateRecipients(NSUInteger n) {
+    NSMutableArray* recipients = [NSMutableArray arrayWithCapacity: n];
+    for (NSUInteger i=0; i<n; ++i)
+        [recipients addObject: [CBEncryptingPrivateKey generate].publicKey];
+    return recipients;
+}
+
+- (void) testGroupKeyTree {
+    CBSigningPrivateKey* manager = [CBSigningPrivateKey generate];
+    CBGroupKeyTree* tree = [[CBGroupKeyTree alloc] initWithSigningKey: manager];
+    XCTAssertNil(tree.groupKey);
+    NSMutableArray* members = [NSMutableArray array];
+    NSMutableArray* rings = [NSMutableArray array];
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+
+    // Delivers a rekey message to every current member, and checks they all have the group key:
+    void (^deliver)(NSData*) = ^(NSData* message) {
+        XCTAssertNotNil(message);
+        NSData* cipher = [tree encrypt: clear];
+        for (CBGroupKeyRing* ring in rings) {
+            NSError* error;
+            XCTAssert([ring processRekeyMessage: message error: &error], @"Failed: %@", error);
+            XCTAssertEqual(ring.epoch, tree.epoch);
+            XCTAssertEqualObjects(ring.groupKey.keyData, tree.groupKey.keyData);
+            XCTAssertEqualObjects([ring decrypt: cipher], clear);
+        }
+    };
+
+    for (int i = 0; i < 20; i++) {
+        CBEncryptingPrivateKey* member = [CBEncryptingPrivateKey generate];
+        [members addObject: member];
+        [rings addObject: [[CBGroupKeyRing alloc] initWithPrivateKey: member
+                                                             manager: tree.publicKey]];
+        deliver([tree addMember: member.publicKey]);
+    }
+    XCTAssertEqual(tree.count, 20u);
+    XCTAssertNil([tree addMember: [members[0] publicKey]]);
+
+    // Remove a member; it can't follow the rekey, or read anything after it:
+    CBGroupKeyRing* removedRing = rings[7];
+    CBEncryptingPrivateKey* removedMember = members[7];
+    CBSymmetricKey* oldGroupKey = tree.groupKey;
+    [rings removeObjectAtIndex: 7];
+    [members removeObjectAtIndex: 7];
+    NSData* message = [tree removeMember: removedMember.publicKey];
+    deliver(message);
+    XCTAssertNotEqualObjects(tree.groupKey.keyData, oldGroupKey.keyData);
+    NSError* error;
+    XCTAssertFalse([removedRing processRekeyMessage: message error: &error]);
+    XCTAssertEqual(error.code, kCBKeyErrorDecryptionFailed);
+    XCTAssertNil(removedRing.groupKey);
+    XCTAssertNil([removedRing decrypt: [tree encrypt: clear]]);
+    XCTAssertNil([tree removeMember: removedMember.publicKey]);
+
+    // Replaying an old message fails:
+    XCTAssertFalse([rings[0] processRekeyMessage: message error: &error]);
+
+    // So does a message that's been tampered with, or signed by anyone but the manager:
+    CBGroupKeyTree* forger = [[CBGroupKeyTree alloc] initWithSigningKey:
+                                                            [CBSigningPrivateKey generate]];
+    for (int i = 0; i < 30; i++)
+        [forger addMember: [CBEncryptingPrivateKey generate].publicKey];
+    NSData* forged = [forger addMember: [members[0] publicKey]];
+    XCTAssertFalse([rings[0] processRekeyMessage: forged error: &error]);
+    XCTAssertEqual(error.code, kCBKeyErrorDecryptionFailed);
+    message = [tree removeMember: [members[1] publicKey]];
+    NSMutableData* tampered = [message mutableCopy];
+    ((uint8_t*)tampered.mutableBytes)[20] ^= 0x01;
+    XCTAssertFalse([rings[0] processRekeyMessage: tampered error: &error]);
+    XCTAssertEqual(error.code, kCBKeyErrorDecryptionFailed);
+    XCTAssertNotNil(rings[0].groupKey);
+    [members removeObjectAtIndex: 1];
+    [rings removeObjectAtIndex: 1];
+    deliver(message);
+
+    // A removed member can rejoin:
+    [rings addObject: removedRing];
+    [members addObject: removedMember];
+    deliver([tree addMember: removedMember.publicKey]);
+
+    // Remove everyone:
+    while (members.count > 0) {
+        NSUInteger i = members.count / 2;
+        CBEncryptingPublicKey* member = [members[i] publicKey];
+        [members removeObjectAtIndex: i];
+        [rings removeObjectAtIndex: i];
+        deliver([tree removeMember: member]);
+    }
+    XCTAssertEqual(tree.count, 0u);
+    XCTAssertNil(tree.groupKey);
+}
+
+- (void) testGroupKeyTreeScaling {
+    // Rekey messages grow with the log of the number of members:
+    CBGroupKeyTree* tree = [[CBGroupKeyTree alloc] initWithSigningKey:
+                                                            [CBSigningPrivateKey generate]];
+    NSArray* members = generateRecipients(1000);
+    size_t maxAddLength = 0;
+    for (CBEncryptingPublicKey* member in members)
+        maxAddLength = MAX(maxAddLength, [tree addMember: member].length);
+    const size_t kHeaderAndWelcome = 10 + 76 + 4, kEntry = 4 + 4 + 73, kSignature = 64;
+    XCTAssertLessThanOrEqual(maxAddLength, kHeaderAndWelcome + 2 * 10 * kEntry + kSignature);
+    for (NSUInteger i = 0; i < members.count; i += 7) {
+        NSData* message = [tree removeMember: members[i]];
+        XCTAssertLessThanOrEqual(message.length, 10 + 4 + 2 * 10 * kEntry + kSignature);
+    }
+    XCTAssertEqual(tree.count, 1000u - 143u);
+}
+
+- (void) testParallelGroupEncryption {
+    // Encrypting in parallel has to produce exactly the same bytes as doing it sequentially:
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    CBNonce nonce = [CBEncryptingPrivateKey randomNonce];
+    CBSymmetricKey* sessionKey = [CBSymmetricKey generate];
+    for (NSUInteger n = 0; n <= 100; n += 33) {
+        NSArray* recipients = generateRecipients(n);
+        NSData* sequential = [alice encryptGroupMessage: clear forRecipients: recipients
+                                              withNonce: nonce sessionKey: sessionKey
+                                               parallel: NO];
+        NSData* parallel = [alice encryptGroupMessage: clear forRecipients: recipients
+                                            withNonce: nonce sessionKey: sessionKey
+                                             parallel: YES];
+        XCTAssertEqualObjects(parallel, sequential);
+        XCTAssertNil([bob decryptGroupMessage: parallel fromSender: alice.publicKey]);
+    }
+
+    // A recipient without a session fails the whole message, instead of leaving a bad slot:
+    NSArray* recipients = generateRecipients(40);
+    CBEncryptingSession* (^sessionAtIndex)(NSUInteger) = ^CBEncryptingSession*(NSUInteger i) {
+        return (i == 20) ? nil : [alice sessionWithPeer: recipients[i]];
+    };
+    XCTAssertNil(CBEncryptGroupMessage(clear, recipients.count, sessionAtIndex,
+                                       nonce, sessionKey, YES));
+}
+
+- (void) testGroupEncryptionPerformance {
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    NSArray* recipients = generateRecipients(1000);
+    [self measureBlock: ^{
+        [alice encryptGroupMessage: clear forRecipients: recipients];
+    }];
+}
+
+- (void) testSequentialGroupEncryptionPerformance {
+    // Compare with testGroupEncryptionPerformance, which uses all the CPU cores.
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    NSArray* recipients = generateRecipients(1000);
+    CBNonce nonce = [CBEncryptingPrivateKey randomNonce];
+    CBSymmetricKey* sessionKey = [CBSymmetricKey generate];
+    [self measureBlock: ^{
+        [alice encryptGroupMessage: clear forRecipients: recipients
+                         withNonce: nonce sessionKey: sessionKey parallel: NO];
+    }];
+}
+
+- (void) testEncryptionGroupPerformance {
+    // Compare with testGroupEncryptionPerformance: no key agreement per message.
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    CBEncryptionGroup* group = [[CBEncryptionGroup alloc] initWithPrivateKey: alice
+                                                                     members: generateRecipients(1000)];
+    [self measureBlock: ^{
+        [group encryptMessage: clear];
+    }];
 }
 
 #if !TARGET_OS_IPHONE
@@ -10,6 +10,8 @@
 #import <XCTest/XCTest.h>
 #import "CBSigningPrivateKey.h"
 #import "CBEncryptingPrivateKey.h"
+#import <CommonCrypto/CommonDigest.h>
+#import <fcntl.h>
 
 
 @interface CBPrivateKey ()
@@ -52,6 +54,94 @@
     XCTAssert([pubKey verifySignature: signature ofData: message]);
 }
 
+- (void) testBatchVerify {
+    const NSUInteger n = 500;
+    CBSignature* signatures = malloc(n * sizeof(CBSignature));
+    NSMutableArray *inputs = [NSMutableArray array], *keys = [NSMutableArray array];
+    for (NSUInteger i = 0; i < n; i++) {
+        CBSigningPrivateKey* key = (i % 2) ? alice : bob;
+        NSData* message = [[NSString stringWithFormat: @"Message #%lu", (unsigned long)i]
+                                                    dataUsingEncoding: NSUTF8StringEncoding];
+        signatures[i] = [key signData: message];
+        [inputs addObject: message];
+        [keys addObject: key.publicKey];
+    }
+    uint8_t results[(n + 7) / 8];
+    XCTAssert([CBVerifyingPublicKey verifySignatures: signatures ofData: inputs withKeys: keys
+                                             results: results]);
+    for (NSUInteger i = 0; i < n; i++)
+        XCTAssert(results[i / 8] & (1 << (i % 8)));
+    XCTAssert([CBVerifyingPublicKey verifySignatures: signatures ofData: inputs withKeys: keys
+                                             results: NULL]);
+
+    // Break a few items: corrupt a signature, swap a key, change a message:
+    signatures[3].bytes[10] ^= 0x40;
+    keys[100] = alice.publicKey;
+    inputs[499] = [@"forged" dataUsingEncoding: NSUTF8StringEncoding];
+    XCTAssertFalse([CBVerifyingPublicKey verifySignatures: signatures ofData: inputs withKeys: keys
+                                                  results: results]);
+    for (NSUInteger i = 0; i < n; i++) {
+        BOOL valid = (results[i / 8] & (1 << (i % 8))) != 0;
+        XCTAssertEqual(valid, (BOOL)(i != 3 && i != 100 && i != 499), @"item %lu", (unsigned long)i);
+    }
+    free(signatures);
+}
+
+- (void) testPrehashSignatures {
+    // A message too big to want in memory at once, fed in uneven chunks:
+    NSMutableData* chunk = [NSMutableData dataWithLength: 100000];
+    SecRandomCopyBytes(kSecRandomDefault, chunk.length, chunk.mutableBytes);
+    CBSignaturePrehash* prehash = [[CBSignaturePrehash alloc] init];
+    for (int i = 0; i < 100; i++)
+        [prehash updateWithBytes: chunk.bytes length: chunk.length - i];
+    CBSignature signature = [alice signPrehash: prehash];
+
+    // Verify it, hashing the same message differently, from a file:
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"prehash_test"];
+    [[NSFileManager defaultManager] createFileAtPath: path contents: nil attributes: nil];
+    NSFileHandle* file = [NSFileHandle fileHandleForWritingAtPath: path];
+    for (int i = 0; i < 100; i++)
+        [file writeData: [chunk subdataWithRange: NSMakeRange(0, chunk.length - i)]];
+    [file closeFile];
+    int fd = open(path.fileSystemRepresentation, O_RDONLY);
+    XCTAssert(fd >= 0);
+    CBSignaturePrehash* verifyPrehash = [[CBSignaturePrehash alloc] init];
+    XCTAssert([verifyPrehash updateWithFileDescriptor: fd error: NULL]);
+    close(fd);
+    [[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+    XCTAssert([alice.prehashPublicKey verifySignature: signature ofPrehash: verifyPrehash]);
+    XCTAssertFalse([bob.prehashPublicKey verifySignature: signature ofPrehash: verifyPrehash]);
+    XCTAssertFalse([alice.publicKey verifySignature: signature ofPrehash: verifyPrehash]);
+    XCTAssertThrows([verifyPrehash updateWithData: chunk]);
+
+    // A different message doesn't verify:
+    CBSignaturePrehash* otherPrehash = [[CBSignaturePrehash alloc] init];
+    [otherPrehash updateWithData: chunk];
+    XCTAssertFalse([alice.prehashPublicKey verifySignature: signature ofPrehash: otherPrehash]);
+
+    // Prehashed and plain signatures of the same message aren't interchangeable:
+    NSData* message = [@"short message" dataUsingEncoding: NSUTF8StringEncoding];
+    CBSignaturePrehash* messagePrehash = [[CBSignaturePrehash alloc] init];
+    [messagePrehash updateWithData: message];
+    CBSignature plain = [alice signData: message];
+    CBSignature prehashed = [alice signPrehash: messagePrehash];
+    XCTAssertFalse([alice.publicKey verifySignature: prehashed ofData: message]);
+    XCTAssertFalse([alice.prehashPublicKey verifySignature: plain ofPrehash: messagePrehash]);
+    XCTAssert([alice.prehashPublicKey verifySignature: prehashed ofPrehash: messagePrehash]);
+
+    // ...not even when the plain signature is of the tagged digest a prehashed signature signs,
+    // which is still ordinary data to -signData:
+    uint8_t digest[CC_SHA512_DIGEST_LENGTH];
+    CC_SHA512(message.bytes, (CC_LONG)message.length, digest);
+    NSMutableData* tagged = [[@"SeekritEd25519ph" dataUsingEncoding: NSUTF8StringEncoding]
+                                                                                mutableCopy];
+    [tagged appendBytes: digest length: sizeof(digest)];
+    CBSignature taggedPlain = [alice signData: tagged];
+    XCTAssert([alice.publicKey verifySignature: taggedPlain ofData: tagged]);
+    XCTAssertFalse([alice.prehashPublicKey verifySignature: taggedPlain ofPrehash: messagePrehash]);
+    XCTAssertFalse([alice.publicKey verifySignature: prehashed ofData: tagged]);
+}
+
 - (void) testEncryptingConversion {
     CBEncryptingPrivateKey* aliceEncrypt = alice.asEncryptingKey;
     CBEncryptingPublicKey* alicePublicEncrypt = alice.publicKey.asEncryptingPublicKey;
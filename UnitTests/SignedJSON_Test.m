@@ -11,6 +11,9 @@
 #import "CBSigningPrivateKey.h"
 #import "CBSignedJSON.h"
 #import "CBCanonicalJSON.h"
+#import "CBJSONMerkleTree.h"
+#import "CBSignatureCache.h"
+#import "CBISO8601.h"
 
 
 static NSString* jsonString(id obj) {
@@ -21,6 +24,42 @@ static NSString* jsonString(id obj) {
 }
 
 
+// Doubles and their canonical (version 2) forms. These were checked against an independent
+// shortest-round-trip implementation, so any platform must produce exactly the same strings.
+static const struct {
+    double value;
+    const char* expected;
+} kDoubleCorpus[] = {
+    {0x1.999999999999ap-4, "0.1"},
+    {0x1.3333333333334p-2, "0.30000000000000004"},
+    {0x1.5555555555555p-2, "0.3333333333333333"},
+    {-0x1.47ae147ae147bp-9, "-0.0025"},
+    {0x1.8000000000000p+0, "1.5"},
+    {0x1.9000000000000p+6, "100"},
+    {0x1.b1ae4d6e2ef50p+69, "1e+21"},
+    {0x1.5af1d78b58c40p+66, "100000000000000000000"},
+    {0x1.ac53a7e04bcdap+66, "123456789012345680000"},
+    {0x1.0c6f7a0b5ed8dp-20, "0.000001"},
+    {0x1.ad7f29abcaf48p-24, "1e-7"},
+    {0x1.091b5aeffdb8ep-23, "1.2345e-7"},
+    {0x0.0000000000001p-1022, "5e-324"},
+    {0x1.0000000000000p-1022, "2.2250738585072014e-308"},
+    {0x1.fffffffffffffp+1023, "1.7976931348623157e+308"},
+    {0x1.0000000000000p-1017, "7.120236347223045e-307"},
+    {0x0.0000000000003p-1022, "1.5e-323"},
+    {0x1.1666666666666p+2, "4.35"},
+    {0x1.0000000000000p+53, "9007199254740992"},
+    {0x1.9999999999999p-1, "0.7999999999999999"},
+    {0x1.0000000000000p+63, "9223372036854776000"},
+    {-0x1.4b66dc01ec6fbp-20, "-0.0000012345678901234567"},
+    {0x1.921fb54442d18p+1, "3.141592653589793"},
+    {0x1.52d02c7e14af6p+76, "1e+23"},
+    {0x1.c7e83209e90b2p+72, "8.41e+21"},
+    {0x0.05c0ab9347ed7p-1022, "5e-310"},
+    {0x1.99999a0000000p-4, "0.10000000149011612"},
+};
+
+
 @interface SignedJSON_Test : XCTestCase
 @end
 
@@ -40,6 +79,7 @@ static NSString* jsonString(id obj) {
     XCTAssert(signature);
     NSLog(@"Signature = %@", jsonString(signature));
 
+    XCTAssertNil(signature[@"canonical"]);     // version 1, for older readers
     XCTAssert([privateKey.publicKey verifySignature: signature ofJSON: json error: NULL]);
     XCTAssertEqualObjects([CBVerifyingPublicKey signerOfSignature: signature ofJSON: json error: NULL],
                           privateKey.publicKey);
@@ -65,4 +105,442 @@ static NSString* jsonString(id obj) {
     XCTAssertNotNil([CBVerifyingPublicKey signatureOfJSON: signedJSON]);
 }
 
+- (void)testCanonicalJSON {
+    NSDictionary* json = @{@"foo": @1234, @"bar": @[@"hi", @"th\"ere", @YES, [NSNull null]],
+                           @"_rev": @"1-xxx", @"_id": @"doc", @"(signed)": @{},
+                           @"n": @{@"_x": @-5, @"Z": @(UINT64_MAX), @"d": @0.5},
+                           @"café": @"über \U0001F600"};
+    XCTAssertEqualObjects([CBCanonicalJSON canonicalString: json],
+                          @"{\"_id\":\"doc\",\"bar\":[\"hi\",\"th\\\"ere\",true,null],"
+                           "\"café\":\"über \U0001F600\",\"foo\":1234,"
+                           "\"n\":{\"Z\":18446744073709551615,\"_x\":-5,\"d\":0.5}}");
+
+    // Long strings, with multi-byte characters and quotes, straddling the output buffer size:
+    NSMutableString* str = [NSMutableString string];
+    for (int i = 0; i < 1000; i++)
+        [str appendFormat: @"%dé\"\U0001F600", i];
+    NSArray* big = @[str, @{@"k": str}, str];
+    NSString* quoted = [NSString stringWithFormat: @"\"%@\"",
+                        [str stringByReplacingOccurrencesOfString: @"\"" withString: @"\\\""]];
+    NSString* expected = [NSString stringWithFormat: @"[%@,{\"k\":%@},%@]", quoted, quoted, quoted];
+    NSData* data = [CBCanonicalJSON canonicalData: big];
+    XCTAssertEqualObjects(data, [expected dataUsingEncoding: NSUTF8StringEncoding]);
+
+    NSMutableData* streamed = [NSMutableData data];
+    __block unsigned chunks = 0;
+    CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithObject: big];
+    XCTAssert([encoder writeTo: ^(const void* bytes, size_t length) {
+        [streamed appendBytes: bytes length: length];
+        ++chunks;
+    }]);
+    XCTAssertEqualObjects(streamed, data);
+    XCTAssertGreaterThan(chunks, 1u);
+
+    // Unpaired surrogates can't be encoded as UTF-8:
+    unichar bad[2] = {'x', 0xD800};
+    XCTAssertNil([CBCanonicalJSON canonicalData: @[[NSString stringWithCharacters: bad length: 2]]]);
+    // ...so they can't be signed either:
+    NSDictionary* badDict = @{@"x": [NSString stringWithCharacters: bad length: 2]};
+    XCTAssertNil([privateKey signatureOfJSON: badDict expiresAfter: 0]);
+    XCTAssertNil([privateKey signatureOfJSON: badDict digestType: kCBSignedJSONDigestBLAKE2b
+                                expiresAfter: 0]);
+    XCTAssertNil([privateKey addSignatureToJSON: badDict expiresAfter: 0]);
+}
+
+- (void)testCanonicalJSONData {
+    // The raw-data encoder must produce the same output as the object encoder:
+    NSArray* inputs = @[
+        @"{\"foo\": 1234, \"bar\": [\"hi\", \"th\\\"ere\", true, false, null]}",
+        @"{\"_id\":\"doc\", \"_rev\":\"1-abc\", \"(signed)\":{\"x\":1}, \"n\":{\"_x\":-5}}",
+        @"{\"esc\": \"\\\\ \\/ \\b\\f\\n\\r\\t \\u00e9 \\ud83d\\ude00 \\u0022\"}",
+        @"{\"\\uff21\": 1, \"\\ud83d\\ude00\": 2, \"z\": 3, \"\\u00e9\": 4, \"A\": 5, \"\": 6}",
+        @"[1, 0, -7, 0.5, 1e3, -2.5E-3, 9223372036854775807, -9223372036854775808]",
+        @" [ { \"b\" : { \"d\" : [ ] , \"c\" : { } } , \"a\" : \"\" } ] ",
+    ];
+    for (NSString* input in inputs) {
+        NSData* data = [input dataUsingEncoding: NSUTF8StringEncoding];
+        id object = [NSJSONSerialization JSONObjectWithData: data options: 0 error: NULL];
+        XCTAssertNotNil(object);
+        for (CBCanonicalJSONVersion version = kCBCanonicalJSONVersion1;
+                version <= kCBCanonicalJSONVersion2; version++) {
+            CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithObject: object];
+            encoder.version = version;
+            CBCanonicalJSON* rawEncoder = [[CBCanonicalJSON alloc] initWithJSONData: data];
+            rawEncoder.version = version;
+            XCTAssertEqualObjects(rawEncoder.canonicalString, encoder.canonicalString);
+        }
+    }
+
+    NSData* data = [@"{\"a\":1, \"(signed)\": {\"sig\": \"xyz\"}, \"_rev\": 2}"
+                    dataUsingEncoding: NSUTF8StringEncoding];
+    CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithJSONData: data];
+    XCTAssertEqualObjects(encoder.canonicalString, @"{\"a\":1}");
+    XCTAssertEqualObjects([encoder ignoredTopLevelValue: @"(signed)"], @{@"sig": @"xyz"});
+    XCTAssertEqualObjects([encoder ignoredTopLevelValue: @"_rev"], @2);
+    XCTAssertNil([encoder ignoredTopLevelValue: @"a"]);
+
+    for (NSString* bad in @[@"", @"{", @"{\"a\":}", @"[1,]", @"{\"a\" 1}", @"[1] x", @"tru",
+                            @"\"\\ud800\"", @"[01]", @"\"\\q\"",
+                            // Ignored top-level values have to be valid too:
+                            @"{\"_rev\":[1,]}", @"{\"_x\":{\"a\" 1}}", @"{\"_x\":\"\\q\"}",
+                            @"{\"_x\":01}", @"{\"_x\":tru}", @"{\"_x\":[}"]) {
+        NSData* badData = [bad dataUsingEncoding: NSUTF8StringEncoding];
+        XCTAssertNil([[CBCanonicalJSON alloc] initWithJSONData: badData].canonicalData, @"%@", bad);
+    }
+}
+
+- (void)testSignedJSONData {
+    NSDictionary* json = @{@"foo": @1234, @"bar": @[@"hi", @"th\"ere", @"a\\b\n"], @"_id": @"doc"};
+    NSDictionary* signedJSON = [privateKey addSignatureToJSON: json expiresAfter: 60*60];
+    NSData* data = [NSJSONSerialization dataWithJSONObject: signedJSON options: 0 error: NULL];
+
+    XCTAssert([privateKey.publicKey verifySignedJSONData: data error: NULL]);
+    XCTAssertEqualObjects([CBVerifyingPublicKey signerOfJSONData: data error: NULL],
+                          privateKey.publicKey);
+
+    NSError* error;
+    NSMutableDictionary* tampered = [signedJSON mutableCopy];
+    tampered[@"foo"] = @1235;
+    data = [NSJSONSerialization dataWithJSONObject: tampered options: 0 error: NULL];
+    XCTAssertNil([CBVerifyingPublicKey signerOfJSONData: data error: &error]);
+    XCTAssertEqual(error.code, kCBSignedJSONErrorIncorrectDigest);
+
+    data = [NSJSONSerialization dataWithJSONObject: json options: 0 error: NULL];
+    XCTAssertNil([CBVerifyingPublicKey signerOfJSONData: data error: &error]);
+    XCTAssertEqual(error.code, kCBSignedJSONErrorUnsigned);
+
+    data = [@"{\"foo\":" dataUsingEncoding: NSUTF8StringEncoding];
+    XCTAssertNil([CBVerifyingPublicKey signerOfJSONData: data error: &error]);
+    XCTAssertEqual(error.code, kCBSignedJSONErrorInvalidJSON);
+
+    // Malformed JSON inside the signature is caught even though it isn't canonicalized:
+    data = [@"{\"foo\":1,\"(signed)\":{\"sig\":\"x\",\"bad\":[1 2]}}"
+                dataUsingEncoding: NSUTF8StringEncoding];
+    XCTAssertNil([CBVerifyingPublicKey signerOfJSONData: data error: &error]);
+    XCTAssertEqual(error.code, kCBSignedJSONErrorInvalidJSON);
+}
+
+- (void)testCanonicalJSONEscaping {
+    NSArray* json = @[@"q\"b\\s\n\t\x01\x1f/\x7fé"];
+    CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithObject: json];
+    XCTAssertEqualObjects(encoder.canonicalString, @"[\"q\\\"b\\s\n\t\x01\x1f/\x7fé\"]");
+    encoder.version = kCBCanonicalJSONVersion2;
+    NSString* v2 = encoder.canonicalString;
+    XCTAssertEqualObjects(v2, @"[\"q\\\"b\\\\s\\n\\t\\u0001\\u001f/\x7fé\"]");
+    XCTAssertEqualObjects([NSJSONSerialization JSONObjectWithData: encoder.canonicalData
+                                                          options: 0 error: NULL], json);
+
+    // Put an escapable character at every position around the SIMD block boundaries:
+    for (NSUInteger length = 1; length <= 40; length++) {
+        for (NSUInteger i = 0; i < length; i++) {
+            NSMutableString* str = [@"" stringByPaddingToLength: length withString: @"x"
+                                                startingAtIndex: 0].mutableCopy;
+            [str replaceCharactersInRange: NSMakeRange(i, 1) withString: @"\n"];
+            encoder = [[CBCanonicalJSON alloc] initWithObject: str];
+            encoder.version = kCBCanonicalJSONVersion2;
+            NSString* expected = [str stringByReplacingOccurrencesOfString: @"\n"
+                                                                withString: @"\\n"];
+            expected = [NSString stringWithFormat: @"\"%@\"", expected];
+            XCTAssertEqualObjects(encoder.canonicalString, expected);
+        }
+    }
+}
+
+- (void)testCanonicalNumbers {
+    for (size_t i = 0; i < sizeof(kDoubleCorpus) / sizeof(kDoubleCorpus[0]); i++) {
+        NSString* expected = [NSString stringWithFormat: @"[%s]", kDoubleCorpus[i].expected];
+        CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc]
+                                        initWithObject: @[@(kDoubleCorpus[i].value)]];
+        encoder.version = kCBCanonicalJSONVersion2;
+        XCTAssertEqualObjects(encoder.canonicalString, expected);
+
+        // The same value written as JSON, in a different way, must canonicalize the same:
+        NSString* json = [NSString stringWithFormat: @"[%.17g]", kDoubleCorpus[i].value];
+        encoder = [[CBCanonicalJSON alloc]
+                                initWithJSONData: [json dataUsingEncoding: NSUTF8StringEncoding]];
+        encoder.version = kCBCanonicalJSONVersion2;
+        XCTAssertEqualObjects(encoder.canonicalString, expected, @"for %@", json);
+    }
+
+    CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithObject:
+                                    @[@0, @-1, @(INT64_MIN), @(UINT64_MAX), @-0.0, @2.0f, @YES]];
+    encoder.version = kCBCanonicalJSONVersion2;
+    XCTAssertEqualObjects(encoder.canonicalString,
+                          @"[0,-1,-9223372036854775808,18446744073709551615,0,2,true]");
+
+    encoder = [[CBCanonicalJSON alloc] initWithObject: @[@(INFINITY)]];
+    encoder.version = kCBCanonicalJSONVersion2;
+    XCTAssertNil(encoder.canonicalData);
+}
+
+- (void)testCanonicalJSONKeyOrder {
+    // Lots of keys with long common prefixes, non-ASCII and non-BMP characters, and some that
+    // are prefixes of others:
+    NSArray* pieces = @[@"", @"a", @"b", @"é", @"Ａ", @"\U0001F600", @"doc-0000", @"doc-0001"];
+    NSMutableDictionary* dict = [NSMutableDictionary dictionary];
+    for (int i = 0; i < 3000; i++) {
+        NSString* key = [NSString stringWithFormat: @"%@%@%d%@", pieces[i % pieces.count],
+                         pieces[(i / 8) % pieces.count], i % 500, pieces[(i / 64) % pieces.count]];
+        dict[key] = @(i);
+    }
+    dict[@"_id"] = @"x";
+    dict[@"_rev"] = @"y";
+    dict[@"(signed)"] = @"z";
+
+    NSArray* keys = [dict.allKeys sortedArrayUsingComparator: ^NSComparisonResult(id a, id b) {
+        return [a compare: b options: NSLiteralSearch];
+    }];
+    NSMutableString* expected = [NSMutableString stringWithString: @"{"];
+    for (NSString* key in keys) {
+        if ([key isEqualToString: @"_rev"] || [key isEqualToString: @"(signed)"])
+            continue;
+        if (expected.length > 1)
+            [expected appendString: @","];
+        id value = dict[key];
+        [expected appendFormat: ([value isKindOfClass: [NSString class]] ? @"\"%@\":\"%@\""
+                                                                         : @"\"%@\":%@"),
+                                key, value];
+    }
+    [expected appendString: @"}"];
+    XCTAssertEqualObjects([CBCanonicalJSON canonicalString: dict], expected);
+
+    // Custom ignore rules, including a non-ASCII prefix. (U+01E9 shares its low byte with the
+    // prefix's first character, U+00E9, so it passes the first-character test.)
+    CBCanonicalJSON* encoder = [[CBCanonicalJSON alloc] initWithObject:
+                                    @{@"éa": @1, @"éb": @2, @"a": @3, @"_x": @4, @"ǩ": @5}];
+    encoder.ignoreKeyPrefixes = @[@"é"];
+    encoder.whitelistedKeys = @[@"éb"];
+    XCTAssertEqualObjects(encoder.canonicalString, @"{\"_x\":4,\"a\":3,\"éb\":2,\"ǩ\":5}");
+}
+
+- (void)testBLAKE2bSignedJSON {
+    NSDictionary* json = @{@"foo": @1234, @"bar": @[@"hi", @"th\"ere"], @"_id": @"doc"};
+    NSDictionary* signature = [privateKey signatureOfJSON: json
+                                               digestType: kCBSignedJSONDigestBLAKE2b
+                                             expiresAfter: 60*60];
+    XCTAssertNil(signature[@"digest_SHA"]);
+    NSData* digest = [[NSData alloc] initWithBase64EncodedString: signature[@"digest_blake2b"]
+                                                         options: 0];
+    XCTAssertEqual(digest.length, 32u);
+    XCTAssert([privateKey.publicKey verifySignature: signature ofJSON: json error: NULL]);
+
+    NSError* error;
+    NSMutableDictionary* tampered = [json mutableCopy];
+    tampered[@"foo"] = @1235;
+    XCTAssertFalse([privateKey.publicKey verifySignature: signature ofJSON: tampered error: &error]);
+    XCTAssertEqual(error.code, kCBSignedJSONErrorIncorrectDigest);
+
+    // Signed JSON data:
+    NSMutableDictionary* signedJSON = [json mutableCopy];
+    signedJSON[kCBJSONSignatureProperty] = signature;
+    NSData* data = [NSJSONSerialization dataWithJSONObject: signedJSON options: 0 error: NULL];
+    XCTAssertEqualObjects([CBVerifyingPublicKey signerOfJSONData: data error: &error],
+                          privateKey.publicKey);
+    tampered[kCBJSONSignatureProperty] = signature;
+    data = [NSJSONSerialization dataWithJSONObject: tampered options: 0 error: NULL];
+    XCTAssertNil([CBVerifyingPublicKey signerOfJSONData: data error: &error]);
+    XCTAssertEqual(error.code, kCBSignedJSONErrorIncorrectDigest);
+}
+
+- (void)testCanonicalVersion2SignedJSON {
+    NSDictionary* json = @{@"path": @"C:\\temp\n", @"ratio": @0.1, @"_id": @"doc"};
+    NSDictionary* signature = [privateKey signatureOfJSON: json
+                                               digestType: kCBSignedJSONDigestSHA1
+                                         canonicalVersion: kCBCanonicalJSONVersion2
+                                             expiresAfter: 60*60];
+    XCTAssertEqualObjects(signature[@"canonical"], @2);
+    XCTAssert([privateKey.publicKey verifySignature: signature ofJSON: json error: NULL]);
+
+    // A version 1 signature of the same object is different, and also verifies:
+    NSDictionary* v1Signature = [privateKey signatureOfJSON: json expiresAfter: 60*60];
+    XCTAssertNil(v1Signature[@"canonical"]);
+    XCTAssertNotEqualObjects(v1Signature[@"digest_SHA"], signature[@"digest_SHA"]);
+    XCTAssert([privateKey.publicKey verifySignature: v1Signature ofJSON: json error: NULL]);
+
+    NSMutableDictionary* signedJSON = [json mutableCopy];
+    signedJSON[kCBJSONSignatureProperty] = signature;
+    NSData* data = [NSJSONSerialization dataWithJSONObject: signedJSON options: 0 error: NULL];
+    XCTAssertEqualObjects([CBVerifyingPublicKey signerOfJSONData: data error: NULL],
+                          privateKey.publicKey);
+}
+
+- (void)testMerkleSignedJSON {
+    NSMutableDictionary* json = [NSMutableDictionary dictionary];
+    for (int i = 0; i < 100; i++)
+        json[[NSString stringWithFormat: @"key%d", i]] = @{@"n": @(i), @"list": @[@"a", @(i)]};
+    json[@"_id"] = @"doc";
+    json[@"_rev"] = @"1-abcd";
+
+    CBJSONMerkleTree* tree = [[CBJSONMerkleTree alloc] init];
+    NSDictionary* signature = [privateKey signatureOfJSON: json merkleTree: tree expiresAfter: 0];
+    XCTAssert(signature[@"digest_merkle"]);
+    XCTAssertNil(signature[@"digest_SHA"]);
+    XCTAssertEqual(tree.valuesHashed, 1 + 1 + 100*5u);
+    XCTAssert([privateKey.publicKey verifySignature: signature ofJSON: json error: NULL]);
+
+    // Ignored keys and key order don't affect the digest, but values do:
+    NSData* digest = tree.digest;
+    XCTAssertEqual(digest.length, 32u);
+    NSMutableDictionary* other = [json mutableCopy];
+    [other removeObjectForKey: @"_rev"];
+    XCTAssertEqualObjects([[[CBJSONMerkleTree alloc] init] digestOfJSON: other], digest);
+    other[@"key7"] = @{@"n": @7, @"list": @[@"a", @8]};
+    XCTAssertNotEqualObjects([[[CBJSONMerkleTree alloc] init] digestOfJSON: other], digest);
+
+    // Re-signing after a change only rehashes the changed path:
+    json[@"key42"] = @{@"n": @1042, @"list": @[@"b", @"c"]};
+    signature = [privateKey signatureOfJSON: json merkleTree: tree expiresAfter: 0];
+    XCTAssertEqual(tree.valuesHashed, 1 + 5u);
+    XCTAssertEqualObjects(tree.digest, [[[CBJSONMerkleTree alloc] init] digestOfJSON: json]);
+    NSError* error;
+    XCTAssert([privateKey.publicKey verifySignature: signature ofJSON: json error: &error]);
+    json[@"key43"] = @0;
+    XCTAssertFalse([privateKey.publicKey verifySignature: signature ofJSON: json error: &error]);
+    XCTAssertEqual(error.code, kCBSignedJSONErrorIncorrectDigest);
+    [json removeObjectForKey: @"key43"];
+
+    // An immutable container is rescanned if something mutable inside it was changed:
+    NSMutableArray* list = [NSMutableArray arrayWithObject: @"x"];
+    NSDictionary* doc = @{@"list": list};
+    CBJSONMerkleTree* docTree = [[CBJSONMerkleTree alloc] init];
+    NSData* docDigest = [docTree digestOfJSON: doc];
+    [list addObject: @"y"];
+    XCTAssertNotEqualObjects([docTree digestOfJSON: doc], docDigest);
+    XCTAssertEqualObjects(docTree.digest, [[[CBJSONMerkleTree alloc] init] digestOfJSON: doc]);
+
+    // Verify single values with proofs:
+    for (NSArray* keyPath in @[@[@"key42", @"list", @0], @[@"key99"], @[@"_id"], @[]]) {
+        NSArray* proof = [tree proofForKeyPath: keyPath];
+        XCTAssertNotNil(proof);
+        // Send the proof through JSON to check that it's JSON-compatible:
+        NSData* proofData = [NSJSONSerialization dataWithJSONObject: proof options: 0 error: NULL];
+        proof = [NSJSONSerialization JSONObjectWithData: proofData options: 0 error: NULL];
+        id value = json;
+        for (id component in keyPath)
+            value = value[component];
+        XCTAssert([privateKey.publicKey verifySignature: signature ofValue: value
+                                              atKeyPath: keyPath proof: proof error: &error],
+                  @"%@: %@", keyPath, error);
+        if (keyPath.count > 0) {
+            XCTAssertFalse([privateKey.publicKey verifySignature: signature ofValue: @"bogus"
+                                                       atKeyPath: keyPath proof: proof
+                                                           error: &error]);
+            XCTAssertEqual(error.code, kCBSignedJSONErrorIncorrectDigest);
+        }
+    }
+    XCTAssertNil([tree proofForKeyPath: @[@"_rev"]]);
+    XCTAssertNil([tree proofForKeyPath: @[@"key42", @"list", @2]]);
+
+    // Proofs with counts or indexes that aren't small non-negative integers are rejected:
+    NSDictionary* step = [tree proofForKeyPath: @[@"key99"]][0];
+    for (NSDictionary* change in @[@{@"count": @1e30}, @{@"count": @2.5},
+                                   @{@"count": @(UINT64_MAX)}, @{@"index": @(-1)},
+                                   @{@"index": @0.5}, @{@"count": @"3"}]) {
+        NSMutableDictionary* badStep = [step mutableCopy];
+        [badStep addEntriesFromDictionary: change];
+        XCTAssertNil([CBJSONMerkleTree digestOfValue: json[@"key99"] atKeyPath: @[@"key99"]
+                                               proof: @[badStep]], @"%@", change);
+    }
+
+    // Signed JSON data with a Merkle signature:
+    NSMutableDictionary* signedJSON = [json mutableCopy];
+    signedJSON[kCBJSONSignatureProperty] = signature;
+    NSData* data = [NSJSONSerialization dataWithJSONObject: signedJSON options: 0 error: NULL];
+    XCTAssert([privateKey.publicKey verifySignedJSONData: data error: &error], @"%@", error);
+}
+
+- (void)testSignatureCache {
+    CBSignatureCache* cache = [[CBSignatureCache alloc] initWithCapacity: 2];
+    [CBVerifyingPublicKey setSignatureCache: cache];
+    CBVerifyingPublicKey* publicKey = privateKey.publicKey;
+
+    NSDictionary* json1 = @{@"n": @1}, *json2 = @{@"n": @2}, *json3 = @{@"n": @3};
+    NSDictionary* sig1 = [privateKey signatureOfJSON: json1 expiresAfter: 0];
+    NSDictionary* sig2 = [privateKey signatureOfJSON: json2 expiresAfter: 0];
+    NSDictionary* sig3 = [privateKey signatureOfJSON: json3 expiresAfter: 0];
+    XCTAssert([publicKey verifySignature: sig1 ofJSON: json1 error: NULL]);
+    XCTAssert([publicKey verifySignature: sig1 ofJSON: json1 error: NULL]);
+    XCTAssertEqual(cache.misses, 1u);
+    XCTAssertEqual(cache.hits, 1u);
+
+    // A wrong document never reaches the cache:
+    XCTAssertFalse([publicKey verifySignature: sig1 ofJSON: json2 error: NULL]);
+    XCTAssertEqual(cache.hits + cache.misses, 2u);
+
+    // Changing a signed property of the signature is a miss, and fails verification:
+    NSMutableDictionary* forged = [sig1 mutableCopy];
+    forged[@"expires"] = @1000000;
+    NSError* error;
+    XCTAssertFalse([publicKey verifySignature: forged ofJSON: json1 error: &error]);
+    XCTAssertEqual(error.code, kCBSignedJSONErrorInvalidSignature);
+    XCTAssertEqual(cache.misses, 2u);
+
+    // Least recently used entries are evicted:
+    XCTAssert([publicKey verifySignature: sig2 ofJSON: json2 error: NULL]);
+    XCTAssert([publicKey verifySignature: sig1 ofJSON: json1 error: NULL]);   // hit
+    XCTAssert([publicKey verifySignature: sig3 ofJSON: json3 error: NULL]);   // evicts sig2
+    XCTAssertEqual(cache.count, 2u);
+    XCTAssertEqual(cache.hits, 2u);
+    XCTAssert([publicKey verifySignature: sig1 ofJSON: json1 error: NULL]);
+    XCTAssertEqual(cache.hits, 3u);
+    XCTAssert([publicKey verifySignature: sig2 ofJSON: json2 error: NULL]);
+    XCTAssertEqual(cache.hits, 3u);
+    XCTAssertEqual(cache.misses, 5u);
+
+    [cache removeAll];
+    XCTAssertEqual(cache.count, 0u);
+    XCTAssertEqual(cache.hits + cache.misses, 0u);
+    [CBVerifyingPublicKey setSignatureCache: nil];
+}
+
+- (void)testISO8601 {
+    NSDateFormatter* fmt = [[NSDateFormatter alloc] init];
+    fmt.dateFormat = @"yyyy-MM-dd'T'HH:mm:ssXXX";
+    fmt.calendar = [[NSCalendar alloc] initWithCalendarIdentifier:NSCalendarIdentifierGregorian];
+    fmt.locale = [[NSLocale alloc] initWithLocaleIdentifier:@"en_US"];
+    fmt.timeZone = [NSTimeZone timeZoneForSecondsFromGMT:0];
+
+    // Every day from 1900 to 2200 (after the Julian-Gregorian cutover, where NSDateFormatter's
+    // calendar and our proleptic one agree), at a different time of day each:
+    char buf[kCBISO8601Length + 1];
+    int64_t start = -2208988800, end = 7258118400;
+    uint64_t n = 0;
+    for (int64_t t = start; t < end; t += 86400, ++n) {
+        int64_t time = t + (int64_t)((n * 7919) % 86400);
+        size_t length = CBISO8601Format(time, buf);
+        XCTAssertEqual(length, (size_t)kCBISO8601Length);
+        NSString* str = @(buf);
+        NSDate* date = [NSDate dateWithTimeIntervalSince1970: time];
+        XCTAssertEqualObjects(str, [fmt stringFromDate: date]);
+        int64_t parsed;
+        XCTAssert(CBISO8601Parse(buf, length, &parsed));
+        XCTAssertEqual(parsed, time);
+        if (parsed != time || ![str isEqualToString: [fmt stringFromDate: date]])
+            break;
+    }
+
+    // Time zone offsets:
+    for (NSString* str in @[@"2015-06-28T17:05:09+05:30", @"2015-06-28T17:05:09-08:00",
+                            @"2016-02-29T23:59:59+00:00", @"1999-12-31T23:59:59-14:00"]) {
+        int64_t parsed;
+        XCTAssert(CBISO8601Parse(str.UTF8String, str.length, &parsed), @"%@", str);
+        XCTAssertEqual(parsed, (int64_t)[fmt dateFromString: str].timeIntervalSince1970, @"%@", str);
+    }
+
+    // Invalid timestamps:
+    for (NSString* str in @[@"", @"2015-06-28", @"2015-06-28T17:05:09", @"2015-06-28 17:05:09Z",
+                            @"2015-02-29T00:00:00Z", @"2015-13-01T00:00:00Z",
+                            @"2015-06-28T24:00:00Z", @"2015-06-28T17:60:00Z",
+                            @"2015-06-28T17:05:09+0530", @"2015-06-28T17:05:09Zjunk",
+                            @"2015-06-28T17:05:0xZ"]) {
+        int64_t parsed;
+        XCTAssertFalse(CBISO8601Parse(str.UTF8String, str.length, &parsed), @"%@", str);
+    }
+
+    // Signature dates round-trip:
+    NSDictionary* signature = [privateKey signatureOfJSON: @{} expiresAfter: 0];
+    NSDate* date = [CBVerifyingPublicKey dateOfSignature: signature];
+    XCTAssertEqualObjects([fmt stringFromDate: date], signature[@"date"]);
+}
+
 @end
@@ -10,7 +10,9 @@
 #import <XCTest/XCTest.h>
 #import "CBKey+Private.h"
 #import "CBSymmetricKey.h"
+#import "CBSymmetricKey+Streaming.h"
 #import "CBKeyBag.h"
+#import <stdatomic.h>
 
 
 @interface CBKeyBag (Private)
@@ -62,13 +64,138 @@
     XCTAssertEqualObjects(decrypted, clear);
 }
 
+- (void) testEncryptInPlace {
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    CBNonce nonce = {{0x01, 0x02, 0x03}}; // rest all zeroes
+    uint8_t cipher[clear.length + kCBEncryptionOverhead];
+    [alice encryptBytes: clear.bytes length: clear.length withNonce: nonce into: cipher];
+    XCTAssertEqualObjects([NSData dataWithBytes: cipher length: sizeof(cipher)],
+                          [alice encrypt: clear withNonce: nonce]);
+    uint8_t decrypted[clear.length];
+    XCTAssert([alice decryptBytes: cipher length: sizeof(cipher) withNonce: nonce into: decrypted]);
+    XCTAssertEqualObjects([NSData dataWithBytes: decrypted length: sizeof(decrypted)], clear);
+    cipher[3] ^= 0x01;
+    XCTAssertFalse([alice decryptBytes: cipher length: sizeof(cipher) withNonce: nonce into: decrypted]);
+
+    // Append a couple of messages to the same buffer, then decrypt them into another buffer:
+    NSMutableData* output = [NSMutableData dataWithBytes: "HDR" length: 3];
+    [alice encryptWithClue: clear appendTo: output];
+    XCTAssertEqual(output.length, 3 + 2 + sizeof(CBNonce) + clear.length + kCBEncryptionOverhead);
+    NSData* message = [output subdataWithRange: NSMakeRange(3, output.length - 3)];
+    NSMutableData* result = [NSMutableData data];
+    XCTAssert([alice decryptWithClue: message appendTo: result]);
+    XCTAssert([alice decryptWithClue: message appendTo: result]);
+    XCTAssertEqual(result.length, 2 * clear.length);
+    XCTAssertEqualObjects([result subdataWithRange: NSMakeRange(clear.length, clear.length)], clear);
+
+    CBSymmetricKey* bob = [CBSymmetricKey generate];
+    XCTAssertFalse([bob decrypt: [alice encrypt: clear] appendTo: result]);
+    XCTAssertEqual(result.length, 2 * clear.length);
+}
+
+- (void) testAssociatedData {
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    NSData* header = [@"doc-1234/5-abcdef" dataUsingEncoding: NSUTF8StringEncoding];
+    NSData* cipher = [alice encrypt: clear associatedData: header];
+    XCTAssertEqual(cipher.length, 1 + sizeof(CBNonce) + clear.length + kCBEncryptionOverhead);
+    XCTAssertEqualObjects([alice decrypt: cipher associatedData: header], clear);
+
+    // Wrong associated data, or none, or the wrong key:
+    NSData* otherHeader = [@"doc-1234/6-abcdef" dataUsingEncoding: NSUTF8StringEncoding];
+    XCTAssertNil([alice decrypt: cipher associatedData: otherHeader]);
+    XCTAssertNil([alice decrypt: cipher associatedData: nil]);
+    XCTAssertNil([[CBSymmetricKey generate] decrypt: cipher associatedData: header]);
+
+    // No associated data:
+    cipher = [alice encrypt: clear associatedData: nil];
+    XCTAssertEqualObjects([alice decrypt: cipher associatedData: nil], clear);
+
+    // Data encrypted in the older format can still be decrypted, but can't authenticate a header:
+    cipher = [alice encrypt: clear];
+    XCTAssertEqualObjects([alice decrypt: cipher associatedData: nil], clear);
+    XCTAssertNil([alice decrypt: cipher associatedData: header]);
+}
+
+- (void) testKeyedClue {
+    CBClueKey clueKey = [CBSymmetricKey randomClueKey];
+    CBKeyedClue clue = [alice keyedClueWithClueKey: clueKey];
+    XCTAssertEqual([alice keyedClueWithClueKey: clueKey], clue);
+    XCTAssertNotEqual([alice keyedClueWithClueKey: [CBSymmetricKey randomClueKey]], clue);
+
+    NSData* clear = [@"this is the cleartext message right here!" dataUsingEncoding: NSUTF8StringEncoding];
+    NSData* cipher = [alice encrypt: clear withClueKey: clueKey];
+    CBKeyedClue readClue;
+    XCTAssert([CBSymmetricKey getKeyedClue: &readClue forEncryptedData: cipher]);
+    XCTAssertEqual(readClue, clue);
+    XCTAssertEqualObjects([alice decrypt: cipher withClueKey: clueKey], clear);
+    XCTAssertNil([[CBSymmetricKey generate] decrypt: cipher withClueKey: clueKey]);
+}
+
+
+static NSData* randomData(size_t length) {
+    NSMutableData* data = [NSMutableData dataWithLength: length];
+    SecRandomCopyBytes(kSecRandomDefault, length, data.mutableBytes);
+    return data;
+}
+
+- (NSData*) streamEncrypt: (NSData*)input {
+    NSOutputStream* output = [NSOutputStream outputStreamToMemory];
+    NSError* error;
+    XCTAssert([alice encryptStream: [NSInputStream inputStreamWithData: input]
+                          toStream: output error: &error], @"Encrypt failed: %@", error);
+    return [output propertyForKey: NSStreamDataWrittenToMemoryStreamKey];
+}
+
+- (NSData*) streamDecrypt: (NSData*)input error: (NSError**)outError {
+    NSOutputStream* output = [NSOutputStream outputStreamToMemory];
+    if (![alice decryptStream: [NSInputStream inputStreamWithData: input]
+                     toStream: output error: outError])
+        return nil;
+    return [output propertyForKey: NSStreamDataWrittenToMemoryStreamKey];
+}
+
+- (void) testStreaming {
+    const size_t sizes[] = {0, 1, 1000, kCBStreamChunkSize - 1, kCBStreamChunkSize,
+                            kCBStreamChunkSize + 1, 3*kCBStreamChunkSize + 5};
+    for (int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+        NSData* clear = randomData(sizes[i]);
+        NSData* cipher = [self streamEncrypt: clear];
+        XCTAssertNotNil(cipher);
+        NSError* error;
+        NSData* decrypted = [self streamDecrypt: cipher error: &error];
+        XCTAssertEqualObjects(decrypted, clear, @"Failed for size %zu: %@", sizes[i], error);
+    }
+}
+
+- (void) testStreamingTruncation {
+    NSData* clear = randomData(2*kCBStreamChunkSize + 100);
+    NSData* cipher = [self streamEncrypt: clear];
+    NSError* error;
+
+    // Chop off part of the last chunk:
+    NSData* truncated = [cipher subdataWithRange: NSMakeRange(0, cipher.length - 10)];
+    XCTAssertNil([self streamDecrypt: truncated error: &error]);
+    XCTAssertEqualObjects(error.domain, CBKeyErrorDomain);
+
+    // Chop off the entire last chunk, leaving only full chunks:
+    truncated = [cipher subdataWithRange: NSMakeRange(0, cipher.length - (100 + 16))];
+    XCTAssertNil([self streamDecrypt: truncated error: &error]);
+    XCTAssertEqualObjects(error.domain, CBKeyErrorDomain);
+
+    // Flip a bit:
+    NSMutableData* corrupted = [cipher mutableCopy];
+    ((uint8_t*)corrupted.mutableBytes)[corrupted.length / 2] ^= 0x10;
+    XCTAssertNil([self streamDecrypt: corrupted error: &error]);
+    XCTAssertEqualObjects(error.domain, CBKeyErrorDomain);
+    XCTAssertEqual(error.code, kCBKeyErrorDecryptionFailed);
+}
 
 
 - (void) testKeyBag {
     [CBPrivateKey useTestKeychain];
 
-    [[NSFileManager defaultManager] removeItemAtPath: [CBKeyBag pathForIdentifier: @"UnitTests"]
-                                               error: nil];
+    NSString* path = [CBKeyBag pathForIdentifier: @"UnitTests"];
+    [self deleteKeyBagAt: path];
     NSError* error;
     CBKeyBag* bag = [CBKeyBag keyBagWithIdentifier: @"UnitTests" error: &error];
     XCTAssertNotNil(bag, @"Couldn't create CBKeyBag: %@", error);
@@ -102,7 +229,164 @@
     XCTAssertEqualObjects(decrypted, cleartext);
     XCTAssertEqualObjects(usedKey, key1);
 
-    [[NSFileManager defaultManager] removeItemAtPath: bag.path error: NULL];
+    // Keyed clues:
+    encrypted = [bag encrypt: cleartext withKey: key2];
+    decrypted = [bag decrypt: encrypted usedKey: &usedKey];
+    XCTAssertEqualObjects(decrypted, cleartext);
+    XCTAssertEqualObjects(usedKey, key2);
+
+    // Add a key to the saved bag, then save and reopen again:
+    CBSymmetricKey* key3 = [[CBSymmetricKey alloc] init];
+    XCTAssertFalse([bag addKey: key1]);
+    [bag addKey: key3 identifier: @"key3"];
+    [bag addKey: key1 identifier: @"key2"];
+    XCTAssert([bag save: &error], @"Save failed: %@", error);
+    bag = [CBKeyBag keyBagWithIdentifier: @"UnitTests" error: &error];
+    XCTAssertNotNil(bag, @"Couldn't reopen CBKeyBag: %@", error);
+    XCTAssertEqualObjects([NSSet setWithArray: bag.allIdentifiers],
+                          ([NSSet setWithObjects: @"key1", @"key2", @"key3", nil]));
+    XCTAssertEqualObjects([bag keyWithIdentifier: @"key2"], key1);
+    XCTAssertEqualObjects([bag keyWithIdentifier: @"key3"], key3);
+    decrypted = [bag decrypt: [bag encrypt: cleartext withKey: key3] usedKey: &usedKey];
+    XCTAssertEqualObjects(decrypted, cleartext);
+    XCTAssertEqualObjects(usedKey, key3);
+    XCTAssertEqualObjects([bag decrypt: encrypted], cleartext);
+
+    [self deleteKeyBagAt: path];
+}
+
+
+- (void) testKeyBagConcurrency {
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"threads.keybag"];
+    [self deleteKeyBagAt: path];
+    NSError* error;
+    CBKeyBag* bag = [CBKeyBag keyBagWithPath: path masterKey: [[CBSymmetricKey alloc] init]
+                                       error: &error];
+    XCTAssertNotNil(bag, @"Couldn't create CBKeyBag: %@", error);
+
+    NSData* cleartext = [@"ATTACK AT DAWN" dataUsingEncoding: NSUTF8StringEncoding];
+    NSMutableArray* messages = [NSMutableArray array];
+    // Enough keys to start a background compaction, which the -compact: below has to wait for:
+    for (int i = 0; i < 300; i++) {
+        CBSymmetricKey* key = [[CBSymmetricKey alloc] init];
+        [bag addKey: key];
+        [messages addObject: (i % 2) ? [bag encrypt: cleartext withKey: key]
+                                     : [key encryptWithClue: cleartext]];
+    }
+    XCTAssert([bag compact: &error], @"Compact failed: %@", error);
+
+    // Decrypt on many threads while another thread adds keys:
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_group_async(group, queue, ^{
+        for (int i = 0; i < 500; i++)
+            [bag addKey: [[CBSymmetricKey alloc] init] identifier: @"latest"];
+    });
+    __block atomic_int failures = 0;
+    dispatch_apply(messages.count * 20, queue, ^(size_t i) {
+        if (![[bag decrypt: messages[i % messages.count]] isEqual: cleartext])
+            atomic_fetch_add(&failures, 1);
+    });
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    XCTAssertEqual(atomic_load(&failures), 0);
+    XCTAssertNotNil([bag keyWithIdentifier: @"latest"]);
+
+    XCTAssert([bag save: &error], @"Save failed: %@", error);
+    [self deleteKeyBagAt: path];
+}
+
+
+- (void) deleteKeyBagAt: (NSString*)path {
+    [[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+    [[NSFileManager defaultManager] removeItemAtPath: [path stringByAppendingPathExtension:
+                                                                                    @"journal"]
+                                               error: NULL];
+}
+
+
+- (void) testKeyBagUpgrade {
+    // Write a KeyBag in the older NSKeyedArchiver-based format:
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"upgrade.keybag"];
+    NSString* scratchPath = [NSTemporaryDirectory() stringByAppendingPathComponent: @"old.keybag"];
+    CBSymmetricKey* masterKey = [[CBSymmetricKey alloc] init];
+    CBKeyBag* bag = [[CBKeyBag alloc] initNewWithPath: scratchPath masterKey: masterKey];
+    CBSymmetricKey* key1 = [[CBSymmetricKey alloc] init];
+    [bag addKey: key1 identifier: @"key1"];
+    NSData* archive = [masterKey encrypt: [NSKeyedArchiver archivedDataWithRootObject: bag]];
+    XCTAssert([archive writeToFile: path atomically: YES]);
+    XCTAssert([bag save: NULL]);
+    [self deleteKeyBagAt: scratchPath];
+
+    NSData* cleartext = [@"ATTACK AT DAWN" dataUsingEncoding: NSUTF8StringEncoding];
+    NSData* encrypted = [key1 encryptWithClue: cleartext];
+
+    NSError* error;
+    bag = [CBKeyBag keyBagWithPath: path masterKey: masterKey error: &error];
+    XCTAssertNotNil(bag, @"Couldn't upgrade CBKeyBag: %@", error);
+    XCTAssertEqualObjects([bag keyWithIdentifier: @"key1"], key1);
+    XCTAssertEqualObjects([bag decrypt: encrypted], cleartext);
+
+    // Now it should open in the new format:
+    bag = [CBKeyBag keyBagWithPath: path masterKey: masterKey error: &error];
+    XCTAssertNotNil(bag, @"Couldn't reopen CBKeyBag: %@", error);
+    XCTAssertEqualObjects([bag keyWithIdentifier: @"key1"], key1);
+    XCTAssertEqualObjects([bag decrypt: encrypted], cleartext);
+
+    // The wrong master key can't open it:
+    XCTAssertNil([CBKeyBag keyBagWithPath: path masterKey: [[CBSymmetricKey alloc] init]
+                                    error: &error]);
+    XCTAssertEqual(error.code, kCBKeyErrorDecryptionFailed);
+
+    [self deleteKeyBagAt: path];
+}
+
+
+- (void) testKeyBagJournal {
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"journal.keybag"];
+    NSString* journalPath = [path stringByAppendingPathExtension: @"journal"];
+    [self deleteKeyBagAt: path];
+    CBSymmetricKey* masterKey = [[CBSymmetricKey alloc] init];
+    NSError* error;
+    CBKeyBag* bag = [CBKeyBag keyBagWithPath: path masterKey: masterKey error: &error];
+    XCTAssertNotNil(bag, @"Couldn't create CBKeyBag: %@", error);
+    NSData* fileContents = [NSData dataWithContentsOfFile: path];
+
+    // Changes go to the journal, not the file:
+    NSMutableArray* keys = [NSMutableArray array];
+    for (int i = 0; i < 10; i++) {
+        CBSymmetricKey* key = [[CBSymmetricKey alloc] init];
+        [bag addKey: key identifier: [NSString stringWithFormat: @"key%d", i]];
+        [keys addObject: key];
+    }
+    XCTAssert([bag save: &error], @"Save failed: %@", error);
+    XCTAssertEqualObjects([NSData dataWithContentsOfFile: path], fileContents);
+    XCTAssert([[NSFileManager defaultManager] fileExistsAtPath: journalPath]);
+
+    // Simulate a crash in mid-write by appending garbage to the journal:
+    NSFileHandle* journal = [NSFileHandle fileHandleForWritingAtPath: journalPath];
+    [journal seekToEndOfFile];
+    const uint8_t torn[] = {0, 0, 0, 64, 't', 'o', 'r', 'n'};
+    [journal writeData: [NSData dataWithBytes: torn length: sizeof(torn)]];
+    [journal closeFile];
+
+    bag = [CBKeyBag keyBagWithPath: path masterKey: masterKey error: &error];
+    XCTAssertNotNil(bag, @"Couldn't reopen CBKeyBag: %@", error);
+    for (int i = 0; i < 10; i++)
+        XCTAssertEqualObjects([bag keyWithIdentifier: [NSString stringWithFormat: @"key%d", i]],
+                              keys[i]);
+
+    // Adding to the replayed journal works, and compaction moves everything into the file:
+    CBSymmetricKey* key = [[CBSymmetricKey alloc] init];
+    [bag addKey: key identifier: @"key0"];
+    XCTAssert([bag compact: &error], @"Compact failed: %@", error);
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath: journalPath]);
+    bag = [CBKeyBag keyBagWithPath: path masterKey: masterKey error: &error];
+    XCTAssertNotNil(bag, @"Couldn't reopen CBKeyBag: %@", error);
+    XCTAssertEqualObjects([bag keyWithIdentifier: @"key0"], key);
+    XCTAssertEqualObjects([bag keyWithIdentifier: @"key9"], keys[9]);
+    XCTAssertEqual(bag.allIdentifiers.count, 10u);
+
+    [self deleteKeyBagAt: path];
 }
 
 